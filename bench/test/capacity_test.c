@@ -0,0 +1,91 @@
+/*
+ * Checks that the default mapping fills each node up to its own number of
+ * CPUs, on a simulated 4-node machine whose nodes have 8, 2, 0 (memory-only)
+ * & 4 processors, e.g. because of offlined CPUs or a cpuset.
+ *
+ * Usage: ./capacity_test
+ */
+
+#include "test_util.h"
+
+#define NODES 4
+
+static const unsigned node_cpus[NODES] = { 8, 2, 0, 4 };
+
+static omp_numa_t* ipc_handle;
+
+/* Map an application after adding num_apps other (empty) applications and
+ * check which nodes it was mapped to
+ */
+static void check_mapping(unsigned num_apps,
+													exec_spec_t* occupied,
+													const unsigned* expected)
+{
+	exec_spec_t others[NODES];
+	exec_spec_t* setup;
+	unsigned i;
+
+	for(i = 0; i < num_apps; i++)
+	{
+		others[i].num_tasks = 0;
+		for(numa_node_t node = 0; node < NODES; node++)
+			others[i].task_assignment[node] = 0;
+		omp_numa_map_tasks(ipc_handle, &others[i], 0);
+	}
+	if(occupied)
+		omp_numa_map_tasks(ipc_handle, occupied, 0);
+
+	setup = omp_numa_map_tasks(ipc_handle, NULL, 0);
+	for(i = 0; i < NODES; i++)
+		printf("%u ", setup->task_assignment[i]);
+	for(i = 0; i < NODES; i++)
+		assert(setup->task_assignment[i] == expected[i]);
+	printf("passed!\n");
+
+	omp_numa_cleanup(ipc_handle, setup);
+	free(setup);
+	if(occupied)
+		omp_numa_cleanup(ipc_handle, occupied);
+	for(i = 0; i < num_apps; i++)
+		omp_numa_cleanup(ipc_handle, &others[i]);
+}
+
+int main(int argc, char** argv)
+{
+	test_start();
+	ipc_handle = test_app();
+
+	omp_numa_simulate_topology(ipc_handle, NODES, 1, NULL);
+	omp_numa_simulate_node_cpus(ipc_handle, node_cpus);
+
+	printf("Checking the CPU inventory...");
+	assert(omp_numa_num_procs() == 14);
+	assert(omp_numa_num_procs_per_node() == 8);
+	for(numa_node_t i = 0; i < NODES; i++)
+		assert(omp_numa_node_num_cpus(i) == node_cpus[i]);
+	printf("passed!\n");
+
+	// A lone application gets every CPU, & nothing on the memory-only node
+	printf("Checking a lone application fills every node...");
+	const unsigned alone[NODES] = { 8, 2, 0, 4 };
+	check_mapping(0, NULL, alone);
+
+	printf("Checking a half share fits on the large node...");
+	const unsigned half[NODES] = { 7, 0, 0, 0 };
+	check_mapping(1, NULL, half);
+
+	printf("Checking spillover around the occupied large node...");
+	exec_spec_t large = { 8, { 8, 0, 0, 0 } };
+	const unsigned spill[NODES] = { 1, 2, 0, 4 };
+	check_mapping(0, &large, spill);
+
+	// Oversubscribe the nodes with the fewest tasks per CPU first - 12 tasks on
+	// the 8-CPU node is less crowded than 4 tasks on the 2-CPU node
+	printf("Checking oversubscription follows node sizes...");
+	exec_spec_t full = { 18, { 12, 2, 0, 4 } };
+	const unsigned oversubscribed[NODES] = { 1, 2, 0, 4 };
+	check_mapping(0, &full, oversubscribed);
+
+	test_finish();
+	return 0;
+}
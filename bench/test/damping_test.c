@@ -0,0 +1,103 @@
+/*
+ * Checks that damping keeps an application's number of tasks stable while
+ * neighbours come & go, on a simulated single node with 8 processors.
+ *
+ * Usage: ./damping_test
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include "test_util.h"
+
+#define DELAY_MS 200
+
+static omp_numa_t* neighbour;
+
+/* Initialize an application with a damping setting */
+static omp_numa_t* damped_app(const char* name, const char* value)
+{
+	omp_numa_t* handle;
+
+	setenv(name, value, 1);
+	handle = test_app();
+	unsetenv(name);
+	return handle;
+}
+
+/* Map & clean up an application while num_neighbours other (empty)
+ * applications are mapped, returning its number of tasks
+ */
+static unsigned map_with_neighbours(omp_numa_t* handle, unsigned num_neighbours)
+{
+	exec_spec_t others[4], setup, *mapped;
+	unsigned i, num_tasks;
+
+	for(i = 0; i < num_neighbours; i++)
+	{
+		others[i].num_tasks = 0;
+		others[i].task_assignment[0] = 0;
+		omp_numa_map_tasks(neighbour, &others[i], 0);
+	}
+
+	mapped = omp_numa_map_tasks_into(handle, &setup, 0);
+	num_tasks = mapped->num_tasks;
+	printf("%u ", num_tasks);
+	omp_numa_cleanup(handle, mapped);
+
+	for(i = 0; i < num_neighbours; i++)
+		omp_numa_cleanup(neighbour, &others[i]);
+	return num_tasks;
+}
+
+/* Check an application's resize & damping counters */
+static void check_counters(omp_numa_t* handle,
+													 unsigned slot,
+													 unsigned resizes,
+													 unsigned damped)
+{
+	omp_numa_app_info_t info;
+
+	assert(omp_numa_app_info(handle, slot, &info) == 1);
+	assert(info.resizes == resizes && info.damped == damped);
+	printf("passed!\n");
+}
+
+int main(int argc, char** argv)
+{
+	omp_numa_t *threshold, *shrink, *grow;
+	char delay[16];
+
+	test_start();
+	snprintf(delay, sizeof(delay), "%d", DELAY_MS);
+	neighbour = test_app();
+	threshold = damped_app(OMP_NUMA_DAMP_THRESHOLD, "5");
+	shrink = damped_app(OMP_NUMA_SHRINK_DELAY, delay);
+	grow = damped_app(OMP_NUMA_GROW_INTERVAL, delay);
+	omp_numa_simulate_topology(neighbour, 1, 8, NULL);
+
+	// Halving the share changes 4 tasks, below the threshold, a quarter share
+	// changes 6
+	printf("Checking small changes are ignored...");
+	assert(map_with_neighbours(threshold, 0) == 8);
+	assert(map_with_neighbours(threshold, 1) == 8);
+	assert(map_with_neighbours(threshold, 3) == 2);
+	check_counters(threshold, 1, 1, 1);
+
+	printf("Checking shrinks are deferred...");
+	assert(map_with_neighbours(shrink, 0) == 8);
+	assert(map_with_neighbours(shrink, 1) == 8);
+	usleep(DELAY_MS * 1500);
+	assert(map_with_neighbours(shrink, 1) == 4);
+	check_counters(shrink, 2, 1, 1);
+
+	printf("Checking grows are rate-limited...");
+	assert(map_with_neighbours(grow, 0) == 8);
+	assert(map_with_neighbours(grow, 1) == 4);
+	assert(map_with_neighbours(grow, 0) == 4);
+	usleep(DELAY_MS * 1500);
+	assert(map_with_neighbours(grow, 0) == 8);
+	check_counters(grow, 3, 2, 1);
+
+	test_finish();
+	return 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * Checks that the default mapping spills applications over onto the nodes
+ * closest to the ones already chosen for them, on simulated 8-node machines
+ * with 4 processors per node & irregular (and asymmetric) distance tables.
+ *
+ * Usage: ./distance_test
+ */
+
+#include "test_util.h"
+
+#define NODES 8
+#define PROCS_PER_NODE 4
+
+/* Nodes wired up in a ring in the order 0, 5, 2, 7, 4, 1, 6, 3 - each hop
+ * adds 6 to the distance
+ */
+static const unsigned ring[NODES * NODES] = {
+	10, 28, 22, 16, 34, 16, 22, 28,
+	28, 10, 28, 22, 16, 34, 16, 22,
+	22, 28, 10, 28, 22, 16, 34, 16,
+	16, 22, 28, 10, 28, 22, 16, 34,
+	34, 16, 22, 28, 10, 28, 22, 16,
+	16, 34, 16, 22, 28, 10, 28, 22,
+	22, 16, 34, 16, 22, 28, 10, 28,
+	28, 22, 16, 34, 16, 22, 28, 10,
+};
+
+/* Same as the ring, but node 3 reaches node 0's memory across a slow link */
+static unsigned asym[NODES * NODES];
+
+static omp_numa_t* ipc_handle;
+
+/* Map an application after adding num_apps other (empty) applications and
+ * check which nodes it was mapped to
+ */
+static void check_mapping(unsigned num_apps,
+													exec_spec_t* occupied,
+													const unsigned* expected)
+{
+	exec_spec_t others[NODES];
+	exec_spec_t* setup;
+	unsigned i;
+
+	for(i = 0; i < num_apps; i++)
+	{
+		others[i].num_tasks = 0;
+		for(numa_node_t node = 0; node < NODES; node++)
+			others[i].task_assignment[node] = 0;
+		omp_numa_map_tasks(ipc_handle, &others[i], 0);
+	}
+	if(occupied)
+		omp_numa_map_tasks(ipc_handle, occupied, 0);
+
+	setup = omp_numa_map_tasks(ipc_handle, NULL, 0);
+	for(i = 0; i < NODES; i++)
+		printf("%u ", setup->task_assignment[i]);
+	for(i = 0; i < NODES; i++)
+		assert(setup->task_assignment[i] == expected[i]);
+	printf("passed!\n");
+
+	omp_numa_cleanup(ipc_handle, setup);
+	free(setup);
+	if(occupied)
+		omp_numa_cleanup(ipc_handle, occupied);
+	for(i = 0; i < num_apps; i++)
+		omp_numa_cleanup(ipc_handle, &others[i]);
+}
+
+int main(int argc, char** argv)
+{
+	omp_numa_t* shepherd = test_start();
+	ipc_handle = test_app();
+
+	// Uniform distances - fill nodes in order
+	printf("Checking uniform distances...");
+	omp_numa_simulate_topology(ipc_handle, NODES, PROCS_PER_NODE, NULL);
+	const unsigned uniform_two[NODES] = { 4, 4, 0, 0, 0, 0, 0, 0 };
+	check_mapping(3, NULL, uniform_two);
+
+	// Ring - spill over onto ring neighbors (ties go to the lowest node)
+	printf("Checking the distance table made it to shared memory...");
+	omp_numa_simulate_topology(ipc_handle, NODES, PROCS_PER_NODE, ring);
+	for(numa_node_t i = 0; i < NODES; i++)
+		for(numa_node_t j = 0; j < NODES; j++)
+			assert(omp_numa_node_distance(shepherd, i, j) == ring[i * NODES + j]);
+	printf("passed!\n");
+
+	printf("Checking two-node spillover on the ring...");
+	const unsigned ring_two[NODES] = { 4, 0, 0, 4, 0, 0, 0, 0 };
+	check_mapping(3, NULL, ring_two);
+
+	printf("Checking three-node spillover on the ring...");
+	const unsigned ring_three[NODES] = { 4, 0, 0, 4, 0, 3, 0, 0 };
+	check_mapping(2, NULL, ring_three);
+
+	printf("Checking spillover around an occupied node...");
+	exec_spec_t occupied = { 4, { 4, 0, 0, 0, 0, 0, 0, 0 } };
+	const unsigned ring_occupied[NODES] = { 0, 4, 0, 0, 4, 0, 0, 0 };
+	check_mapping(2, &occupied, ring_occupied);
+
+	// Asymmetric - the slow 3 -> 0 link makes node 5 the closer neighbor
+	printf("Checking two-node spillover with asymmetric distances...");
+	for(numa_node_t i = 0; i < NODES * NODES; i++)
+		asym[i] = ring[i];
+	asym[3 * NODES + 0] = 40;
+	omp_numa_simulate_topology(ipc_handle, NODES, PROCS_PER_NODE, asym);
+	const unsigned asym_two[NODES] = { 4, 0, 0, 0, 0, 4, 0, 0 };
+	check_mapping(3, NULL, asym_two);
+
+	test_finish();
+	return 0;
+}
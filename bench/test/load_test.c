@@ -0,0 +1,76 @@
+/*
+ * Checks that applications see the system load sampled by the shepherd,
+ * including processes which aren't OpenMP applications, & ignore samples
+ * which are too old.
+ *
+ * Usage: ./load_test
+ */
+
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "test_util.h"
+
+#define MAX_AGE_MS 100
+
+/* Sum of all nodes' busy CPUs in the latest sample */
+static double busy_cpus(omp_numa_t* handle)
+{
+	double busy = 0.0;
+	int node;
+
+	for(node = 0; node < omp_numa_num_nodes(); node++)
+		busy += omp_numa_node_load(handle, node);
+	printf("%.2f ", busy);
+	return busy;
+}
+
+int main(int argc, char** argv)
+{
+	omp_numa_t *shepherd, *app;
+	omp_numa_load_t load;
+	double loadavg[3];
+	FILE* fp;
+	pid_t spinner;
+
+	shepherd = test_start();
+	app = test_app();
+
+	printf("Checking there's no load before the first sample...");
+	assert(!omp_numa_system_load(app, MAX_AGE_MS, &load));
+	printf("passed!\n");
+
+	// Load averages only change every few seconds
+	printf("Checking the sample matches /proc/loadavg...");
+	assert(!omp_numa_sample_load(shepherd));
+	assert(omp_numa_system_load(app, MAX_AGE_MS, &load) == 1);
+	assert((fp = fopen("/proc/loadavg", "r")));
+	assert(fscanf(fp, "%lf %lf %lf", &loadavg[0], &loadavg[1], &loadavg[2]) == 3);
+	fclose(fp);
+	printf("%.2f %.2f %.2f ", load.loadavg[0], load.loadavg[1], load.loadavg[2]);
+	assert(load.threads > 0 && load.age_ns <= MAX_AGE_MS * 1000000ULL);
+	assert(load.loadavg[0] > loadavg[0] - 0.5 &&
+				 load.loadavg[0] < loadavg[0] + 0.5);
+	printf("passed!\n");
+
+	// A process which isn't an OpenMP application keeps (at least) a CPU busy
+	printf("Checking other processes count towards the node load...");
+	if(!(spinner = fork()))
+		while(1);
+	assert(spinner > 0);
+	usleep(500000);
+	assert(!omp_numa_sample_load(shepherd));
+	assert(busy_cpus(app) >= 0.5);
+	kill(spinner, SIGKILL);
+	waitpid(spinner, NULL, 0);
+	printf("passed!\n");
+
+	printf("Checking old samples are ignored...");
+	usleep(MAX_AGE_MS * 2000);
+	assert(!omp_numa_system_load(app, MAX_AGE_MS, &load));
+	assert(omp_numa_system_load(app, MAX_AGE_MS * 10, &load) == 1);
+	printf("passed!\n");
+
+	test_finish();
+	return 0;
+}
@@ -0,0 +1,80 @@
+/*
+ * Checks that latency-critical applications take their share of processors
+ * from best-effort applications, which give them back at their next mapping,
+ * on a simulated 2-node machine with 4 processors per node.
+ *
+ * Usage: ./qos_test
+ */
+
+#include "test_util.h"
+
+#define NODES 2
+
+/* Check which nodes a setup was mapped to */
+static void check_setup(const exec_spec_t* setup, const unsigned* expected)
+{
+	unsigned i;
+
+	for(i = 0; i < NODES; i++)
+		printf("%u ", setup->task_assignment[i]);
+	for(i = 0; i < NODES; i++)
+		assert(setup->task_assignment[i] == expected[i]);
+	printf("passed!\n");
+}
+
+int main(int argc, char** argv)
+{
+	omp_numa_t *shepherd, *batch, *solver;
+	exec_spec_t *batch_setup, *solver_setup;
+
+	shepherd = test_start();
+	batch = test_app();
+	solver = test_app();
+
+	omp_numa_simulate_topology(batch, NODES, 4, NULL);
+	assert(omp_numa_set_qos(solver, 1, OMP_NUMA_LATENCY_CRITICAL) == 0);
+	assert(omp_numa_set_qos(solver, 1, OMP_NUMA_NUM_CLASSES) < 0);
+	assert(omp_numa_set_qos(solver, 0, OMP_NUMA_BEST_EFFORT) < 0);
+
+	printf("Checking a lone best-effort application fills every node...");
+	const unsigned alone[NODES] = { 4, 4 };
+	batch_setup = omp_numa_map_tasks(batch, NULL, 0);
+	check_setup(batch_setup, alone);
+
+	// The solver's fair share is half the machine, taken from the batch job
+	printf("Checking a latency-critical application preempts best-effort ones...");
+	const unsigned preempt[NODES] = { 4, 0 };
+	solver_setup = omp_numa_map_tasks(solver, NULL, 0);
+	check_setup(solver_setup, preempt);
+
+	printf("Checking the best-effort application yields at its next mapping...");
+	const unsigned yield[NODES] = { 0, 4 };
+	omp_numa_cleanup(batch, batch_setup);
+	free(batch_setup);
+	batch_setup = omp_numa_map_tasks(batch, NULL, 0);
+	check_setup(batch_setup, yield);
+	omp_numa_cleanup(batch, batch_setup);
+	free(batch_setup);
+
+	// Weighted 3:1, the solver is entitled to 6 of the 8 processors
+	printf("Checking weighted shares across classes...");
+	const unsigned weighted[NODES] = { 0, 2 };
+	assert(!omp_numa_set_policy(shepherd, "weighted-share"));
+	omp_numa_cleanup(solver, solver_setup);
+	free(solver_setup);
+	assert(omp_numa_set_qos(solver, 3, OMP_NUMA_LATENCY_CRITICAL) == 0);
+	batch_setup = omp_numa_map_tasks(batch, NULL, 0);
+	solver_setup = omp_numa_map_tasks(solver, NULL, 0);
+	assert(solver_setup->num_tasks == 6);
+	omp_numa_cleanup(batch, batch_setup);
+	free(batch_setup);
+	batch_setup = omp_numa_map_tasks(batch, NULL, 0);
+	check_setup(batch_setup, weighted);
+
+	omp_numa_cleanup(batch, batch_setup);
+	free(batch_setup);
+	omp_numa_cleanup(solver, solver_setup);
+	free(solver_setup);
+	test_finish();
+	return 0;
+}
@@ -0,0 +1,84 @@
+/*
+ * Checks that mappings stay within an application's bounds on its number of
+ * tasks & leave the surplus beyond its preference to other applications, on a
+ * simulated single node with 8 processors.
+ *
+ * Usage: ./range_test
+ */
+
+#include <string.h>
+#include "test_util.h"
+
+static omp_numa_t *app, *neighbour;
+
+/* Map & clean up a region within bounds, returning its number of tasks */
+static unsigned map_range(unsigned min, unsigned pref, unsigned max)
+{
+	exec_spec_t setup, *mapped;
+	unsigned num_tasks;
+
+	mapped = omp_numa_map_range(app, &setup, min, pref, max, 0);
+	num_tasks = mapped->num_tasks;
+	printf("%u ", num_tasks);
+	omp_numa_cleanup(app, mapped);
+	return num_tasks;
+}
+
+int main(int argc, char** argv)
+{
+	exec_spec_t busy, setup, nested, *parent;
+	unsigned i, cpu, num_cpus;
+
+	test_start();
+	app = test_app();
+	neighbour = test_app();
+	omp_numa_simulate_topology(app, 1, 8, NULL);
+
+	printf("Checking idle processors are granted up to the maximum...");
+	assert(map_range(0, 4, 6) == 6);
+	assert(map_range(0, 0, 0) == 8);
+	printf("passed!\n");
+
+	// The neighbour holds every processor, our equal share is 4
+	memset(&busy, 0, sizeof(busy));
+	busy.num_tasks = busy.task_assignment[0] = 8;
+	omp_numa_map_tasks(neighbour, &busy, 0);
+
+	printf("Checking the surplus beyond the preference is left to others...");
+	assert(map_range(0, 2, 8) == 2);
+	assert(map_range(0, 6, 8) == 4);
+	printf("passed!\n");
+
+	printf("Checking the minimum is granted even if it oversubscribes...");
+	assert(map_range(6, 6, 8) == 6);
+	printf("passed!\n");
+
+	omp_numa_cleanup(neighbour, &busy);
+
+	printf("Checking the process's bounds narrow the region's...");
+	assert(omp_numa_request_range(app, 5, 0, 3) < 0);
+	assert(omp_numa_request_range(app, 0, 4, 3) < 0);
+	assert(omp_numa_request_range(app, 0, 0, 3) == 0);
+	assert(map_range(0, 0, 6) == 3);
+	assert(map_range(0, 0, 0) == 3);
+	assert(omp_numa_request_range(app, 0, 0, 0) == 0);
+	assert(map_range(0, 0, 0) == 8);
+	printf("passed!\n");
+
+	// Four nested regions raised from 2 to 3 of the parent's 8 tasks wrap
+	// around the parent's CPUs rather than running past them
+	printf("Checking nested regions raised to their minimum get CPUs...");
+	parent = omp_numa_map_range(app, &setup, 0, 0, 0, 0);
+	for(i = 0; i < 4; i++)
+	{
+		assert(omp_numa_map_nested(app, parent, 0, i, 4, &nested, 3, 0));
+		for(cpu = 0, num_cpus = 0; cpu < 8; cpu++)
+			num_cpus += !!SPEC_HAS_CPU(&nested, cpu);
+		assert(nested.num_tasks == 3 && num_cpus == 3);
+	}
+	omp_numa_cleanup(app, parent);
+	printf("passed!\n");
+
+	test_finish();
+	return 0;
+}
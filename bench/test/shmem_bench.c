@@ -0,0 +1,121 @@
+/*
+ * Multi-process contention benchmark for the OpenMP/NUMA shared-memory
+ * segment.  Forks several processes which each emulate an OpenMP application
+ * forking & joining parallel regions as fast as possible, i.e. mapping tasks
+ * into per-region storage (like the runtime) & cleaning them up, interleaved
+ * with up-to-date queries of the node counters.  Reports the aggregate fork
+ * rate across all processes.
+ *
+ * Build against the spinlock & lock-free (seqlock) versions of the library
+ * to compare (see the Makefile).  The benchmark acts as its own shepherd, so
+ * make sure shmem-shepherd is not running.
+ *
+ * Usage: ./shmem_bench [ # processes ] [ seconds ]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sched_comm.h>
+
+#define DEFAULT_PROCS 16
+#define DEFAULT_SECONDS 5
+#define QUERIES_PER_FORK 4
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + ((double)ts.tv_nsec / 1e9);
+}
+
+static unsigned long run_child(double seconds)
+{
+	unsigned long forks = 0;
+	exec_spec_t spec;
+	int i;
+	omp_numa_t* ipc_handle = omp_numa_initialize(0);
+	if(!ipc_handle)
+		exit(1);
+
+	double end = now() + seconds;
+	while(now() < end)
+	{
+		for(i = 0; i < 64; i++)
+		{
+			exec_spec_t* setup = omp_numa_map_tasks_into(ipc_handle, &spec, 0);
+			numa_node_t node;
+			for(node = 0; node < QUERIES_PER_FORK; node++)
+				omp_numa_num_tasks(ipc_handle, node % omp_numa_num_nodes(), 0);
+			omp_numa_cleanup(ipc_handle, setup);
+		}
+		forks += 64;
+	}
+
+	omp_numa_shutdown(ipc_handle, 0);
+	return forks;
+}
+
+int main(int argc, char** argv)
+{
+	int i, num_procs = DEFAULT_PROCS;
+	double seconds = DEFAULT_SECONDS;
+	unsigned long total = 0;
+
+	if(argc > 1)
+		num_procs = atoi(argv[1]);
+	if(argc > 2)
+		seconds = atof(argv[2]);
+
+	omp_numa_t* ipc_handle = omp_numa_initialize(SHEPHERD);
+	if(!ipc_handle)
+	{
+		fprintf(stderr, "Could not create shared memory (is the shepherd running?)\n");
+		return 1;
+	}
+
+	// Per-child fork counts, written by the children
+	unsigned long* counts = (unsigned long*)mmap(NULL,
+																							 sizeof(unsigned long) * num_procs,
+																							 PROT_READ | PROT_WRITE,
+																							 MAP_SHARED | MAP_ANONYMOUS,
+																							 -1,
+																							 0);
+	if(counts == MAP_FAILED)
+	{
+		perror("Could not map fork counters");
+		omp_numa_shutdown(ipc_handle, SHEPHERD);
+		return 1;
+	}
+
+	printf("Running %d processes for %.1f seconds...\n", num_procs, seconds);
+	fflush(stdout);
+	for(i = 0; i < num_procs; i++)
+	{
+		if(fork() == 0)
+		{
+			counts[i] = run_child(seconds);
+			exit(0);
+		}
+	}
+
+	for(i = 0; i < num_procs; i++)
+		wait(NULL);
+	for(i = 0; i < num_procs; i++)
+		total += counts[i];
+
+	printf("Total forks: %lu\n", total);
+	printf("Fork rate: %.0f forks/s (%.0f forks/s/process)\n",
+		(double)total / seconds, (double)total / seconds / (double)num_procs);
+
+	for(i = 0; i < omp_numa_num_nodes(); i++)
+		if(omp_numa_num_tasks(ipc_handle, i, 0) != 0)
+			fprintf(stderr, "WARNING: node %d has leftover tasks!\n", i);
+
+	munmap(counts, sizeof(unsigned long) * num_procs);
+	omp_numa_shutdown(ipc_handle, SHEPHERD);
+	return 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * Bring-up & teardown shared by the mapping tests.  Each test acts as its own
+ * shepherd, creating the shared memory & attaching its emulated applications
+ * to it, so make sure shmem-shepherd is not running.
+ */
+
+#ifndef _TEST_UTIL_H
+#define _TEST_UTIL_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <sched_comm.h>
+
+/* Maximum number of applications a test attaches */
+#define MAX_TEST_APPS 8
+
+static omp_numa_t* test_shepherd;
+static omp_numa_t* test_apps[MAX_TEST_APPS];
+static unsigned test_num_apps;
+
+/* Create the shared memory as the shepherd, exiting if somebody else (e.g.
+ * shmem-shepherd) already is
+ */
+static inline omp_numa_t* test_start()
+{
+	test_shepherd = omp_numa_initialize(SHEPHERD);
+	if(!test_shepherd)
+	{
+		fprintf(stderr, "Could not create shared memory (is the shepherd "
+			"running?)\n");
+		exit(1);
+	}
+	return test_shepherd;
+}
+
+/* Attach an application, which test_finish() detaches */
+static inline omp_numa_t* test_app()
+{
+	omp_numa_t* app;
+
+	assert(test_num_apps < MAX_TEST_APPS);
+	app = omp_numa_initialize(0);
+	assert(app);
+	test_apps[test_num_apps++] = app;
+	return app;
+}
+
+/* Detach all applications (latest first) & the shepherd, removing the shared
+ * memory
+ */
+static inline void test_finish()
+{
+	while(test_num_apps)
+		omp_numa_shutdown(test_apps[--test_num_apps], 0);
+	omp_numa_shutdown(test_shepherd, SHEPHERD);
+}
+
+#endif /* _TEST_UTIL_H */
@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <sched_comm.h>
+
+void print_help()
+{
+	printf("omp-numa-client: send a request to the OpenMP/NUMA shepherd\n\n");
+	printf("Usage: ./omp-numa-client <request> [ argument ]\n");
+	printf("Requests:\n");
+	printf("\tstatus             : node counters & the pushed policy\n");
+	printf("\tapps               : per-application reservations & allotments\n");
+	printf("\tpolicy [ name ]    : print or switch the pushed mapping policy\n");
+	printf("\tclear              : clear all counters\n");
+	printf("\tdrain              : drain applications' traces into the trace file\n");
+	printf("\tsubscribe [ ms ]   : print allotments whenever they change, checking "
+		"every ms milliseconds (default 100)\n");
+	printf("\tshutdown           : stop the shepherd\n");
+	printf("\nThe socket is %s unless " OMP_NUMA_SOCKET " is set\n",
+		OMP_NUMA_DEFAULT_SOCKET);
+	exit(0);
+}
+
+int main(int argc, char** argv)
+{
+	const char* socket_path = OMP_NUMA_DEFAULT_SOCKET;
+	struct sockaddr_un addr;
+	char request[256], *line = NULL;
+	size_t line_size = 0;
+	int fd, i, subscribe, error = 0;
+	FILE* in;
+
+	if(argc < 2 || !strcmp(argv[1], "-h") || !strcmp(argv[1], "--help"))
+		print_help();
+	if(getenv(OMP_NUMA_SOCKET))
+		socket_path = getenv(OMP_NUMA_SOCKET);
+
+	// Requests are a single line, arguments separated by spaces
+	request[0] = '\0';
+	for(i = 1; i < argc; i++)
+	{
+		if(strlen(request) + strlen(argv[i]) + 2 >= sizeof(request))
+		{
+			fprintf(stderr, "Request is too long\n");
+			return 1;
+		}
+		strcat(request, argv[i]);
+		strcat(request, i < argc - 1 ? " " : "\n");
+	}
+	subscribe = !strcmp(argv[1], "subscribe");
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+	if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+		 connect(fd, (struct sockaddr*)&addr, sizeof(addr)))
+	{
+		perror("Could not connect to the shepherd (is it running?)");
+		return 1;
+	}
+	if(send(fd, request, strlen(request), MSG_NOSIGNAL) < 0)
+	{
+		perror("Could not send request");
+		return 1;
+	}
+
+	// Responses end with an empty line, subscriptions go on until the shepherd
+	// exits
+	in = fdopen(fd, "r");
+	while(in && getline(&line, &line_size, in) > 0)
+	{
+		if(!subscribe && !strcmp(line, "\n"))
+			break;
+		if(!strncmp(line, "error", 5))
+			error = 1;
+		fputs(line, stdout);
+		fflush(stdout);
+	}
+
+	free(line);
+	if(in)
+		fclose(in);
+	else
+		close(fd);
+	return error;
+}
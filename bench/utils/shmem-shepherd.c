@@ -1,89 +1,463 @@
 #include <stdlib.h>
 #include <stdio.h>
-#include <assert.h>
 #include <unistd.h>
 #include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <sched_comm.h>
 
-#define PRINT_SIG SIGUSR1
-#define CLEAR_SIG SIGUSR2
 #define STOP_SIG SIGINT
+#define REAP_INTERVAL_MS 1000
+#define TRACE_INTERVAL_MS 10
+#define LOAD_INTERVAL_MS 100
+
+/* Control socket - maximum number of connected clients, how often the control
+ * thread checks whether to exit & how often subscribers are sent changes to
+ * the allotments by default
+ */
+#define MAX_CLIENTS 16
+#define CONTROL_POLL_MS 100
+#define SUBSCRIBE_INTERVAL_MS 100
+
+/* A control socket client:
+ *   1. Connection & partially-received requests
+ *   2. Whether the client subscribed to changes, how often it wants them, the
+ *      epoch of the last snapshot it was sent & when to check again
+ */
+typedef struct control_client {
+	int fd;
+	char buf[256];
+	size_t len;
+
+	int subscribed;
+	unsigned interval_ms;
+	unsigned epoch;
+	unsigned long long next_ns;
+} control_client;
 
 volatile int exit_flag = 0;
 omp_numa_t* ipc_handle = NULL;
+const char* policy = NULL;
+int scheduler = 0;
+const char* trace_file = NULL;
+FILE* trace_fp = NULL;
+unsigned load_interval_ms = LOAD_INTERVAL_MS;
+const char* socket_path = OMP_NUMA_DEFAULT_SOCKET;
+int control_fd = -1;
+pthread_t main_thread;
+
+/* Serializes updates from the main loop & the control thread */
+pthread_mutex_t shepherd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void print_help()
+{
+	printf("shmem-shepherd: OpenMP/NUMA shared-memory shepherd process\n\n");
+	printf("Usage: ./shmem-shepherd [ OPTIONS ]\n");
+	printf("Options:\n");
+	printf("\t-h        : print help & exit\n");
+	printf("\t-p <name> : mapping policy pushed to applications (equal-share, "
+		"weighted-share, distance-aware, packing, feedback)\n");
+	printf("\t-s        : act as central scheduler, deciding all applications' "
+		"allotments (pushes the central policy)\n");
+	printf("\t-t <file> : write applications' mapping decisions (recorded with "
+		"OMP_NUMA_TRACE=1) to a trace file\n");
+	printf("\t-l <ms>   : sample the system load every ms milliseconds, 0 to "
+		"disable (default %d)\n", LOAD_INTERVAL_MS);
+	printf("\nControl the shepherd through its socket (%s, or "
+		OMP_NUMA_SOCKET ") with omp-numa-client\n", OMP_NUMA_DEFAULT_SOCKET);
+	exit(0);
+}
 
 void parse_args(int argc, char** argv)
 {
-	//TODO
+	int opt;
+	while((opt = getopt(argc, argv, "hl:p:st:")) != -1)
+	{
+		switch(opt)
+		{
+		case 'l': load_interval_ms = atoi(optarg); break;
+		case 'p': policy = optarg; break;
+		case 's': scheduler = 1; policy = "central"; break;
+		case 't': trace_file = optarg; break;
+		default: print_help(); break;
+		}
+	}
 }
 
-void print_info(int sig)
+///////////////////////////////////////////////////////////////////////////////
+// Tracing
+///////////////////////////////////////////////////////////////////////////////
+
+/* Drain applications' trace rings into the trace file, with the shepherd
+ * lock held.  Returns the number of records written, or -1 on failure.
+ */
+int drain_trace()
 {
-	if(exit_flag)
-		return;
+	unsigned dropped;
+	int drained;
 
-	assert(ipc_handle != NULL);
-	char str[512];
-	char tmp[16];
+	if((drained = omp_numa_drain_trace(ipc_handle, trace_fp, &dropped)) < 0)
+	{
+		perror("Could not write trace file");
+		return -1;
+	}
+	if(dropped)
+	{
+		printf("Applications dropped %u trace record(s)\n", dropped);
+		fflush(stdout);
+	}
+	return drained;
+}
 
-	snprintf(str, sizeof(str), "OpenMP task information:\n");
+///////////////////////////////////////////////////////////////////////////////
+// Control socket
+///////////////////////////////////////////////////////////////////////////////
+
+/* Print the node counters & the system load */
+void print_status(FILE* out)
+{
+	omp_numa_load_t load;
 	int i;
-	for(i = 0; i < omp_numa_num_nodes(ipc_handle); i++)
+
+	fprintf(out, "policy %s\n", omp_numa_policy_name(ipc_handle));
+	fprintf(out, "epoch %u\n", omp_numa_epoch(ipc_handle));
+	if(load_interval_ms &&
+		 omp_numa_system_load(ipc_handle, 2 * load_interval_ms, &load))
+		fprintf(out, "load %.2f %.2f %.2f running %u threads %u\n",
+			load.loadavg[0], load.loadavg[1], load.loadavg[2], load.running,
+			load.threads);
+	for(i = 0; i < omp_numa_num_nodes(); i++)
+		fprintf(out, "node %d tasks %u busy %u cpus %u load %.2f\n",
+			i, omp_numa_num_tasks(ipc_handle, i, FAST_CHECK),
+			omp_numa_num_busy_cpus(ipc_handle, i, FAST_CHECK),
+			omp_numa_node_num_cpus(i), omp_numa_node_load(ipc_handle, i));
+}
+
+/* Print a per-node task assignment, e.g. [(0,4),(2,4)] */
+void print_assignment(FILE* out, const unsigned* assignment)
+{
+	int i, sep = 0;
+
+	fprintf(out, "[");
+	for(i = 0; i < omp_numa_num_nodes(); i++)
 	{
-		snprintf(tmp, sizeof(tmp), "\t[%d] %u\n",
-			i, omp_numa_num_tasks(ipc_handle, i, FAST_CHECK));
-		strcat(str, tmp);
+		if(!assignment[i])
+			continue;
+		fprintf(out, "%s(%d,%u)", sep ? "," : "", i, assignment[i]);
+		sep = 1;
 	}
+	fprintf(out, "]");
+}
+
+/* Print every application's reservations & allotment */
+void print_apps(FILE* out)
+{
+	omp_numa_app_info_t info;
+	unsigned slot;
+	int ret;
+
+	fprintf(out, "epoch %u\n", omp_numa_epoch(ipc_handle));
+	for(slot = 0; (ret = omp_numa_app_info(ipc_handle, slot, &info)) >= 0; slot++)
+	{
+		if(!ret)
+			continue;
+		fprintf(out, "app %d weight %u class %s tasks %u ", info.pid, info.weight,
+			omp_numa_class_name(info.qos_class), info.num_tasks);
+		print_assignment(out, info.task_assignment);
+		fprintf(out, " allotted %u ", info.alloc_num_tasks);
+		print_assignment(out, info.alloc_assignment);
+		fprintf(out, " resizes %u damped %u rebinds %u avoided %u\n", info.resizes,
+			info.damped, info.rebinds, info.rebinds_avoided);
+	}
+}
+
+/* Send a response, terminated by an empty line.  Returns 0 on success. */
+int send_response(int fd, char* buf, size_t len)
+{
+	ssize_t sent;
+
+	while(len)
+	{
+		if((sent = send(fd, buf, len, MSG_NOSIGNAL)) <= 0)
+		{
+			if(sent < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += sent;
+		len -= sent;
+	}
+	return 0;
+}
+
+/* Execute a request & send the response.  Returns 0 if the client should
+ * stay connected.
+ */
+int handle_request(control_client* client, char* line)
+{
+	char* cmd, *arg, *save, *buf = NULL;
+	size_t len = 0;
+	int ret, drained;
+	FILE* out = open_memstream(&buf, &len);
+
+	if(!out)
+		return -1;
+
+	cmd = strtok_r(line, " \t\r", &save);
+	arg = strtok_r(NULL, " \t\r", &save);
+	if(!cmd)
+		fprintf(out, "error empty request\n");
+	else if(!strcmp(cmd, "status"))
+		print_status(out);
+	else if(!strcmp(cmd, "apps"))
+		print_apps(out);
+	else if(!strcmp(cmd, "policy"))
+	{
+		if(!arg)
+			fprintf(out, "policy %s\n", omp_numa_policy_name(ipc_handle));
+		else if(omp_numa_set_policy(ipc_handle, arg))
+			fprintf(out, "error unknown mapping policy '%s'\n", arg);
+		else
+			fprintf(out, "ok\n");
+	}
+	else if(!strcmp(cmd, "clear"))
+	{
+		pthread_mutex_lock(&shepherd_lock);
+		omp_numa_clear_counters(ipc_handle);
+		pthread_mutex_unlock(&shepherd_lock);
+		fprintf(out, "ok\n");
+	}
+	else if(!strcmp(cmd, "drain"))
+	{
+		if(!trace_fp)
+			fprintf(out, "error tracing is disabled (start the shepherd with -t)\n");
+		else
+		{
+			pthread_mutex_lock(&shepherd_lock);
+			drained = drain_trace();
+			pthread_mutex_unlock(&shepherd_lock);
+			if(drained < 0)
+				fprintf(out, "error could not write trace file\n");
+			else
+				fprintf(out, "ok %d records\n", drained);
+		}
+	}
+	else if(!strcmp(cmd, "subscribe"))
+	{
+		client->interval_ms = arg && atoi(arg) > 0 ? atoi(arg) :
+																								 SUBSCRIBE_INTERVAL_MS;
+		client->subscribed = 1;
+		client->epoch = omp_numa_epoch(ipc_handle);
+		client->next_ns = omp_numa_time_ns() + client->interval_ms * 1000000ULL;
+		print_apps(out);
+	}
+	else if(!strcmp(cmd, "shutdown"))
+	{
+		fprintf(out, "ok\n");
+		exit_flag = 1;
+		pthread_kill(main_thread, STOP_SIG);
+	}
+	else
+		fprintf(out, "error unknown request '%s'\n", cmd);
+
+	fprintf(out, "\n");
+	fclose(out);
+	ret = send_response(client->fd, buf, len);
+	free(buf);
+	return ret;
+}
+
+/* Send subscribers a snapshot of the allotments if they changed */
+void notify_subscriber(control_client* client)
+{
+	char* buf = NULL;
+	size_t len = 0;
+	unsigned epoch = omp_numa_epoch(ipc_handle);
+	FILE* out;
 
-	printf("%s\n", str);
+	client->next_ns = omp_numa_time_ns() + client->interval_ms * 1000000ULL;
+	if(epoch == client->epoch || !(out = open_memstream(&buf, &len)))
+		return;
+	client->epoch = epoch;
+	print_apps(out);
+	fprintf(out, "\n");
+	fclose(out);
+	if(send_response(client->fd, buf, len))
+	{
+		close(client->fd);
+		client->fd = -1;
+	}
+	free(buf);
 }
 
-void clear_counters(int sig)
+/* Read requests from a client, one per line */
+void read_requests(control_client* client)
 {
-	if(exit_flag)
+	ssize_t got;
+	char* nl;
+
+	got = recv(client->fd, client->buf + client->len,
+		sizeof(client->buf) - client->len - 1, 0);
+	if(got <= 0)
+	{
+		close(client->fd);
+		client->fd = -1;
 		return;
+	}
+	client->len += got;
+	client->buf[client->len] = '\0';
 
-	assert(ipc_handle != NULL);
-	omp_numa_clear_counters(ipc_handle);
+	while((nl = strchr(client->buf, '\n')))
+	{
+		*nl = '\0';
+		if(handle_request(client, client->buf))
+		{
+			close(client->fd);
+			client->fd = -1;
+			return;
+		}
+		client->len -= nl + 1 - client->buf;
+		memmove(client->buf, nl + 1, client->len + 1);
+	}
+
+	// Requests are short, drop clients sending garbage
+	if(client->len >= sizeof(client->buf) - 1)
+	{
+		close(client->fd);
+		client->fd = -1;
+	}
 }
 
-void cleanup(int sig)
+/* Serve the control socket until the shepherd exits */
+void* control_thread(void* arg)
 {
-	exit_flag = 1;
-	omp_numa_shutdown(ipc_handle, SHEPHERD);
+	control_client clients[MAX_CLIENTS];
+	struct pollfd fds[MAX_CLIENTS + 1];
+	struct timeval send_timeout = { 1, 0 };
+	unsigned long long now, wait_ms;
+	int i, num_fds, fd, timeout;
+
+	for(i = 0; i < MAX_CLIENTS; i++)
+		clients[i].fd = -1;
+
+	while(!exit_flag)
+	{
+		// Wake up in time for the next subscriber update
+		now = omp_numa_time_ns();
+		timeout = CONTROL_POLL_MS;
+		fds[0].fd = control_fd;
+		fds[0].events = POLLIN;
+		for(i = 0, num_fds = 1; i < MAX_CLIENTS; i++)
+		{
+			if(clients[i].fd < 0)
+				continue;
+			if(clients[i].subscribed)
+			{
+				wait_ms = clients[i].next_ns > now ?
+					(clients[i].next_ns - now + 999999ULL) / 1000000ULL : 0;
+				if(wait_ms < (unsigned long long)timeout)
+					timeout = (int)wait_ms;
+			}
+			fds[num_fds].fd = clients[i].fd;
+			fds[num_fds++].events = POLLIN;
+		}
+
+		if(poll(fds, num_fds, timeout) < 0 && errno != EINTR)
+		{
+			perror("Could not poll control socket");
+			break;
+		}
+
+		for(i = 0, num_fds = 1; i < MAX_CLIENTS; i++)
+		{
+			if(clients[i].fd < 0)
+				continue;
+			if(fds[num_fds++].revents & (POLLIN | POLLHUP | POLLERR))
+				read_requests(&clients[i]);
+			if(clients[i].fd >= 0 && clients[i].subscribed &&
+				 omp_numa_time_ns() >= clients[i].next_ns)
+				notify_subscriber(&clients[i]);
+		}
+
+		if(fds[0].revents & POLLIN)
+		{
+			if((fd = accept(control_fd, NULL, NULL)) < 0)
+				continue;
+			for(i = 0; i < MAX_CLIENTS && clients[i].fd >= 0; i++);
+			if(i == MAX_CLIENTS)
+			{
+				close(fd);
+				continue;
+			}
+			setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout,
+				sizeof(send_timeout));
+			memset(&clients[i], 0, sizeof(control_client));
+			clients[i].fd = fd;
+		}
+	}
+
+	for(i = 0; i < MAX_CLIENTS; i++)
+		if(clients[i].fd >= 0)
+			close(clients[i].fd);
+	return NULL;
 }
 
-int setup_signals()
+/* Create the control socket, replacing any stale one */
+int open_control_socket()
 {
-	struct sigaction print;
-	struct sigaction clear;
-	struct sigaction exit;
+	struct sockaddr_un addr;
 
-	// Register handler for printing information
-	print.sa_handler = print_info;
-	print.sa_flags = 0;
-	sigemptyset(&print.sa_mask);
-	if(sigaction(PRINT_SIG, &print, NULL) == -1)
+	if(strlen(socket_path) >= sizeof(addr.sun_path))
 	{
-		perror("Could not register signal handler for printing information");
+		fprintf(stderr, "Control socket path '%s' is too long\n", socket_path);
 		return -1;
 	}
 
-	clear.sa_handler = clear_counters;
-	clear.sa_flags = 0;
-	sigemptyset(&clear.sa_mask);
-	if(sigaction(CLEAR_SIG, &clear, NULL) == -1)
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	if((control_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
 	{
-		perror("Could not register signal handler for exiting");
+		perror("Could not create control socket");
 		return -1;
 	}
 
+	// We own the shared memory, so any existing socket is left over
+	unlink(socket_path);
+	if(bind(control_fd, (struct sockaddr*)&addr, sizeof(addr)) ||
+		 listen(control_fd, MAX_CLIENTS))
+	{
+		perror("Could not bind control socket");
+		close(control_fd);
+		return -1;
+	}
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Shepherd
+///////////////////////////////////////////////////////////////////////////////
+
+void cleanup(int sig)
+{
+	exit_flag = 1;
+}
+
+int setup_signals()
+{
+	struct sigaction exit;
+
 	// Register handler for cleaning up & exiting
 	exit.sa_handler = cleanup;
 	exit.sa_flags = 0;
 	sigemptyset(&exit.sa_mask);
-	if(sigaction(STOP_SIG, &exit, NULL) == -1)
+	if(sigaction(STOP_SIG, &exit, NULL) == -1 ||
+		 sigaction(SIGTERM, &exit, NULL) == -1)
 	{
 		perror("Could not register signal handler for exiting");
 		return -1;
@@ -96,12 +470,98 @@ int main(int argc, char** argv)
 {
 	parse_args(argc, argv);
 	ipc_handle = omp_numa_initialize(SHEPHERD);
+	if(!ipc_handle)
+		return 1;
+	if(policy && omp_numa_set_policy(ipc_handle, policy))
+	{
+		fprintf(stderr, "Unknown mapping policy '%s'\n", policy);
+		omp_numa_shutdown(ipc_handle, SHEPHERD);
+		return 1;
+	}
+	if(trace_file && !(trace_fp = fopen(trace_file, "w")))
+	{
+		perror("Could not open trace file");
+		omp_numa_shutdown(ipc_handle, SHEPHERD);
+		return 1;
+	}
+	if(getenv(OMP_NUMA_SOCKET))
+		socket_path = getenv(OMP_NUMA_SOCKET);
+	if(open_control_socket())
+	{
+		if(trace_fp)
+			fclose(trace_fp);
+		omp_numa_shutdown(ipc_handle, SHEPHERD);
+		return 1;
+	}
 	setup_signals();
 
+	pthread_t control;
+	main_thread = pthread_self();
+	int control_started = !pthread_create(&control, NULL, control_thread, NULL);
+	if(!control_started)
+	{
+		fprintf(stderr, "Could not start control thread\n");
+		exit_flag = 1;
+	}
+
+	// Wake up when applications arrive or leave, & at least every second to
+	// reclaim the reservations of applications which died without leaving (or
+	// more often to sample the system load & keep up with applications'
+	// traces)
+	unsigned wait_ms = REAP_INTERVAL_MS;
+	if(load_interval_ms && load_interval_ms < wait_ms)
+		wait_ms = load_interval_ms;
+	if(trace_fp && TRACE_INTERVAL_MS < wait_ms)
+		wait_ms = TRACE_INTERVAL_MS;
+
+	unsigned long long next_reap = 0, next_sample = 0;
 	while(!exit_flag) {
-		pause();
+		int requested = omp_numa_wait_requests(ipc_handle, wait_ms);
+		if(exit_flag)
+			break;
+
+		// We're the only one publishing samples, which applications read
+		// without any lock
+		if(load_interval_ms && omp_numa_time_ns() >= next_sample)
+		{
+			next_sample = omp_numa_time_ns() + load_interval_ms * 1000000ULL;
+			if(omp_numa_sample_load(ipc_handle))
+			{
+				perror("Could not sample the system load");
+				load_interval_ms = 0;
+			}
+		}
+
+		pthread_mutex_lock(&shepherd_lock);
+		if(trace_fp)
+			drain_trace();
+		if(requested || omp_numa_time_ns() >= next_reap)
+		{
+			next_reap = omp_numa_time_ns() + REAP_INTERVAL_MS * 1000000ULL;
+
+			int reaped = omp_numa_reap_apps(ipc_handle);
+			if(reaped)
+			{
+				printf("Reclaimed the reservations of %d dead application(s)\n",
+					reaped);
+				fflush(stdout);
+			}
+			if(scheduler && (requested || reaped))
+				omp_numa_schedule(ipc_handle);
+		}
+		pthread_mutex_unlock(&shepherd_lock);
 	}
 
+	if(control_started)
+		pthread_join(control, NULL);
+	close(control_fd);
+	unlink(socket_path);
+	if(trace_fp)
+	{
+		drain_trace();
+		fclose(trace_fp);
+	}
+	omp_numa_shutdown(ipc_handle, SHEPHERD);
 	return 0;
 }
 
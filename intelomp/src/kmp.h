@@ -2170,6 +2170,9 @@ typedef struct KMP_ALIGN_CACHE kmp_base_info {
 #if KMP_AFFINITY_SUPPORTED
     kmp_affin_mask_t  *th_affin_mask; /* thread's current affinity mask */
 #endif
+		int                th_numa_node;  /* Rob: node the thread lives on, -1 if not placed yet */
+		unsigned           th_numa_idx;   /* Rob: index among the team's threads on th_numa_node */
+		omp_numa_binding_t th_numa_bound; /* Rob: where the thread is bound, to skip needless migrations */
 
 /*
  * The data set by the master at reinit, then R/W by the worker
@@ -2360,6 +2363,10 @@ typedef struct KMP_ALIGN_CACHE kmp_base_team {
     int t_size_changed; // team size was changed?: 0: no, 1: yes, -1: changed via omp_set_num_threads() call
 #endif
 		exec_spec_t             *t_setup;        // Rob: NUMA setup data for all threads in team
+		kmp_uint64               t_numa_start;   // Rob: start time of the parallel region, for feedback
+		exec_spec_t              t_numa_spec;    // Rob: storage for t_setup unless it's leased
+		unsigned                 t_numa_requested; // Rob: threads requested before mapping, for tracing
+		int                      t_numa_nested;  // Rob: t_setup divides up the parent team's, not negotiated
 
     // Read/write by workers as well -----------------------------------------------------------------------
 #if KMP_ARCH_X86 || KMP_ARCH_X86_64
@@ -85,6 +85,11 @@ kmp_info_t __kmp_monitor;
 
 static omp_numa_t* ipc_handle;
 
+/* Rob: setup of the team being allocated, so __kmp_allocate_thread() can pick
+ * pooled threads living on the nodes it maps to (protected by
+ * __kmp_forkjoin_lock) */
+static exec_spec_t* omp_numa_forming = NULL;
+
 /* ------------------------------------------------------------------------ */
 /* ------------------------------------------------------------------------ */
 
@@ -110,6 +115,11 @@ static int __kmp_unregister_root_other_thread( int gtid );
 static void __kmp_unregister_library( void ); // called by __kmp_internal_end()
 static void __kmp_reap_thread( kmp_info_t * thread, int is_root );
 static kmp_info_t *__kmp_thread_pool_insert_pt = NULL;
+static numa_node_t __kmp_numa_wanted_node( kmp_team_t *team, int new_tid );
+static kmp_info_t **__kmp_numa_pool_link( numa_node_t node );
+static void __kmp_numa_place_team( kmp_team_t *team );
+static exec_spec_t *__kmp_numa_map_nested( kmp_team_t *parent_team, kmp_info_t *master_th,
+                                           exec_spec_t *spec, unsigned min, unsigned max );
 
 /* ------------------------------------------------------------------------ */
 /* ------------------------------------------------------------------------ */
@@ -1473,7 +1483,10 @@ __kmp_fork_call(
 #if KMP_NESTED_HOT_TEAMS
     kmp_hot_team_ptr_t **p_hot_teams;
 #endif
-    exec_spec_t    *omp_numa_setup;
+    exec_spec_t    *omp_numa_setup = NULL;
+    exec_spec_t     omp_numa_spec;
+    unsigned        omp_numa_requested = 0;
+    int             omp_numa_nested = 0;
     { // KMP_TIME_BLOCK
     KMP_TIME_BLOCK(KMP_fork_call);
 
@@ -1596,6 +1609,45 @@ __kmp_fork_call(
     }
 #endif
 
+		// Rob: select & map tasks before taking the fork/join lock, so other root
+		// threads don't wait on the negotiation (only the master's own state is
+		// read here)
+		if(ipc_handle && parent_team->t.t_active_level <
+				master_th->th.th_current_task->td_icvs.max_active_levels)
+		{
+			// Rob: decide into the stack, copied into the team once we have one.  The
+			// num_threads clause (or nthreads-var) caps the region, & the clause's
+			// count is required unless dynamic adjustment is enabled.
+			unsigned min = master_set_numthreads &&
+				!get__dynamic_2( parent_team, master_tid ) ? master_set_numthreads : 1;
+			omp_numa_requested = master_set_numthreads ?
+				master_set_numthreads : get__nproc_2( parent_team, master_tid );
+
+			if(parent_team->t.t_setup)
+			{
+				// Rob: nested regions divide up the parent's setup locally
+				if(get__nested_2( parent_team, master_tid ))
+					omp_numa_setup = __kmp_numa_map_nested(parent_team, master_th,
+						&omp_numa_spec, min, omp_numa_requested);
+				omp_numa_nested = omp_numa_setup != NULL;
+			}
+			else if(get__nested_2( parent_team, master_tid ) &&
+							parent_team->t.t_active_level + 1 <
+								master_th->th.th_current_task->td_icvs.max_active_levels)
+			{
+				// Rob: nested regions will need processors beyond our own threads,
+				// reserve our whole share for them to divide up
+				omp_numa_setup = omp_numa_map_range(ipc_handle, &omp_numa_spec, min, 0, 0, 0);
+				KMP_DEBUG_ASSERT( omp_numa_setup );
+			}
+			else
+			{
+				omp_numa_setup = omp_numa_map_range(ipc_handle, &omp_numa_spec, min,
+					omp_numa_requested, omp_numa_requested, 0);
+				KMP_DEBUG_ASSERT( omp_numa_setup );
+			}
+		}
+
     /* determine how many new threads we can use */
     __kmp_acquire_bootstrap_lock( &__kmp_forkjoin_lock );
 
@@ -1605,31 +1657,10 @@ __kmp_fork_call(
         nthreads = master_set_numthreads ?
             master_set_numthreads : get__nproc_2( parent_team, master_tid ); // TODO: get nproc directly from current task
 
-				// Rob: select & map tasks
-				if(ipc_handle)
-				{
-					omp_numa_setup = omp_numa_map_tasks(ipc_handle, NULL, 0);
-					KMP_DEBUG_ASSERT( omp_numa_setup );
-					nthreads = omp_numa_setup->num_tasks;
-
-					char str[4096];
-					char tmp[512];
-					snprintf(str, sizeof(str), "begin_python|num_tasks|%d\nbegin_python|task_assignment|[", nthreads);
-					numa_node_t i = 0;
-					for(i = 0; i < omp_numa_num_nodes(); i++)
-					{
-						if(omp_numa_setup->task_assignment[i] != 0)
-						{
-							snprintf(tmp, sizeof(tmp), "(%d,%d),", i, omp_numa_setup->task_assignment[i]);
-							strcat(str, tmp);
-						}
-					}
-					if(str[strlen(str)-1] == ',')
-						str[strlen(str)-1] = '\0';
-					snprintf(tmp, sizeof(tmp), "]\n");
-					strcat(str, tmp);
-					printf("%s", str);
-				}
+				// Rob: the mapping decides how many threads we get (it may reserve
+				// more for nested regions)
+				if(omp_numa_setup)
+					nthreads = KMP_MIN( nthreads, (int)omp_numa_setup->num_tasks );
 
         nthreads = __kmp_reserve_threads(root, parent_team, master_tid, nthreads
 #if OMP_40_ENABLED
@@ -1657,6 +1688,15 @@ __kmp_fork_call(
 #endif /* KMP_OS_LINUX && ( KMP_ARCH_X86 || KMP_ARCH_X86_64 || KMP_ARCH_ARM ) */
 
         __kmp_release_bootstrap_lock( &__kmp_forkjoin_lock );
+
+				// Rob: serialized regions don't get a team, give back the mapping
+				if(omp_numa_setup)
+				{
+					omp_numa_trace_region(ipc_handle, loc, omp_numa_requested, omp_numa_setup, 0);
+					if(!omp_numa_nested)
+						omp_numa_cleanup(ipc_handle, omp_numa_setup);
+					omp_numa_setup = NULL;
+				}
         KA_TRACE( 20, ("__kmp_fork_call: T#%d serializing parallel region\n", gtid ));
 
         __kmpc_serialized_parallel(loc, gtid);
@@ -1787,6 +1827,9 @@ __kmp_fork_call(
     master_th->th.th_set_proc_bind = proc_bind_default;
 #endif /* OMP_40_ENABLED */
 
+		/* Rob: let new threads come from pools on the setup's nodes */
+		omp_numa_forming = omp_numa_setup;
+
     if ((nthreads_icv > 0)
 #if OMP_40_ENABLED
         || (proc_bind_icv != proc_bind_default)
@@ -1831,7 +1874,13 @@ __kmp_fork_call(
     team->t.t_parent     = parent_team;
     TCW_SYNC_PTR(team->t.t_pkfn, microtask);
     team->t.t_invoke     = invoker;  /* TODO move this to root, maybe */
+		if(omp_numa_setup && !omp_numa_is_leased(ipc_handle, omp_numa_setup))
+			omp_numa_setup = omp_numa_copy_spec(&team->t.t_numa_spec, omp_numa_setup);
 		team->t.t_setup      = omp_numa_setup;
+		team->t.t_numa_requested = omp_numa_requested;
+		team->t.t_numa_nested = omp_numa_nested;
+		if(omp_numa_setup)
+			team->t.t_numa_start = omp_numa_time_ns();
     // TODO: parent_team->t.t_level == INT_MAX ???
 #if OMP_40_ENABLED
     if ( !master_th->th.th_teams_microtask || level > teams_level ) {
@@ -1897,6 +1946,11 @@ __kmp_fork_call(
     __kmp_fork_team_threads( root, team, master_th, gtid );
     __kmp_setup_icv_copy( team, nthreads, &master_th->th.th_current_task->td_icvs, loc );
 
+		/* Rob: decide which node each thread runs on */
+		omp_numa_forming = NULL;
+		if(team->t.t_setup)
+			__kmp_numa_place_team(team);
+
 
     __kmp_release_bootstrap_lock( &__kmp_forkjoin_lock );
 
@@ -1992,6 +2046,12 @@ __kmp_join_call(ident_t *loc, int gtid
     kmp_root_t     *root;
     int             master_active;
     int             i;
+    exec_spec_t    *omp_numa_setup = NULL;
+    exec_spec_t     omp_numa_spec;
+    const void     *omp_numa_site = NULL;
+    unsigned        omp_numa_nproc = 0, omp_numa_requested = 0;
+    kmp_uint64      omp_numa_duration = 0;
+    int             omp_numa_nested = 0;
 
     KA_TRACE( 20, ("__kmp_join_call: enter T#%d\n", gtid ));
 
@@ -2192,18 +2252,36 @@ __kmp_join_call(ident_t *loc, int gtid
      // KMP_ASSERT( master_th->th.th_current_task->td_flags.executing == 0 );
      master_th->th.th_current_task->td_flags.executing = 1;
 
-		// Rob: clean up execution for this task
-		if(ipc_handle)
+		// Rob: take the team's setup while nobody can reuse the team, it's given
+		// back once we've released the lock
+		if(ipc_handle && team->t.t_setup)
 		{
-			OMP_NUMA_DEBUG("cleaning up team\n");
-			KMP_DEBUG_ASSERT( team->t.t_setup );
-			omp_numa_cleanup(ipc_handle, team->t.t_setup);
-			free(team->t.t_setup);
+			omp_numa_setup = team->t.t_setup;
+			if(!omp_numa_is_leased(ipc_handle, omp_numa_setup))
+				omp_numa_setup = omp_numa_copy_spec(&omp_numa_spec, omp_numa_setup);
+			omp_numa_site = team->t.t_ident;
+			omp_numa_nproc = team->t.t_nproc;
+			omp_numa_requested = team->t.t_numa_requested;
+			omp_numa_duration = omp_numa_time_ns() - team->t.t_numa_start;
+			omp_numa_nested = team->t.t_numa_nested;
 			team->t.t_setup = NULL;
 		}
 
     __kmp_release_bootstrap_lock( &__kmp_forkjoin_lock );
 
+		// Rob: clean up execution for this task, nested setups were never
+		// negotiated (& don't profile the application's scaling)
+		if(omp_numa_setup)
+		{
+			OMP_NUMA_DEBUG("cleaning up team\n");
+			if(!omp_numa_nested)
+				omp_numa_region_done(ipc_handle, omp_numa_site, omp_numa_nproc, omp_numa_duration);
+			omp_numa_trace_region(ipc_handle, omp_numa_site, omp_numa_requested,
+				omp_numa_setup, omp_numa_duration);
+			if(!omp_numa_nested)
+				omp_numa_cleanup(ipc_handle, omp_numa_setup);
+		}
+
     KMP_MB();
     KA_TRACE( 20, ("__kmp_join_call: exit T#%d\n", gtid ));
 }
@@ -3435,6 +3513,8 @@ __kmp_register_root( int initial_thread )
         }
         root_thread->th.th_info .ds.ds_gtid = gtid;
         root_thread->th.th_root =  root;
+				root_thread->th.th_numa_node = -1; // Rob: not placed on a node yet
+				root_thread->th.th_numa_bound.node = -1;
         if( __kmp_env_consistency_check ) {
             root_thread->th.th_cons = __kmp_allocate_cons_stack( gtid );
         }
@@ -3789,6 +3869,128 @@ __kmp_initialize_info( kmp_info_t *this_thr, kmp_team_t *team, int tid, int gtid
 }
 
 
+/* Rob: per-node thread pools - the free list stays sorted by gtid, but each
+ * pooled thread remembers the node it last ran on, so teams can be formed from
+ * threads already living (& with warm caches) on the nodes of their setup.
+ * Only called from within a forkjoin critical section.
+ */
+
+/* Rob: the node with the most of the forming team's tasks not yet covered by
+ * threads 0..new_tid-1, or -1 if they're all covered */
+static numa_node_t
+__kmp_numa_wanted_node( kmp_team_t *team, int new_tid )
+{
+	unsigned slots[MAX_NUM_NODES];
+	numa_node_t node, wanted = -1, num_nodes = omp_numa_num_nodes();
+	int i;
+
+	memcpy(slots, omp_numa_forming->task_assignment, sizeof(slots));
+	for(i = 0; i < new_tid; i++)
+	{
+		node = team->t.t_threads[i] ? team->t.t_threads[i]->th.th_numa_node : -1;
+		if(node >= 0 && node < num_nodes && slots[node])
+			slots[node]--;
+	}
+	for(node = 0; node < num_nodes; node++)
+		if(slots[node] && (wanted < 0 || slots[node] > slots[wanted]))
+			wanted = node;
+	return wanted;
+}
+
+/* Rob: the link to the first pooled thread living on node, or to the head of
+ * the pool if there isn't one */
+static kmp_info_t **
+__kmp_numa_pool_link( numa_node_t node )
+{
+	kmp_info_t **scan;
+
+	if(node < 0)
+		return (kmp_info_t **)&__kmp_thread_pool;
+	for(scan = (kmp_info_t **)&__kmp_thread_pool; *scan; scan = &(*scan)->th.th_next_pool)
+		if((*scan)->th.th_numa_node == node)
+			return scan;
+	return (kmp_info_t **)&__kmp_thread_pool;
+}
+
+/* Rob: give each thread of a team a node of its setup & an index among the
+ * node's threads.  A team smaller than its setup (which reserved processors
+ * for nested regions) is spread across the setup's nodes in proportion to
+ * their tasks.  Threads stay on the node they already live on while it has
+ * room left, the others fill in the rest, & any threads beyond the setup's
+ * tasks aren't placed (node -1). */
+static void
+__kmp_numa_place_team( kmp_team_t *team )
+{
+	const exec_spec_t *setup = team->t.t_setup;
+	unsigned quota[MAX_NUM_NODES] = { 0 }, used[MAX_NUM_NODES] = { 0 };
+	numa_node_t node, best, num_nodes = omp_numa_num_nodes();
+	kmp_info_t *thr;
+	int i, n = KMP_MIN( team->t.t_nproc, (int)setup->num_tasks );
+
+	// Hand out threads one at a time to the node with the most tasks per thread
+	// handed out so far, i.e. every node's tasks if the team is big enough
+	for(i = 0; i < n; i++)
+	{
+		for(node = 0, best = -1; node < num_nodes; node++)
+			if(setup->task_assignment[node] > quota[node] &&
+				 (best < 0 || setup->task_assignment[node] * (quota[best] + 1) >
+											setup->task_assignment[best] * (quota[node] + 1)))
+				best = node;
+		if(best < 0)
+			break;
+		quota[best]++;
+	}
+
+	for(i = 0; i < team->t.t_nproc; i++)
+	{
+		thr = team->t.t_threads[i];
+		node = thr->th.th_numa_node;
+		if(node >= 0 && node < num_nodes && used[node] < quota[node])
+			thr->th.th_numa_idx = used[node]++;
+		else
+			thr->th.th_numa_node = -1;
+	}
+
+	for(i = 0, node = 0; i < team->t.t_nproc; i++)
+	{
+		thr = team->t.t_threads[i];
+		if(thr->th.th_numa_node >= 0)
+			continue;
+		while(node < num_nodes && used[node] >= quota[node])
+			node++;
+		if(node >= num_nodes)
+			break;
+		thr->th.th_numa_node = node;
+		thr->th.th_numa_idx = used[node]++;
+	}
+}
+
+/* Rob: divide up the parent team's setup for a nested region forked by one of
+ * its threads, on that thread's node.  The thread's index on the node comes
+ * from its position in the parent team, as placing an earlier nested team
+ * overwrote th_numa_idx. */
+static exec_spec_t *
+__kmp_numa_map_nested( kmp_team_t *parent_team, kmp_info_t *master_th,
+                       exec_spec_t *spec, unsigned min, unsigned max )
+{
+	numa_node_t node = master_th->th.th_numa_node;
+	unsigned siblings = 0, idx = 0;
+	int i;
+
+	if(node < 0)
+		return NULL;
+	for(i = 0; i < parent_team->t.t_nproc; i++)
+	{
+		if(parent_team->t.t_threads[i]->th.th_numa_node != node)
+			continue;
+		if(parent_team->t.t_threads[i] == master_th)
+			idx = siblings;
+		siblings++;
+	}
+	return omp_numa_map_nested(ipc_handle, parent_team->t.t_setup, node, idx,
+		siblings, spec, min, max);
+}
+
 /* allocate a new thread for the requesting team.  this is only called from within a
  * forkjoin critical section.  we will first try to get an available thread from the
  * thread pool.  if none is available, we will fork a new one assuming we are able
@@ -3811,9 +4013,14 @@ __kmp_allocate_thread( kmp_root_t *root, kmp_team_t *team, int new_tid )
 
     /* first, try to get one from the thread pool */
     if ( __kmp_thread_pool ) {
+        kmp_info_t **link = (kmp_info_t **)&__kmp_thread_pool;
 
-        new_thr = (kmp_info_t*)__kmp_thread_pool;
-        __kmp_thread_pool = (volatile kmp_info_t *) new_thr->th.th_next_pool;
+				/* Rob: prefer a thread already living on a node we still need */
+				if(omp_numa_forming)
+					link = __kmp_numa_pool_link( __kmp_numa_wanted_node( team, new_tid ) );
+
+        new_thr = *link;
+        *link = new_thr->th.th_next_pool;
         if ( new_thr == __kmp_thread_pool_insert_pt ) {
             __kmp_thread_pool_insert_pt = NULL;
         }
@@ -3902,6 +4109,8 @@ __kmp_allocate_thread( kmp_root_t *root, kmp_team_t *team, int new_tid )
 
     /* allocate space for it. */
     new_thr = (kmp_info_t*) __kmp_allocate( sizeof(kmp_info_t) );
+		new_thr->th.th_numa_node = -1; // Rob: not placed on a node yet
+		new_thr->th.th_numa_bound.node = -1;
 
     TCW_SYNC_PTR(__kmp_threads[new_gtid], new_thr);
 
@@ -5118,22 +5327,11 @@ __kmp_launch_thread( kmp_info_t *this_thr )
 
                 updateHWFPControl (*pteam);
 
-								/* Rob: migrate to a new node */
-								if((*pteam)->t.t_setup)
-								{
-									numa_node_t cur_node;
-									int t_count = 0;
-									for(cur_node = 0; cur_node < omp_numa_num_nodes(); cur_node++)
-									{
-										t_count += (*pteam)->t.t_setup->task_assignment[cur_node];
-										if(gtid < t_count)
-										{
-											OMP_NUMA_DEBUG("migrating thread %d to node %d\n", gtid, cur_node);
-											numa_run_on_node(cur_node);
-											break;
-										}
-									}
-								}
+								/* Rob: migrate to our node (or CPU), unless we're already bound there */
+								if((*pteam)->t.t_setup && this_thr->th.th_numa_node >= 0)
+									omp_numa_bind_node(ipc_handle, (*pteam)->t.t_setup,
+										this_thr->th.th_numa_node, this_thr->th.th_numa_idx,
+										&this_thr->th.th_numa_bound);
 
                 KMP_STOP_EXPLICIT_TIMER(USER_launch_thread_loop);
                 {
@@ -6552,22 +6750,10 @@ __kmp_internal_fork( ident_t *id, int gtid, kmp_team_t *team )
     /* release the worker threads so they may begin working */
     __kmp_fork_barrier( gtid, 0 );
 
-		/* Rob: migrate to a new node */
-		if(team->t.t_setup)
-		{
-			numa_node_t cur_node;
-			int t_count = 0;
-			for(cur_node = 0; cur_node < omp_numa_num_nodes(); cur_node++)
-			{
-				t_count += team->t.t_setup->task_assignment[cur_node];
-				if(gtid < t_count)
-				{
-					OMP_NUMA_DEBUG("migrating thread %d to node %d\n", gtid, cur_node);
-					numa_run_on_node(cur_node);
-					break;
-				}
-			}
-		}
+		/* Rob: migrate to our node (or CPU), unless we're already bound there */
+		if(team->t.t_setup && this_thr->th.th_numa_node >= 0)
+			omp_numa_bind_node(ipc_handle, team->t.t_setup, this_thr->th.th_numa_node,
+				this_thr->th.th_numa_idx, &this_thr->th.th_numa_bound);
 }
 
 
@@ -6649,6 +6835,7 @@ __kmp_load_balance_nproc( kmp_root_t *root, int set_nproc )
     int hot_team_active;
     int team_curr_active;
     int system_active;
+	omp_numa_load_t omp_numa_load;
 
     KB_TRACE( 20, ("__kmp_load_balance_nproc: called root:%p set_nproc:%d\n",
                 root, set_nproc ) );
@@ -6675,7 +6862,13 @@ __kmp_load_balance_nproc( kmp_root_t *root, int set_nproc )
     //
     // Check the system load.
     //
-    system_active = __kmp_get_load_balance( __kmp_avail_proc + team_curr_active );
+	/* Rob: the shepherd samples the load for every application, only scan /proc
+	 * ourselves if it hasn't recently (i.e. within our own sampling interval) */
+	if(ipc_handle && omp_numa_system_load(ipc_handle,
+				(unsigned)(__kmp_load_balance_interval * 1000), &omp_numa_load))
+		system_active = omp_numa_load.running;
+	else
+		system_active = __kmp_get_load_balance( __kmp_avail_proc + team_curr_active );
     KB_TRACE( 30, ("__kmp_load_balance_nproc: system active = %d pool active = %d hot team active = %d\n",
       system_active, pool_active, hot_team_active ) );
 
@@ -742,6 +742,13 @@ else # norm or prof
         kmp_itt                      \
 				numa_ctl                     \
         sched_comm                   \
+        sched_policy                 \
+        sched_feedback               \
+        sched_residency              \
+        sched_migrate                \
+        sched_central                \
+        sched_trace                  \
+        sched_load                   \
         $(empty)
     ifeq "$(USE_ITT_NOTIFY)" "1"
         lib_c_items +=  ittnotify_static
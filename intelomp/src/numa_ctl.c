@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
 /* For system scheduling API */
@@ -234,6 +235,45 @@ void numa_task_info(char* str, size_t str_size)
 	numa_bitmask_free(cm);
 }
 
+int numa_resident_memory(unsigned long long* kb, size_t num_nodes)
+{
+	unsigned long page_kb, count;
+	char* line = NULL, *tok, *save;
+	size_t line_size = 0, i;
+	int node;
+
+	FILE* fp = fopen("/proc/self/numa_maps", "r");
+	if(!fp)
+		return -1;
+
+	for(i = 0; i < num_nodes; i++)
+		kb[i] = 0;
+
+	/* Each line describes a mapping, e.g.:
+	 *   7f0c4e000000 default anon=512 dirty=512 N0=256 N1=256 kernelpagesize_kB=4
+	 * Skip file-backed mappings, their pages are (usually) not the
+	 * application's data.
+	 */
+	while(getline(&line, &line_size, fp) > 0)
+	{
+		if(strstr(line, " file=") && !strstr(line, " anon="))
+			continue;
+
+		page_kb = 4;
+		if((tok = strstr(line, "kernelpagesize_kB=")))
+			sscanf(tok, "kernelpagesize_kB=%lu", &page_kb);
+
+		for(tok = strtok_r(line, " \n", &save); tok; tok = strtok_r(NULL, " \n", &save))
+			if(sscanf(tok, "N%d=%lu", &node, &count) == 2 &&
+				 node >= 0 && (size_t)node < num_nodes)
+				kb[node] += (unsigned long long)count * page_kb;
+	}
+
+	free(line);
+	fclose(fp);
+	return 0;
+}
+
 void numa_nodemask_to_cpumask(const struct bitmask* nodes, struct bitmask* cpus)
 {
 	struct bitmask* temp_cpus = numa_allocate_cpumask(); 
@@ -152,6 +152,16 @@ void numa_mem_info(char* str, size_t str_size);
  */
 void numa_task_info(char* str, size_t str_size);
 
+/**
+ * Sum up the calling process's resident anonymous (i.e. heap, stack &
+ * private mmap) memory on each node, in kilobytes, from /proc/self/numa_maps.
+ *
+ * @param kb array to be populated with per-node resident memory
+ * @param num_nodes number of elements in kb
+ * @return 0 if successful, -1 otherwise
+ */
+int numa_resident_memory(unsigned long long* kb, size_t num_nodes);
+
 /**
  * Convert a node mask into a CPU mask with all CPUs contained by the nodes in
  * the node mask.
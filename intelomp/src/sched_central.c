@@ -0,0 +1,293 @@
+/*
+ * Central scheduling - rather than every application greedily mapping itself
+ * against its own view of the counters (where early arrivals grab whole nodes
+ * & latecomers get the leftovers), the shepherd re-solves the assignment of
+ * all attached applications whenever one arrives or leaves & publishes each
+ * application's allotment in its slot.  Applications using the central
+ * policy adopt their allotment at their next mapping.
+ *
+ * The solution is a greedy approximation of a min-cost assignment:
+ *
+ * 1. Processors are shared in proportion to the applications' weights, capped
+ *    at each application's maximum if it has one (leftovers go to the others)
+ * 2. Applications are placed largest share first.  Each one starts on the
+ *    node of its previous allotment with the most free processors (or the
+ *    node with the most free processors), then spills over onto the free
+ *    nodes closest to the ones already chosen, preferring nodes of its
+ *    previous allotment so that applications aren't moved needlessly.  Among
+ *    equally close nodes, it avoids those of other applications' previous
+ *    allotments.
+ * 3. If applications outnumber processors, tasks go to the least-loaded nodes
+ */
+
+#include "sched_comm_internal.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Prototypes for internal functions
+///////////////////////////////////////////////////////////////////////////////
+
+static void calc_shares(omp_numa_app** apps, unsigned num_apps, unsigned* shares);
+static void place_app(omp_numa_t* handle,
+											omp_numa_app* app,
+											unsigned share,
+											const unsigned* claimed,
+											unsigned* free_procs,
+											unsigned* load,
+											unsigned* assignment);
+static void publish_allotment(omp_numa_shmem* shmem,
+															omp_numa_app* app,
+															unsigned num_tasks,
+															const unsigned* assignment,
+															unsigned gen);
+
+///////////////////////////////////////////////////////////////////////////////
+// Central scheduler (shepherd)
+///////////////////////////////////////////////////////////////////////////////
+
+int omp_numa_wait_requests(omp_numa_t* handle, unsigned timeout_ms)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout_ms / 1000;
+	ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if(ts.tv_nsec >= 1000000000L)
+	{
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	if(sem_timedwait(&handle->shmem->sched_sem, &ts))
+		return 0;
+
+	// Coalesce requests which arrived in the meantime
+	while(!sem_trywait(&handle->shmem->sched_sem));
+	return 1;
+}
+
+int omp_numa_schedule(omp_numa_t* handle)
+{
+	omp_numa_app* apps[MAX_NUM_APPS];
+	unsigned shares[MAX_NUM_APPS], order[MAX_NUM_APPS];
+	unsigned free_procs[MAX_NUM_NODES], load[MAX_NUM_NODES];
+	unsigned claimed[MAX_NUM_NODES], assignment[MAX_NUM_NODES];
+	unsigned num_apps = 0, i, j, gen;
+	numa_node_t node;
+
+	for(i = 0; i < MAX_NUM_APPS; i++)
+		if(__atomic_load_n(&handle->shmem->apps[i].pid, __ATOMIC_ACQUIRE) > 0)
+			apps[num_apps++] = &handle->shmem->apps[i];
+	if(!num_apps)
+		return 0;
+
+	calc_shares(apps, num_apps, shares);
+
+	// Largest shares first (insertion sort, stable)
+	for(i = 0; i < num_apps; i++)
+	{
+		for(j = i; j > 0 && shares[order[j - 1]] < shares[i]; j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+
+	for(node = 0; node < __num_nodes; node++)
+	{
+		free_procs[node] = NODE_NUM_CPUS(node);
+		load[node] = 0;
+		claimed[node] = 0;
+		for(i = 0; i < num_apps; i++)
+			if(apps[i]->alloc_gen &&
+				 app_node(handle->shmem, apps[i], node)->alloc_tasks)
+				claimed[node]++;
+	}
+
+	gen = __atomic_add_fetch(&handle->shmem->sched_gen, 1, __ATOMIC_RELAXED);
+	for(i = 0; i < num_apps; i++)
+	{
+		omp_numa_app* app = apps[order[i]];
+		place_app(handle, app, shares[order[i]], claimed, free_procs, load,
+							assignment);
+		publish_allotment(handle->shmem, app, shares[order[i]], assignment, gen);
+		OMP_NUMA_DEBUG("allotted %u tasks to %d\n", shares[order[i]], app->pid);
+	}
+
+	// Invalidate leases so that applications pick up their new allotments
+	bump_epoch(handle->shmem);
+	return num_apps;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Applications
+///////////////////////////////////////////////////////////////////////////////
+
+int __omp_numa_adopt_allotment(omp_numa_t* handle, exec_spec_t* spec)
+{
+	omp_numa_app* app = handle->app;
+	numa_node_t node;
+	unsigned seq;
+
+	if(!app || !__atomic_load_n(&app->alloc_gen, __ATOMIC_ACQUIRE))
+		return 0;
+
+	// Per-slot seqlock, the shepherd may be publishing a new allotment
+	do
+	{
+		while((seq = __atomic_load_n(&app->alloc_seq, __ATOMIC_ACQUIRE)) & 1)
+			CPU_RELAX();
+		spec->num_tasks = app->alloc_num_tasks;
+		for(node = 0; node < __num_nodes; node++)
+			spec->task_assignment[node] =
+				app_node(handle->shmem, app, node)->alloc_tasks;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while(__atomic_load_n(&app->alloc_seq, __ATOMIC_RELAXED) != seq);
+
+	return 1;
+}
+
+void __omp_numa_post_request(omp_numa_t* handle)
+{
+	sem_post(&handle->shmem->sched_sem);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Miscellaneous helpers
+///////////////////////////////////////////////////////////////////////////////
+
+/* Water-fill processors in proportion to weights, capped at each
+ * application's maximum.  Every application gets at least one processor.
+ */
+void calc_shares(omp_numa_app** apps, unsigned num_apps, unsigned* shares)
+{
+	unsigned remaining = __num_procs, total_weight, i, share;
+	int capped[MAX_NUM_APPS], changed = 1;
+
+	for(i = 0; i < num_apps; i++)
+	{
+		shares[i] = 1;
+		capped[i] = 0;
+	}
+	remaining = remaining > num_apps ? remaining - num_apps : 0;
+
+	// Hand out the remaining processors by weight, redistributing whatever
+	// capped applications can't use
+	while(remaining && changed)
+	{
+		changed = 0;
+		total_weight = 0;
+		for(i = 0; i < num_apps; i++)
+			if(!capped[i])
+				total_weight += MAX(apps[i]->weight, 1);
+		if(!total_weight)
+			break;
+
+		unsigned handed_out = 0;
+		for(i = 0; i < num_apps && handed_out < remaining; i++)
+		{
+			if(capped[i])
+				continue;
+			share = MAX(remaining * MAX(apps[i]->weight, 1) / total_weight, 1);
+			share = MIN(share, remaining - handed_out);
+			if(apps[i]->max_tasks && shares[i] + share >= apps[i]->max_tasks)
+			{
+				share = apps[i]->max_tasks > shares[i] ?
+								apps[i]->max_tasks - shares[i] : 0;
+				capped[i] = 1;
+			}
+			shares[i] += share;
+			handed_out += share;
+			if(share)
+				changed = 1;
+		}
+		remaining -= handed_out;
+	}
+}
+
+/* Place an application's share onto nodes (see the top of the file) */
+void place_app(omp_numa_t* handle,
+							 omp_numa_app* app,
+							 unsigned share,
+							 const unsigned* claimed,
+							 unsigned* free_procs,
+							 unsigned* load,
+							 unsigned* assignment)
+{
+	unsigned cost[MAX_NUM_NODES], others[MAX_NUM_NODES], chunk;
+	unsigned remaining = share;
+	int prev[MAX_NUM_NODES], have_prev = app->alloc_gen != 0;
+	numa_node_t node, chosen, other;
+
+	for(node = 0; node < __num_nodes; node++)
+	{
+		assignment[node] = 0;
+		cost[node] = 0;
+		prev[node] = have_prev &&
+								 app_node(handle->shmem, app, node)->alloc_tasks;
+		others[node] = claimed[node] - prev[node];
+	}
+
+	while(remaining)
+	{
+		chosen = -1;
+		for(node = 0; node < __num_nodes; node++)
+		{
+			if(!free_procs[node])
+				continue;
+			if(chosen < 0 ||
+				 prev[node] > prev[chosen] ||
+				 (prev[node] == prev[chosen] &&
+					(cost[node] < cost[chosen] ||
+					 (cost[node] == cost[chosen] &&
+						(others[node] < others[chosen] ||
+						 (others[node] == others[chosen] &&
+							free_procs[node] > free_procs[chosen]))))))
+				chosen = node;
+		}
+		if(chosen < 0)
+			break;
+
+		chunk = MIN(remaining, free_procs[chosen]);
+		assignment[chosen] += chunk;
+		free_procs[chosen] -= chunk;
+		load[chosen] += chunk;
+		remaining -= chunk;
+		prev[chosen] = 0;
+
+		for(other = 0; other < __num_nodes; other++)
+			cost[other] += *shmem_distance(handle->shmem, other, chosen) +
+										 *shmem_distance(handle->shmem, chosen, other);
+	}
+
+	// Out of processors - oversubscribe the nodes with the fewest tasks per CPU
+	while(remaining)
+	{
+		chosen = -1;
+		for(node = 0; node < __num_nodes; node++)
+			if(NODE_NUM_CPUS(node) &&
+				 (chosen < 0 ||
+					(unsigned long long)load[node] * NODE_NUM_CPUS(chosen) <
+						(unsigned long long)load[chosen] * NODE_NUM_CPUS(node)))
+				chosen = node;
+		if(chosen < 0)
+			chosen = 0;
+		assignment[chosen]++;
+		load[chosen]++;
+		remaining--;
+	}
+}
+
+/* Publish an allotment in an application's slot */
+void publish_allotment(omp_numa_shmem* shmem,
+											 omp_numa_app* app,
+											 unsigned num_tasks,
+											 const unsigned* assignment,
+											 unsigned gen)
+{
+	numa_node_t node;
+
+	__atomic_add_fetch(&app->alloc_seq, 1, __ATOMIC_ACQ_REL);
+	app->alloc_num_tasks = num_tasks;
+	for(node = 0; node < __num_nodes; node++)
+		app_node(shmem, app, node)->alloc_tasks = assignment[node];
+	__atomic_add_fetch(&app->alloc_seq, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&app->alloc_gen, gen, __ATOMIC_RELEASE);
+}
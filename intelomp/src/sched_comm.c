@@ -1,106 +1,84 @@
-#include <stdlib.h>
-#include <stdio.h>
-#include <math.h>
-#include <assert.h>
-
-/* Shared-memory API */
-#include <sys/mman.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <unistd.h>
-#include <fcntl.h>
-
-/* Threading API */
-#include <semaphore.h>
-#include <pthread.h>
-#include <sys/sysinfo.h>
-
-#include <sched_comm.h>
+#include "sched_comm_internal.h"
 
 ///////////////////////////////////////////////////////////////////////////////
 // Internal definitions
 ///////////////////////////////////////////////////////////////////////////////
 
-/* Specify lock type (only leave one uncommented!) */
-#define _USE_SPINLOCK
-//#define _USE_SEMAPHORE
-
-#ifdef _USE_SPINLOCK
-#ifdef _USE_SEMAPHORE
-#error Please use either a spinlock or a semaphore!
-#endif
-#endif
-
-#define SHMEM_FILE "omp_numa"
-#define MAX( a, b ) (a > b ? a : b)
-#define MIN( a, b ) (a < b ? a : b)
-
-/* Error-reporting */
-#define INIT_PERROR( msg, handle ) { \
-	perror(msg); \
-	free(handle); \
-	return NULL; \
-}
-
-#define ERROR( msg ) fprintf(stderr, "ERROR: " msg)
-
-#ifdef _VERBOSE
-#define WARN( msg ) fprintf(stderr, "WARNING: " msg)
-#else
-#define WARN( msg )
-#endif
-
-static numa_node_t __num_nodes;
-static unsigned __num_procs;
-static unsigned __num_procs_per_node;
-
-/* Shared-memory data & application handle */
-typedef struct omp_numa_shmem {
-	/* POSIX locking for concurrency updates */
-#ifdef _USE_SPINLOCK
-	pthread_spinlock_t lock;
-#else
-	sem_t lock;
-#endif
-
-	/* Runtime environment information:
-	 *   1. Number of OpenMP applications
-	 *   2. Number of tasks for all OpenMP applications
-	 *   3. Current NUMA node, for filling in a round-robin fasion
-	 */
-	unsigned num_omp_applications;
-	unsigned num_omp_tasks;
-	numa_node_t cur_rr_node; // TODO needed?
-
-	/* Per-node task information:
-	 *   1. Per-node OpenMP application count (# applications mapped to node)
-	 *   2. Per-node OpenMP task counters (# tasks mapped to node)
-	 */
-	unsigned node_application_count[MAX_NUM_NODES];
-	unsigned node_task_count[MAX_NUM_NODES];
-} omp_numa_shmem;
-
-struct omp_numa_t {
-	int shmem_fd;
-	struct stat shmem_fd_stats;
-
-	/* Previous execution setup - used to attempt to place nodes near memory 
-	 * from previous executions
-	 */
-	exec_spec_t prev_setup;
-
-	/* Actual shared memory between processes */
-	omp_numa_shmem* shmem;
+numa_node_t __num_nodes;
+unsigned __num_procs;
+unsigned __num_procs_per_node;
+unsigned short __node_cpus[MAX_NUM_CPUS];
+unsigned __node_cpu_offset[MAX_NUM_NODES + 1];
+unsigned __num_cpu_words;
+
+/* Quality-of-service class names, indexed by class */
+static const char* __class_names[OMP_NUMA_NUM_CLASSES] = {
+	"best-effort",
+	"latency-critical",
 };
 
 ///////////////////////////////////////////////////////////////////////////////
 // Prototypes for internal functions
 ///////////////////////////////////////////////////////////////////////////////
 
-static unsigned calc_num_tasks(omp_numa_t* handle, omp_numa_flags flags);
-static exec_spec_t* map_tasks_to_nodes(omp_numa_t* handle,
-																			 unsigned num_tasks,
-																			 omp_numa_flags flags);
+static void init_topology();
+static void assign_cpus(omp_numa_t* handle, exec_spec_t* spec);
+static void add_spec(omp_numa_t* handle, exec_spec_t* spec);
+static void remove_spec(omp_numa_t* handle, exec_spec_t* spec);
+static exec_spec_t* map_tasks(omp_numa_t* handle,
+															exec_spec_t* spec,
+															int decide,
+															omp_numa_flags flags);
+static exec_spec_t* lease_tasks(omp_numa_t* handle,
+																exec_spec_t* spec,
+																omp_numa_flags flags);
+static void set_bounds(omp_numa_t* handle,
+											 unsigned min,
+											 unsigned pref,
+											 unsigned max);
+static int in_bounds(omp_numa_t* handle, unsigned num_tasks);
+static int decide_tasks(omp_numa_t* handle,
+												const omp_numa_policy_t* policy,
+												exec_spec_t* spec,
+												omp_numa_flags flags);
+static void count_resize(omp_numa_t* handle, const exec_spec_t* spec, int damped);
+static int task_cpu(omp_numa_t* handle,
+										const exec_spec_t* spec,
+										numa_node_t node,
+										unsigned idx);
+static exec_spec_t* renew_lease(omp_numa_t* handle, omp_numa_flags flags);
+static void attach_app(omp_numa_t* handle);
+static void detach_app(omp_numa_t* handle);
+static int app_alive(const omp_numa_app* app, pid_t pid);
+static int reap_app(omp_numa_t* handle, omp_numa_app* app, pid_t pid);
+static int proc_stat(pid_t pid, char* state, unsigned long long* start_time);
+static size_t layout_segment(omp_numa_header* hdr,
+														 numa_node_t num_nodes,
+														 unsigned num_cpus);
+static size_t max_segment_size();
+static int segment_compatible(omp_numa_t* handle);
+static int open_segment(omp_numa_t* handle, omp_numa_flags flags);
+static int create_segment(omp_numa_t* handle, omp_numa_flags flags);
+static int join_segment(omp_numa_t* handle, omp_numa_flags flags);
+static int init_segment(omp_numa_t* handle);
+static int attach_segment(omp_numa_t* handle, omp_numa_flags flags);
+static void detach_segment(omp_numa_t* handle, omp_numa_flags flags);
+static int lock_init(omp_numa_shmem* shmem);
+static void admit(omp_numa_t* handle);
+static int try_admit(omp_numa_t* handle, unsigned needed);
+static void drop_pledge(omp_numa_shmem* shmem, omp_numa_app* app);
+static void count_critical(omp_numa_shmem* shmem,
+													 int sign,
+													 unsigned specs,
+													 unsigned weight,
+													 unsigned num_tasks,
+													 const unsigned* task_assignment);
+static void app_task_assignment(omp_numa_shmem* shmem,
+																omp_numa_app* app,
+																unsigned* task_assignment);
+static void clear_arrays(omp_numa_shmem* shmem);
+static void clear_reservations(omp_numa_shmem* shmem, omp_numa_app* app);
+static void save_prev_setup(omp_numa_t* handle, const exec_spec_t* spec);
 
 ///////////////////////////////////////////////////////////////////////////////
 // Initialization & shutdown
@@ -110,85 +88,170 @@ omp_numa_t* omp_numa_initialize(omp_numa_flags flags)
 {
 	int i = 0;
 	omp_numa_t* new_handle = (omp_numa_t*)malloc(sizeof(omp_numa_t));
+	pthread_mutex_init(&new_handle->lock, NULL);
+	pthread_mutex_init(&new_handle->trace_lock, NULL);
 	new_handle->shmem_fd = -1;
 	new_handle->shmem = NULL;
+	new_handle->lease_ns = 0;
+	new_handle->lease_held = 0;
+	new_handle->lease_users = 0;
+	new_handle->env_policy = NULL;
+	new_handle->policy = NULL;
+	new_handle->weight = 1;
+	new_handle->qos_class = OMP_NUMA_BEST_EFFORT;
+	new_handle->app = NULL;
+	new_handle->regions = 0;
+	memset(new_handle->profiles, 0, sizeof(new_handle->profiles));
 
-	// Open shared-memory file
-	if(IS_SHEPHERD(flags))
+	// Initialize internal values
+	init_topology();
+
+	// Open shared-memory file, creating it if we're the first one here
+	OMP_NUMA_DEBUG("initializing OpenMP/NUMA handle (%s)\n",
+		IS_SHEPHERD(flags) ? "shepherd" : "non-shepherd");
+	if(open_segment(new_handle, flags))
 	{
-		OMP_NUMA_DEBUG("initializing OpenMP/NUMA handle (shepherd)\n");
-		new_handle->shmem_fd = shm_open(SHMEM_FILE, O_RDWR | O_CREAT | O_EXCL, 0666);
+		pthread_mutex_destroy(&new_handle->lock);
+		pthread_mutex_destroy(&new_handle->trace_lock);
+		free(new_handle);
+		return NULL;
 	}
-	else
+
+	new_handle->prev_setup.num_tasks = 0;
+	for(i = 0; i < __num_nodes; i++)
+		new_handle->prev_setup.task_assignment[i] = 1;
+	memset(new_handle->prev_setup.cpus, 0, sizeof(new_handle->prev_setup.cpus));
+
+	// Check to see if thread placement should follow memory residency
+	new_handle->residency_ns = 0;
+	new_handle->residency_gen = 0;
+	new_handle->residency_used_gen = 0;
+	new_handle->resident = 0;
+	if(!IS_SHEPHERD(flags) && getenv(OMP_NUMA_RESIDENCY))
+	{
+		new_handle->residency_ns = strtoull(getenv(OMP_NUMA_RESIDENCY), NULL, 10) *
+															 1000000ULL;
+		OMP_NUMA_DEBUG("sampling memory residency every %llu ns\n",
+			new_handle->residency_ns);
+	}
+
+	// Check to see if pages should follow remapped tasks
+	new_handle->migrate_rate = 0;
+	new_handle->migrate_started = 0;
+	if(!IS_SHEPHERD(flags) && getenv(OMP_NUMA_MIGRATE) &&
+		 atoi(getenv(OMP_NUMA_MIGRATE)) > 0)
 	{
-		OMP_NUMA_DEBUG("initializing OpenMP/NUMA handle (non-shepherd)\n");
-		new_handle->shmem_fd = shm_open(SHMEM_FILE, O_RDWR, 0666);
+		new_handle->migrate_rate = strtoull(getenv(OMP_NUMA_MIGRATE), NULL, 10) *
+															 1024ULL * 1024ULL;
 	}
 
-	if(new_handle->shmem_fd < 0)
-		INIT_PERROR("Could not open shared-memory device (is the shepherd running?)",
-			new_handle);
+	// Both sampling residency & migrating pages happen on the helper thread
+	if(new_handle->residency_ns || new_handle->migrate_rate)
+		__omp_numa_start_helper(new_handle);
 
-	// Get size & initialize if necessary
-	// NOTE: not thread-safe! Written with the expectation that a single process
-	// is responsible for initializing & cleaning up the shared memory
-	if(fstat(new_handle->shmem_fd, &new_handle->shmem_fd_stats))
-		INIT_PERROR("Could not get shared-memory file statistics", new_handle);
+	// Check to see if tasks should be pinned to CPUs
+	new_handle->bind_cpus = getenv(OMP_NUMA_CPU_BINDING) &&
+													!strcmp(getenv(OMP_NUMA_CPU_BINDING), "1");
 
-	// Resize
-	if(IS_SHEPHERD(flags))
-		if(ftruncate(new_handle->shmem_fd, sizeof(omp_numa_shmem)))
-			INIT_PERROR("Could not resize shared-memory file", new_handle);
-
-	// Map into memory
-	if((new_handle->shmem = (omp_numa_shmem*)mmap(NULL,
-																								sizeof(omp_numa_shmem),
-																								PROT_WRITE,
-																								MAP_SHARED,
-																								new_handle->shmem_fd,
-																								0))
-																										== MAP_FAILED)
-		INIT_PERROR("Could not map shared-memory into process", new_handle);
+	// Check to see if mapping decisions should be traced
+	new_handle->trace = !IS_SHEPHERD(flags) && getenv(OMP_NUMA_TRACE) &&
+											atoi(getenv(OMP_NUMA_TRACE)) > 0;
+	memset(new_handle->trace_drops, 0, sizeof(new_handle->trace_drops));
 
-	if(IS_SHEPHERD(flags))
+	// The shepherd's first load sample is relative to boot
+	memset(new_handle->load_busy, 0, sizeof(new_handle->load_busy));
+	memset(new_handle->load_total, 0, sizeof(new_handle->load_total));
+
+	// Check to see if lease-based allocations are enabled
+	if(!IS_SHEPHERD(flags) && getenv(OMP_NUMA_LEASE))
 	{
-		// Initialize lock
-#ifdef _USE_SPINLOCK
-		if(pthread_spin_init(&new_handle->shmem->lock, PTHREAD_PROCESS_SHARED))
-			INIT_PERROR("Could not initialize spin lock", new_handle);
-		pthread_spin_lock(&new_handle->shmem->lock);
-#else
-		if(sem_init(&new_handle->shmem->lock, 1, 1))
-			INIT_PERROR("Could not initialize semaphore", new_handle);
-		sem_wait(&new_handle->shmem->lock);
-#endif
+		new_handle->lease_ns = strtoull(getenv(OMP_NUMA_LEASE), NULL, 10) *
+													 1000000ULL;
+		OMP_NUMA_DEBUG("leasing allocations for %llu ns\n", new_handle->lease_ns);
+	}
 
-		// Initialize shared memory
-		new_handle->shmem->num_omp_applications = 0;
-		new_handle->shmem->num_omp_tasks = 0;
-		new_handle->shmem->cur_rr_node = 0;
+	// Check to see if the application requested a mapping policy or weight
+	if(!IS_SHEPHERD(flags) && getenv(OMP_NUMA_POLICY))
+	{
+		int policy = __omp_numa_find_policy(getenv(OMP_NUMA_POLICY));
+		if(policy >= 0)
+			new_handle->env_policy = __omp_numa_get_policy(policy);
+		else
+			fprintf(stderr, "WARNING: unknown mapping policy '%s', using the "
+				"shepherd's\n", getenv(OMP_NUMA_POLICY));
+	}
 
-		for(i = 0; i < __num_nodes; i++)
-		{
-			new_handle->shmem->node_application_count[i] = 0;
-			new_handle->shmem->node_task_count[i] = 0;
-		}
+	if(getenv(OMP_NUMA_WEIGHT) && atoi(getenv(OMP_NUMA_WEIGHT)) > 0)
+		new_handle->weight = atoi(getenv(OMP_NUMA_WEIGHT));
 
-#ifdef _USE_SPINLOCK
-		pthread_spin_unlock(&new_handle->shmem->lock);
-#else
-		sem_post(&new_handle->shmem->lock);
-#endif
+	if(!IS_SHEPHERD(flags) && getenv(OMP_NUMA_CLASS))
+	{
+		for(i = 0; i < OMP_NUMA_NUM_CLASSES; i++)
+			if(!strcmp(getenv(OMP_NUMA_CLASS), __class_names[i]))
+				break;
+		if(i < OMP_NUMA_NUM_CLASSES)
+			new_handle->qos_class = i;
+		else
+			fprintf(stderr, "WARNING: unknown quality-of-service class '%s', using "
+				"%s\n", getenv(OMP_NUMA_CLASS), __class_names[OMP_NUMA_BEST_EFFORT]);
 	}
 
-	new_handle->prev_setup.num_tasks = 0;
-	for(i = 0; i < __num_nodes; i++)
-		new_handle->prev_setup.task_assignment[i] = 1;
+	// Check to see if thread-count decisions should be damped
+	new_handle->damping = 0;
+	new_handle->damp_threshold = 0;
+	new_handle->shrink_delay_ns = 0;
+	new_handle->shrink_since = 0;
+	new_handle->grow_interval_ns = 0;
+	new_handle->last_resize = 0;
+	if(!IS_SHEPHERD(flags))
+	{
+		if(getenv(OMP_NUMA_DAMP_THRESHOLD) &&
+			 atoi(getenv(OMP_NUMA_DAMP_THRESHOLD)) > 0)
+			new_handle->damp_threshold = atoi(getenv(OMP_NUMA_DAMP_THRESHOLD));
+		if(getenv(OMP_NUMA_SHRINK_DELAY))
+			new_handle->shrink_delay_ns =
+				strtoull(getenv(OMP_NUMA_SHRINK_DELAY), NULL, 10) * 1000000ULL;
+		if(getenv(OMP_NUMA_GROW_INTERVAL))
+			new_handle->grow_interval_ns =
+				strtoull(getenv(OMP_NUMA_GROW_INTERVAL), NULL, 10) * 1000000ULL;
+		new_handle->damping = new_handle->damp_threshold ||
+													new_handle->shrink_delay_ns ||
+													new_handle->grow_interval_ns;
+		if(new_handle->damping)
+			OMP_NUMA_DEBUG("damping resizes below %u tasks, shrinking after %llu ns, "
+				"growing every %llu ns\n", new_handle->damp_threshold,
+				new_handle->shrink_delay_ns, new_handle->grow_interval_ns);
+	}
 
-	// Initialize internal values
-	__num_nodes = MIN(numa_num_configured_nodes(), MAX_NUM_NODES);
-	__num_procs = get_nprocs();
-	__num_procs_per_node = __num_procs / __num_nodes; //Assuming even number...
+	// Check to see if the number of tasks should be bounded
+	new_handle->range_min = new_handle->range_pref = new_handle->range_max = 0;
+	new_handle->bound_min = new_handle->bound_pref = new_handle->bound_max = 0;
+	if(!IS_SHEPHERD(flags) && getenv(OMP_NUMA_RANGE))
+	{
+		unsigned min, pref, max;
+		if(sscanf(getenv(OMP_NUMA_RANGE), "%u:%u:%u", &min, &pref, &max) != 3 ||
+			 omp_numa_request_range(new_handle, min, pref, max))
+			fprintf(stderr, "WARNING: invalid task bounds '%s', expected "
+				"min:pref:max\n", getenv(OMP_NUMA_RANGE));
+	}
+
+	// Check to see if the application should wait for a large enough share
+	new_handle->admit_min = 0;
+	new_handle->admit_timeout_ns = ADMIT_TIMEOUT_MS * 1000000ULL;
+	new_handle->admitted = 0;
+	if(!IS_SHEPHERD(flags) && getenv(OMP_NUMA_ADMIT_MIN) &&
+		 atoi(getenv(OMP_NUMA_ADMIT_MIN)) > 0)
+	{
+		new_handle->admit_min = atoi(getenv(OMP_NUMA_ADMIT_MIN));
+		if(getenv(OMP_NUMA_ADMIT_TIMEOUT))
+			new_handle->admit_timeout_ns =
+				strtoull(getenv(OMP_NUMA_ADMIT_TIMEOUT), NULL, 10) * 1000000ULL;
+		OMP_NUMA_DEBUG("waiting for a share of %u processors before starting\n",
+			new_handle->admit_min);
+	}
+
+	if(!IS_SHEPHERD(flags))
+		attach_app(new_handle);
 
 	return new_handle;
 }
@@ -196,17 +259,14 @@ omp_numa_t* omp_numa_initialize(omp_numa_flags flags)
 void omp_numa_shutdown(omp_numa_t* handle, omp_numa_flags flags)
 {
 	OMP_NUMA_DEBUG("shutting down\n");
-	munmap(handle->shmem, sizeof(omp_numa_shmem));
+	__omp_numa_stop_helper(handle);
+	omp_numa_release_lease(handle);
+	detach_app(handle);
+	detach_segment(handle, flags);
+	munmap(handle->shmem, handle->shmem_map_size);
 	close(handle->shmem_fd);
-	if(IS_SHEPHERD(flags))
-	{
-#ifdef _USE_SPINLOCK
-		pthread_spin_destroy(&handle->shmem->lock);
-#else
-		sem_destroy(&handle->shmem->lock);
-#endif
-		shm_unlink(SHMEM_FILE);
-	}
+	pthread_mutex_destroy(&handle->lock);
+	pthread_mutex_destroy(&handle->trace_lock);
 	free(handle);
 }
 
@@ -229,25 +289,42 @@ unsigned omp_numa_num_procs_per_node()
 	return __num_procs_per_node;
 }
 
+unsigned omp_numa_node_num_cpus(numa_node_t node)
+{
+	assert(node < MAX_NUM_NODES);
+	if(node >= __num_nodes)
+		return 0;
+	return NODE_NUM_CPUS(node);
+}
+
+unsigned omp_numa_node_distance(omp_numa_t* handle,
+																numa_node_t from,
+																numa_node_t to)
+{
+	assert(from < MAX_NUM_NODES && to < MAX_NUM_NODES);
+	return *shmem_distance(handle->shmem, from, to);
+}
+
 int omp_numa_num_tasks(omp_numa_t* handle, numa_node_t node, omp_numa_flags flags)
 {
 	assert(node < MAX_NUM_NODES);
 
 	if(DO_FAST_CHECK(flags)) // Get potentially outdated value
-		return handle->shmem->node_task_count[node];
+		return shmem_node(handle->shmem, node)->task_count;
 	else // Get guaranteed up-to-date value
 	{
 		int result = -1;
-#ifdef _USE_SPINLOCK
-		pthread_spin_lock(&handle->shmem->lock);
-#else
-		sem_wait(&handle->shmem->lock);
-#endif
-		result = handle->shmem->node_task_count[node];
-#ifdef _USE_SPINLOCK
-		pthread_spin_unlock(&handle->shmem->lock);
+#ifdef _USE_SEQLOCK
+		unsigned seq;
+		do
+		{
+			seq = seq_read_begin(handle->shmem);
+			result = shmem_node(handle->shmem, node)->task_count;
+		} while(seq_read_retry(handle->shmem, seq));
 #else
-		sem_post(&handle->shmem->lock);
+		shmem_lock(handle->shmem);
+		result = shmem_node(handle->shmem, node)->task_count;
+		shmem_unlock(handle->shmem);
 #endif
 		return result;
 	}
@@ -263,23 +340,110 @@ void omp_numa_task_assignment(omp_numa_t* handle,
 	if(DO_FAST_CHECK(flags))
 	{
 		for(i = 0; i < num_elems; i++)
-			task_assignment[i] = handle->shmem->node_task_count[i];
+			task_assignment[i] = shmem_node(handle->shmem, i)->task_count;
 	}
 	else
 	{
-#ifdef _USE_SPINLOCK
-		pthread_spin_lock(&handle->shmem->lock);
+#ifdef _USE_SEQLOCK
+		unsigned seq;
+		do
+		{
+			seq = seq_read_begin(handle->shmem);
+			for(i = 0; i < num_elems; i++)
+				task_assignment[i] = shmem_node(handle->shmem, i)->task_count;
+		} while(seq_read_retry(handle->shmem, seq));
 #else
-		sem_wait(&handle->shmem->lock);
-#endif
+		shmem_lock(handle->shmem);
 		for(i = 0; i < num_elems; i++)
-			task_assignment[i] = handle->shmem->node_task_count[i];
-#ifdef _USE_SPINLOCK
-		pthread_spin_unlock(&handle->shmem->lock);
+			task_assignment[i] = shmem_node(handle->shmem, i)->task_count;
+		shmem_unlock(handle->shmem);
+#endif
+	}
+}
+
+unsigned omp_numa_num_busy_cpus(omp_numa_t* handle,
+																numa_node_t node,
+																omp_numa_flags flags)
+{
+	unsigned i, result = 0;
+
+	assert(node < MAX_NUM_NODES);
+	if(node >= __num_nodes)
+		return 0;
+
+	if(DO_FAST_CHECK(flags))
+	{
+		for(i = __node_cpu_offset[node]; i < __node_cpu_offset[node + 1]; i++)
+			if(shmem_cpu(handle->shmem, __node_cpus[i])->task_count)
+				result++;
+	}
+	else
+	{
+#ifdef _USE_SEQLOCK
+		unsigned seq;
+		do
+		{
+			seq = seq_read_begin(handle->shmem);
+			result = 0;
+			for(i = __node_cpu_offset[node]; i < __node_cpu_offset[node + 1]; i++)
+				if(shmem_cpu(handle->shmem, __node_cpus[i])->task_count)
+					result++;
+		} while(seq_read_retry(handle->shmem, seq));
 #else
-		sem_post(&handle->shmem->lock);
+		shmem_lock(handle->shmem);
+		for(i = __node_cpu_offset[node]; i < __node_cpu_offset[node + 1]; i++)
+			if(shmem_cpu(handle->shmem, __node_cpus[i])->task_count)
+				result++;
+		shmem_unlock(handle->shmem);
 #endif
 	}
+
+	return result;
+}
+
+int omp_numa_app_info(omp_numa_t* handle,
+											unsigned slot,
+											omp_numa_app_info_t* info)
+{
+	omp_numa_app* app;
+	numa_node_t node;
+
+	if(slot >= MAX_NUM_APPS)
+		return -1;
+
+	app = &handle->shmem->apps[slot];
+	info->pid = __atomic_load_n(&app->pid, __ATOMIC_ACQUIRE);
+	if(info->pid <= 0)
+		return 0;
+
+	info->weight = app->weight;
+	info->qos_class = app->qos_class;
+	info->num_tasks = app->num_tasks;
+	info->alloc_num_tasks = app->alloc_gen ? app->alloc_num_tasks : 0;
+	info->resizes = __atomic_load_n(&app->resizes, __ATOMIC_RELAXED);
+	info->damped = __atomic_load_n(&app->damped, __ATOMIC_RELAXED);
+	info->rebinds = __atomic_load_n(&app->rebinds, __ATOMIC_RELAXED);
+	info->rebinds_avoided = __atomic_load_n(&app->rebinds_avoided, __ATOMIC_RELAXED);
+	memset(info->task_assignment, 0, sizeof(info->task_assignment));
+	memset(info->alloc_assignment, 0, sizeof(info->alloc_assignment));
+	for(node = 0; node < __num_nodes; node++)
+	{
+		info->task_assignment[node] = app_node(handle->shmem, app, node)->tasks;
+		if(app->alloc_gen)
+			info->alloc_assignment[node] =
+				app_node(handle->shmem, app, node)->alloc_tasks;
+	}
+	return 1;
+}
+
+unsigned omp_numa_epoch(omp_numa_t* handle)
+{
+	return __atomic_load_n(&handle->shmem->epoch, __ATOMIC_ACQUIRE);
+}
+
+const char* omp_numa_class_name(unsigned qos_class)
+{
+	return qos_class < OMP_NUMA_NUM_CLASSES ? __class_names[qos_class] : NULL;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -288,259 +452,1581 @@ void omp_numa_task_assignment(omp_numa_t* handle,
 
 void omp_numa_clear_counters(omp_numa_t* handle)
 {
-#ifdef _USE_SPINLOCK
-	pthread_spin_lock(&handle->shmem->lock);
-#else
-	sem_wait(&handle->shmem->lock);
-#endif
+	shmem_lock(handle->shmem);
 	OMP_NUMA_DEBUG("clearing all node counters\n");
 
 	int i = 0;
 	for(i = 0; i < __num_nodes; i++)
-		handle->shmem->node_task_count[i] = 0;
-#ifdef _USE_SPINLOCK
-	pthread_spin_unlock(&handle->shmem->lock);
-#else
-	sem_post(&handle->shmem->lock);
-#endif
+	{
+		shmem_node(handle->shmem, i)->task_count = 0;
+		shmem_node(handle->shmem, i)->critical_task_count = 0;
+	}
+	handle->shmem->critical_tasks = 0;
+	memset(shmem_cpu(handle->shmem, 0), 0,
+		sizeof(omp_numa_cpu) * handle->shmem->hdr.num_cpus);
+
+	// Applications' reservations are gone as well, don't reclaim them again
+	for(i = 0; i < MAX_NUM_APPS; i++)
+		clear_reservations(handle->shmem, &handle->shmem->apps[i]);
+	shmem_unlock(handle->shmem);
+}
+
+int omp_numa_set_qos(omp_numa_t* handle, unsigned weight, unsigned qos_class)
+{
+	omp_numa_shmem* shmem = handle->shmem;
+	omp_numa_app* app = handle->app;
+	unsigned task_assignment[MAX_NUM_NODES];
+
+	if(!weight || qos_class >= OMP_NUMA_NUM_CLASSES || !app)
+		return -1;
+
+	// Move the tasks we hold over to the new weight & class
+	shmem_lock(shmem);
+	app_task_assignment(shmem, app, task_assignment);
+	if(handle->qos_class == OMP_NUMA_LATENCY_CRITICAL)
+		count_critical(shmem, -1, app->active, handle->weight, app->num_tasks,
+			task_assignment);
+	shmem->total_weight += (weight - handle->weight) * app->active;
+	shmem->admit_pledged_weight += (weight - handle->weight) * app->admit_pledged;
+	handle->weight = app->weight = weight;
+	handle->qos_class = app->qos_class = qos_class;
+	if(handle->qos_class == OMP_NUMA_LATENCY_CRITICAL)
+		count_critical(shmem, 1, app->active, handle->weight, app->num_tasks,
+			task_assignment);
+	bump_epoch(shmem);
+	shmem_unlock(shmem);
+
+	OMP_NUMA_DEBUG("weight %u, %s\n", weight, __class_names[qos_class]);
+	__omp_numa_post_request(handle);
+	return 0;
+}
+
+int omp_numa_reap_apps(omp_numa_t* handle)
+{
+	omp_numa_app* app;
+	int i, reaped = 0;
+	pid_t pid;
+
+	for(i = 0; i < MAX_NUM_APPS; i++)
+	{
+		app = &handle->shmem->apps[i];
+		pid = __atomic_load_n(&app->pid, __ATOMIC_ACQUIRE);
+		if(pid <= 0 || app == handle->app || app_alive(app, pid))
+			continue;
+		if(reap_app(handle, app, pid))
+		{
+			OMP_NUMA_DEBUG("reaped dead application %d\n", pid);
+			reaped++;
+		}
+	}
+
+	// The central scheduler can hand out the reclaimed processors
+	if(reaped)
+		__omp_numa_post_request(handle);
+	return reaped;
 }
 
 exec_spec_t* omp_numa_map_tasks(omp_numa_t* handle,
 																exec_spec_t* requested,
 																omp_numa_flags flags)
 {
-#ifdef _USE_SPINLOCK
-	pthread_spin_lock(&handle->shmem->lock);
-#else
-	sem_wait(&handle->shmem->lock);
-#endif
+	exec_spec_t* spec;
+
+	pthread_mutex_lock(&handle->lock);
+	if(!handle->admitted)
+		admit(handle);
+	set_bounds(handle, 0, 0, 0);
+	if(requested)
+		spec = map_tasks(handle, requested, 0, flags);
+	else if(handle->lease_ns)
+		spec = lease_tasks(handle, NULL, flags);
+	else
+		spec = map_tasks(handle, (exec_spec_t*)malloc(sizeof(exec_spec_t)), 1, flags);
+	pthread_mutex_unlock(&handle->lock);
+	return spec;
+}
 
-	exec_spec_t* result;
-	handle->shmem->num_omp_applications++; // Needed before calc_num_tasks
-	if(!requested)
-	{
-		result = map_tasks_to_nodes(handle,
-																calc_num_tasks(handle, flags),
-																flags);
-		OMP_NUMA_DEBUG("mapping %d threads\n", result->num_tasks);
-	}
+exec_spec_t* omp_numa_map_tasks_into(omp_numa_t* handle,
+																		 exec_spec_t* spec,
+																		 omp_numa_flags flags)
+{
+	return omp_numa_map_range(handle, spec, 0, 0, 0, flags);
+}
+
+exec_spec_t* omp_numa_map_range(omp_numa_t* handle,
+																exec_spec_t* spec,
+																unsigned min,
+																unsigned pref,
+																unsigned max,
+																omp_numa_flags flags)
+{
+	pthread_mutex_lock(&handle->lock);
+	if(!handle->admitted)
+		admit(handle);
+	set_bounds(handle, min, pref, max);
+	if(handle->lease_ns)
+		spec = lease_tasks(handle, spec, flags);
 	else
+		spec = map_tasks(handle, spec, 1, flags);
+	pthread_mutex_unlock(&handle->lock);
+	return spec;
+}
+
+exec_spec_t* omp_numa_map_nested(omp_numa_t* handle,
+																 const exec_spec_t* parent,
+																 numa_node_t node,
+																 unsigned idx,
+																 unsigned siblings,
+																 exec_spec_t* spec,
+																 unsigned min,
+																 unsigned max)
+{
+	unsigned share, first, cpu, num_cpus, i;
+
+	if(node < 0 || node >= __num_nodes || !parent->task_assignment[node] ||
+		 !siblings)
+		return NULL;
+
+	share = MAX(parent->task_assignment[node] / siblings, 1);
+	if(max)
+		share = MIN(share, max);
+	share = MAX(share, min);
+
+	for(i = 0; i < (unsigned)__num_nodes; i++)
+		spec->task_assignment[i] = 0;
+	memset(spec->cpus, 0, sizeof(unsigned long) * __num_cpu_words);
+	spec->num_tasks = spec->task_assignment[node] = share;
+
+	// Take our slice of the parent's CPUs on the node, so that pinned tasks of
+	// sibling regions don't pile up on the same CPUs.  If the minimum raised
+	// our share, slices wrap around & overlap rather than running past the
+	// parent's CPUs.
+	for(i = __node_cpu_offset[node], num_cpus = 0;
+			i < __node_cpu_offset[node + 1]; i++)
+		if(SPEC_HAS_CPU(parent, __node_cpus[i]))
+			num_cpus++;
+	first = num_cpus ? (idx % siblings) * share % num_cpus : 0;
+	for(i = __node_cpu_offset[node], cpu = 0; i < __node_cpu_offset[node + 1]; i++)
 	{
-		result = requested;
-		OMP_NUMA_DEBUG("mapping %d threads (user-requested)\n", result->num_tasks);
+		if(!SPEC_HAS_CPU(parent, __node_cpus[i]))
+			continue;
+		if((cpu + num_cpus - first) % num_cpus < share)
+			SPEC_SET_CPU(spec, __node_cpus[i]);
+		cpu++;
 	}
 
-	handle->shmem->num_omp_tasks += result->num_tasks;
-	numa_node_t cur_node = 0;
-	for(cur_node = 0; cur_node < __num_nodes; cur_node++)
+	OMP_NUMA_DEBUG("nesting %u threads on node %d\n", share, node);
+	return spec;
+}
+
+int omp_numa_request_range(omp_numa_t* handle,
+													 unsigned min,
+													 unsigned pref,
+													 unsigned max)
+{
+	if((max && (min > max || pref > max)) || (pref && pref < min))
+		return -1;
+
+	pthread_mutex_lock(&handle->lock);
+	handle->range_min = min;
+	handle->range_pref = pref;
+
+	// The central scheduler doesn't allot more than we can use in any region.
+	// Regions' own bounds are only applied to our allotment when mapping.
+	if(handle->app && max != handle->range_max)
 	{
-		if(result->task_assignment[cur_node])
-		{
-			handle->shmem->node_application_count[cur_node]++;
-			handle->shmem->node_task_count[cur_node] +=
-				result->task_assignment[cur_node];
-		}
+		__atomic_store_n(&handle->app->max_tasks, max, __ATOMIC_RELAXED);
+		if(__omp_numa_central_active(handle))
+			__omp_numa_post_request(handle);
 	}
+	handle->range_max = max;
+	pthread_mutex_unlock(&handle->lock);
 
-#ifdef _USE_SPINLOCK
-	pthread_spin_unlock(&handle->shmem->lock);
-#else
-	sem_post(&handle->shmem->lock);
-#endif
-	return result;
+	OMP_NUMA_DEBUG("bounding mappings to %u-%u tasks, preferring %u\n", min, max,
+		pref);
+	return 0;
 }
 
 void omp_numa_cleanup(omp_numa_t* handle, exec_spec_t* spec)
 {
-#ifdef _USE_SPINLOCK
-	pthread_spin_lock(&handle->shmem->lock);
-#else
-	sem_wait(&handle->shmem->lock);
-#endif
+	pthread_mutex_lock(&handle->lock);
+
+	// Leased setups stay reserved across parallel regions
+	if(spec == &handle->lease)
+	{
+		assert(handle->lease_users > 0);
+		handle->lease_users--;
+		pthread_mutex_unlock(&handle->lock);
+		return;
+	}
+
+	shmem_lock(handle->shmem);
 	OMP_NUMA_DEBUG("cleaning up (%d tasks)\n", spec->num_tasks);
-	handle->shmem->num_omp_applications--;
-	handle->shmem->num_omp_tasks -= spec->num_tasks;
-	numa_node_t cur_node = 0;
-	for(cur_node = 0; cur_node < __num_nodes; cur_node++)
+	remove_spec(handle, spec);
+	bump_epoch(handle->shmem);
+	shmem_unlock(handle->shmem);
+
+	if(handle->policy && handle->policy->release)
+		handle->policy->release(handle, spec);
+
+	// Save previous setup for NUMA-aware mapping
+	save_prev_setup(handle, spec);
+	pthread_mutex_unlock(&handle->lock);
+}
+
+exec_spec_t* omp_numa_copy_spec(exec_spec_t* dst, const exec_spec_t* src)
+{
+	numa_node_t node;
+
+	dst->num_tasks = src->num_tasks;
+	for(node = 0; node < __num_nodes; node++)
+		dst->task_assignment[node] = src->task_assignment[node];
+	memcpy(dst->cpus, src->cpus, sizeof(unsigned long) * __num_cpu_words);
+	return dst;
+}
+
+numa_node_t omp_numa_bind_task(omp_numa_t* handle,
+															 const exec_spec_t* spec,
+															 unsigned task)
+{
+	numa_node_t node;
+	unsigned first_task = 0;
+
+	// Find the task's node & its index among the node's tasks
+	for(node = 0; node < __num_nodes; node++)
 	{
-		if(spec->task_assignment[cur_node])
+		if(task < first_task + spec->task_assignment[node])
+			break;
+		first_task += spec->task_assignment[node];
+	}
+	if(node >= __num_nodes)
+		return -1;
+	return omp_numa_bind_node(handle, spec, node, task - first_task, NULL);
+}
+
+numa_node_t omp_numa_bind_node(omp_numa_t* handle,
+															 const exec_spec_t* spec,
+															 numa_node_t node,
+															 unsigned idx,
+															 omp_numa_binding_t* binding)
+{
+	int cpu;
+
+	if(node < 0 || node >= __num_nodes || !spec->task_assignment[node])
+		return -1;
+
+	// Skip the migration (a syscall & possibly a trip through the scheduler) if
+	// we're already there
+	cpu = task_cpu(handle, spec, node, idx);
+	if(binding && binding->node == node && binding->cpu == cpu)
+	{
+		if(handle->app)
+			__atomic_fetch_add(&handle->app->rebinds_avoided, 1, __ATOMIC_RELAXED);
+		return node;
+	}
+
+	if(cpu >= 0)
+	{
+		cpu_set_t mask;
+		CPU_ZERO(&mask);
+		CPU_SET(cpu, &mask);
+		if(!sched_setaffinity(0, sizeof(mask), &mask))
+			OMP_NUMA_DEBUG("binding task %u on node %d to CPU %d\n", idx, node, cpu);
+		else
+			cpu = -1;
+	}
+	if(cpu < 0)
+	{
+		OMP_NUMA_DEBUG("migrating task %u to node %d\n", idx, node);
+		if(numa_run_on_node(node))
 		{
-			handle->shmem->node_application_count[cur_node]--;
-			handle->shmem->node_task_count[cur_node] -=
-				spec->task_assignment[cur_node];
+			// Forget where we were, so the next region tries again
+			WARN("could not bind task to its node\n");
+			if(binding)
+			{
+				binding->node = -1;
+				binding->cpu = -1;
+			}
+			return -1;
 		}
 	}
-#ifdef _USE_SPINLOCK
-	pthread_spin_unlock(&handle->shmem->lock);
-#else
-	sem_post(&handle->shmem->lock);
-#endif
 
-	// Save previous setup for NUMA-aware mapping
-	handle->prev_setup.num_tasks = spec->num_tasks;
-	int i;
-	for(i = 0; i < __num_nodes; i++)
-		handle->prev_setup.task_assignment[i] = spec->task_assignment[i];
+	if(binding)
+	{
+		binding->node = node;
+		binding->cpu = cpu;
+	}
+	if(handle->app)
+		__atomic_fetch_add(&handle->app->rebinds, 1, __ATOMIC_RELAXED);
+	return node;
+}
+
+int omp_numa_is_leased(omp_numa_t* handle, exec_spec_t* spec)
+{
+	return spec == &handle->lease;
+}
+
+void omp_numa_release_lease(omp_numa_t* handle)
+{
+	pthread_mutex_lock(&handle->lock);
+	if(!handle->lease_held)
+	{
+		pthread_mutex_unlock(&handle->lock);
+		return;
+	}
+
+	assert(handle->lease_users == 0);
+	OMP_NUMA_DEBUG("releasing lease (%d tasks)\n", handle->lease.num_tasks);
+	shmem_lock(handle->shmem);
+	remove_spec(handle, &handle->lease);
+	bump_epoch(handle->shmem);
+	shmem_unlock(handle->shmem);
+	handle->lease_held = 0;
+
+	if(handle->policy && handle->policy->release)
+		handle->policy->release(handle, &handle->lease);
+	pthread_mutex_unlock(&handle->lock);
+}
+
+void omp_numa_simulate_topology(omp_numa_t* handle,
+																numa_node_t num_nodes,
+																unsigned procs_per_node,
+																const unsigned* distances)
+{
+	numa_node_t i, j;
+	unsigned cpu;
+
+	assert(num_nodes > 0 && num_nodes <= MAX_NUM_NODES &&
+				 num_nodes * procs_per_node <= MAX_NUM_CPUS);
+
+	__num_nodes = num_nodes;
+	__num_procs_per_node = procs_per_node;
+	__num_procs = num_nodes * procs_per_node;
+	for(i = 0; i < num_nodes; i++)
+		__node_cpu_offset[i] = i * procs_per_node;
+	__node_cpu_offset[num_nodes] = __num_procs;
+	for(cpu = 0; cpu < __num_procs; cpu++)
+		__node_cpus[cpu] = cpu;
+	__num_cpu_words = (__num_procs + CPU_MASK_BITS - 1) / CPU_MASK_BITS;
+
+	// Re-lay out the segment for the simulated topology (with room for any
+	// number of simulated CPUs) unless somebody already did
+	shmem_lock(handle->shmem);
+	if(handle->shmem->hdr.num_nodes != (unsigned)num_nodes ||
+		 handle->shmem->hdr.num_cpus < MAX_NUM_CPUS)
+	{
+		omp_numa_header hdr = handle->shmem->hdr;
+		size_t size = layout_segment(&hdr, num_nodes, MAX_NUM_CPUS);
+		if(ftruncate(handle->shmem_fd, size))
+			perror("Could not resize shared-memory file");
+		assert(size <= handle->shmem_map_size);
+		handle->shmem->hdr = hdr;
+		clear_arrays(handle->shmem);
+	}
+
+	for(i = 0; i < num_nodes; i++)
+		for(j = 0; j < num_nodes; j++)
+			*shmem_distance(handle->shmem, i, j) = distances ?
+				MIN(distances[i * num_nodes + j], 255) : (i == j ? 10 : 20);
+	shmem_unlock(handle->shmem);
+
+	for(i = 0; i < num_nodes; i++)
+		handle->prev_setup.task_assignment[i] = 1;
+	memset(handle->prev_setup.cpus, 0, sizeof(handle->prev_setup.cpus));
+	OMP_NUMA_DEBUG("simulating %d nodes with %u processors each\n",
+		num_nodes, procs_per_node);
+}
+
+void omp_numa_simulate_node_cpus(omp_numa_t* handle, const unsigned* node_cpus)
+{
+	numa_node_t node;
+	unsigned cpu;
+
+	__num_procs = 0;
+	__num_procs_per_node = 0;
+	for(node = 0; node < __num_nodes; node++)
+	{
+		__node_cpu_offset[node] = __num_procs;
+		__num_procs += node_cpus[node];
+		__num_procs_per_node = MAX(__num_procs_per_node, node_cpus[node]);
+	}
+	assert(__num_procs <= MAX_NUM_CPUS);
+	__node_cpu_offset[__num_nodes] = __num_procs;
+	for(cpu = 0; cpu < __num_procs; cpu++)
+		__node_cpus[cpu] = cpu;
+	__num_cpu_words = (__num_procs + CPU_MASK_BITS - 1) / CPU_MASK_BITS;
+
+	memset(handle->prev_setup.cpus, 0, sizeof(handle->prev_setup.cpus));
+	OMP_NUMA_DEBUG("simulating %u processors on %d nodes\n",
+		__num_procs, __num_nodes);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 // Miscellaneous helpers
 ///////////////////////////////////////////////////////////////////////////////
 
-// TODO make configurable, add other options (i.e. ML)
-/* Give each application an equal number of processors, that is:
- *
- *   # processors / # OpenMP applications
+/* Map tasks into an execution setup, either decided by the active policy or
+ * requested by the application, & reserve them in shared memory
  */
-unsigned calc_num_tasks(omp_numa_t* handle, omp_numa_flags flags)
+exec_spec_t* map_tasks(omp_numa_t* handle,
+											 exec_spec_t* spec,
+											 int decide,
+											 omp_numa_flags flags)
 {
-	if(handle->shmem->num_omp_applications == 0)
-		return __num_procs;
+	const omp_numa_policy_t* policy = __omp_numa_active_policy(handle);
+	int damped = 0;
+
+	if(handle->residency_ns && decide)
+		__omp_numa_adopt_residency(handle);
+
+#ifdef _USE_SEQLOCK
+	// Map against a snapshot of the counters & try to commit the reservation.
+	// If somebody else committed in the meantime, our view is stale - re-map.
+	unsigned seq;
+	do
+	{
+		seq = seq_read_begin(handle->shmem);
+		if(decide)
+			damped = decide_tasks(handle, policy, spec, flags);
+		assign_cpus(handle, spec);
+	} while(!seq_try_commit(handle->shmem, seq));
+#else
+	shmem_lock(handle->shmem);
+	if(decide)
+		damped = decide_tasks(handle, policy, spec, flags);
+	assign_cpus(handle, spec);
+#endif
+
+	if(decide)
+		OMP_NUMA_DEBUG("mapping %d threads\n", spec->num_tasks);
 	else
-		return ceil((double)__num_procs /
-								(double)handle->shmem->num_omp_applications);
-}
-
-// TODO make configurable, add other options
-/* Assign the requested number of tasks to nodes in a round-robin fasion -
- * fill each node up with tasks, then move on to the next.
- *
- * "Filling up a node" refers to mapping up to __num_procs_per_node tasks
- * to a NUMA node.  If it has fewer tasks than this, it is considered
- * unfilled.
- *
- * The current algorithm maps tasks according to the following priority:
- *
- * 1. (NUMA-aware) Map tasks to nodes that are empty and on which we've
- *    previously executed
- * 2. (NUMA-aware) Map tasks to nodes that are unfilled and on which we've
- *    previously executed
- * 3. Map tasks to nodes that are empty
- * 4. Map tasks to nodes that are unfilled
- * 5. Map tasks to nodes that have the least number of nodes.
- *    (NUMA-aware) if two tasks have equally small numbers of tasks, prefer the
- *    node on which we've previously executed
- *
- * TODO several of these priorities can be collapsed into single priorities,
- * i.e. 1 & 2 could be done in the same for-loop.  This isn't a performance
- * concern right now, as we've got maximum 8 nodes in our test setup.
+		OMP_NUMA_DEBUG("mapping %d threads (user-requested)\n", spec->num_tasks);
+
+	add_spec(handle, spec);
+	bump_epoch(handle->shmem);
+	shmem_unlock(handle->shmem);
+
+	if(decide)
+		count_resize(handle, spec, damped);
+	if(handle->migrate_started)
+		__omp_numa_request_migration(handle, spec);
+	return spec;
+}
+
+/* Let the policy decide the number of tasks & their nodes, then stabilize the
+ * decision against the previous setup so that teams aren't resized every time
+ * a neighbour starts or finishes a parallel region.  Changes smaller than
+ * OMP_NUMA_DAMP_THRESHOLD are ignored, shrinks happen only once they've been
+ * asked for for OMP_NUMA_SHRINK_DELAY & grows at most once every
+ * OMP_NUMA_GROW_INTERVAL.  Otherwise the previous setup is kept.  Returns
+ * non-zero if the decision was overridden.
  */
-exec_spec_t* map_tasks_to_nodes(omp_numa_t* handle,
-																unsigned num_tasks,
-																omp_numa_flags flags)
+int decide_tasks(omp_numa_t* handle,
+								 const omp_numa_policy_t* policy,
+								 exec_spec_t* spec,
+								 omp_numa_flags flags)
 {
-	exec_spec_t* spec = (exec_spec_t*)malloc(sizeof(exec_spec_t));
-	unsigned tasks_remaining = num_tasks;
-	unsigned task_chunk;
-	numa_node_t cur_node;
-	unsigned local_task_count[MAX_NUM_NODES];
+	const exec_spec_t* prev = &handle->prev_setup;
+	unsigned long long now;
+	unsigned change;
+	numa_node_t node;
+	int keep;
+
+	policy->decide(handle, spec, flags);
+	if(!handle->damping || !prev->num_tasks || spec->num_tasks == prev->num_tasks)
+	{
+		handle->shrink_since = 0;
+		return 0;
+	}
 
-	// Check to see if NUMA-aware mapping is enabled
-	int numa_aware = 0;
-	if(getenv(OMP_NUMA_AWARE_MAPPING) &&
-		 !strcmp(getenv(OMP_NUMA_AWARE_MAPPING), "1"))
+	now = __omp_numa_coarse_time_ns();
+	if(spec->num_tasks < prev->num_tasks)
 	{
-		OMP_NUMA_DEBUG("NUMA-aware mapping is enabled\n");
-		numa_aware = 1;
+		change = prev->num_tasks - spec->num_tasks;
+		if(!handle->shrink_since)
+			handle->shrink_since = now;
+		keep = change < handle->damp_threshold ||
+					 now - handle->shrink_since < handle->shrink_delay_ns;
 	}
+	else
+	{
+		change = spec->num_tasks - prev->num_tasks;
+		handle->shrink_since = 0;
+		keep = change < handle->damp_threshold ||
+					 (handle->last_resize &&
+						now - handle->last_resize < handle->grow_interval_ns);
+	}
+	if(!keep || !in_bounds(handle, prev->num_tasks))
+		return 0;
 
-	// Initialize local copy of current task assignment & spec task assignment
-	spec->num_tasks = num_tasks;
-	for(cur_node = 0; cur_node < __num_nodes; cur_node++)
+	spec->num_tasks = prev->num_tasks;
+	for(node = 0; node < __num_nodes; node++)
+		spec->task_assignment[node] = prev->task_assignment[node];
+	return 1;
+}
+
+/* Count how often the number of tasks changed (or would have, if not for
+ * damping) in our slot
+ */
+void count_resize(omp_numa_t* handle, const exec_spec_t* spec, int damped)
+{
+	omp_numa_app* app = handle->app;
+
+	if(!handle->prev_setup.num_tasks ||
+		 (!damped && spec->num_tasks == handle->prev_setup.num_tasks))
+		return;
+
+	if(!damped)
 	{
-		spec->task_assignment[cur_node] = 0;
-		local_task_count[cur_node] = handle->shmem->node_task_count[cur_node];
+		handle->last_resize = __omp_numa_coarse_time_ns();
+		handle->shrink_since = 0;
 	}
+	if(app && damped)
+		__atomic_store_n(&app->damped, app->damped + 1, __ATOMIC_RELAXED);
+	else if(app)
+		__atomic_store_n(&app->resizes, app->resizes + 1, __ATOMIC_RELAXED);
+}
 
-	// NUMA-aware passes - attempt to schedule onto nodes that are not full and
-	// on which we've previously executed
-	if(numa_aware)
+/* The CPU the idx-th task on a node is pinned to - the idx-th CPU the setup
+ * reserves on the node - or -1 if it may run anywhere on the node (no CPU
+ * binding, or more tasks on the node than it has CPUs)
+ */
+int task_cpu(omp_numa_t* handle,
+						 const exec_spec_t* spec,
+						 numa_node_t node,
+						 unsigned idx)
+{
+	unsigned i;
+
+	if(!handle->bind_cpus ||
+		 spec->task_assignment[node] > omp_numa_node_num_cpus(node))
+		return -1;
+
+	for(i = __node_cpu_offset[node]; i < __node_cpu_offset[node + 1]; i++)
+		if(SPEC_HAS_CPU(spec, __node_cpus[i]) && !idx--)
+			return __node_cpus[i];
+	return -1;
+}
+
+/* Narrow the process's bounds on the number of tasks by a region's, for the
+ * mapping about to be decided.  If they conflict, the maximum wins.
+ */
+void set_bounds(omp_numa_t* handle, unsigned min, unsigned pref, unsigned max)
+{
+	handle->bound_min = MAX(min, handle->range_min);
+	handle->bound_pref = !pref ? handle->range_pref :
+											 !handle->range_pref ? pref : MIN(pref, handle->range_pref);
+	handle->bound_max = !max ? handle->range_max :
+											!handle->range_max ? max : MIN(max, handle->range_max);
+	if(handle->bound_max)
 	{
-		// First pass - attempt to map tasks into empty & previous execution nodes
-		for(cur_node = 0; cur_node < __num_nodes && tasks_remaining; cur_node++)
+		handle->bound_min = MIN(handle->bound_min, handle->bound_max);
+		handle->bound_pref = MIN(handle->bound_pref, handle->bound_max);
+	}
+	if(handle->bound_pref)
+		handle->bound_pref = MAX(handle->bound_pref, handle->bound_min);
+}
+
+/* Check whether a number of tasks is within the bounds of the mapping being
+ * decided
+ */
+int in_bounds(omp_numa_t* handle, unsigned num_tasks)
+{
+	return num_tasks >= handle->bound_min &&
+				 (!handle->bound_max || num_tasks <= handle->bound_max);
+}
+
+/* Hand out the leased setup if nobody arrived or left since we got it,
+ * otherwise renew the lease
+ */
+exec_spec_t* lease_tasks(omp_numa_t* handle,
+												 exec_spec_t* spec,
+												 omp_numa_flags flags)
+{
+	if(handle->lease_held &&
+		 (handle->lease_users ||
+			(__atomic_load_n(&handle->shmem->epoch, __ATOMIC_RELAXED) ==
+				handle->lease_epoch &&
+			 __omp_numa_coarse_time_ns() < handle->lease_expiry)))
+	{
+		if(in_bounds(handle, handle->lease.num_tasks))
+		{
+			handle->lease_users++;
+			return &handle->lease;
+		}
+
+		// Out of the region's bounds & can't be renewed while in use, map the
+		// region on its own
+		if(handle->lease_users)
+			return map_tasks(handle, spec ? spec :
+				(exec_spec_t*)malloc(sizeof(exec_spec_t)), 1, flags);
+	}
+	return renew_lease(handle, flags);
+}
+
+/* (Re-)acquire a lease on an execution setup.  Renewing an existing lease
+ * swaps our old reservation for the new one in a single update and does not
+ * change the epoch, as no application arrived or left.
+ */
+exec_spec_t* renew_lease(omp_numa_t* handle, omp_numa_flags flags)
+{
+	const omp_numa_policy_t* policy = __omp_numa_active_policy(handle);
+	int damped;
+
+	if(handle->residency_ns)
+		__omp_numa_adopt_residency(handle);
+
+	shmem_lock(handle->shmem);
+	if(handle->lease_held)
+	{
+		remove_spec(handle, &handle->lease);
+		save_prev_setup(handle, &handle->lease);
+	}
+
+	damped = decide_tasks(handle, policy, &handle->lease, flags);
+	assign_cpus(handle, &handle->lease);
+	add_spec(handle, &handle->lease);
+	if(handle->lease_held)
+		handle->lease_epoch = __atomic_load_n(&handle->shmem->epoch,
+																					__ATOMIC_RELAXED);
+	else
+		handle->lease_epoch = bump_epoch(handle->shmem);
+	shmem_unlock(handle->shmem);
+
+	count_resize(handle, &handle->lease, damped);
+	if(handle->migrate_started)
+		__omp_numa_request_migration(handle, &handle->lease);
+
+	OMP_NUMA_DEBUG("leased %d threads\n", handle->lease.num_tasks);
+	handle->lease_held = 1;
+	handle->lease_users = 1;
+	handle->lease_expiry = __omp_numa_coarse_time_ns() + handle->lease_ns;
+	return &handle->lease;
+}
+
+/* Claim a free per-application slot in shared memory, after reclaiming the
+ * slots of applications which died without giving them back
+ */
+void attach_app(omp_numa_t* handle)
+{
+	pid_t free_pid, pid = getpid();
+	unsigned long long start_time = 0;
+	char state;
+	int i;
+
+	omp_numa_reap_apps(handle);
+	proc_stat(pid, &state, &start_time);
+
+	for(i = 0; i < MAX_NUM_APPS; i++)
+	{
+		free_pid = 0;
+		if(__atomic_compare_exchange_n(&handle->shmem->apps[i].pid, &free_pid, pid,
+																	 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
 		{
-			if(local_task_count[cur_node] == 0 &&
-				 handle->prev_setup.task_assignment[cur_node] != 0)
+			handle->app = &handle->shmem->apps[i];
+			handle->app->start_time = start_time;
+			handle->app->active = 0;
+			handle->app->profiled = 0;
+			handle->app->serial_milli = 0;
+			handle->app->weight = handle->weight;
+			handle->app->qos_class = handle->qos_class;
+			handle->app->max_tasks = handle->range_max;
+			handle->app->alloc_gen = 0;
+			handle->app->admit_pledged = 0;
+			handle->app->resizes = 0;
+			handle->app->damped = 0;
+			handle->app->rebinds = 0;
+			handle->app->rebinds_avoided = 0;
+			clear_reservations(handle->shmem, handle->app);
+			__omp_numa_post_request(handle);
+			return;
+		}
+	}
+
+	WARN("no free application slots in shared memory\n");
+}
+
+/* Give back our per-application slot */
+void detach_app(omp_numa_t* handle)
+{
+	if(!handle->app)
+		return;
+
+	// Admitted, but never started a parallel region
+	if(handle->app->admit_pledged)
+	{
+		shmem_lock(handle->shmem);
+		drop_pledge(handle->shmem, handle->app);
+		bump_epoch(handle->shmem);
+		shmem_unlock(handle->shmem);
+	}
+
+	handle->app->profiled = 0;
+	handle->app->alloc_gen = 0;
+	handle->app->start_time = 0;
+	__atomic_store_n(&handle->app->pid, 0, __ATOMIC_RELEASE);
+	handle->app = NULL;
+	__omp_numa_post_request(handle);
+}
+
+/* Check whether a slot's owner is still alive.  Zombies are dead, as is a
+ * process which reused the owner's PID but started at a different time.  If
+ * the process can't be inspected beyond existing, assume it's alive.
+ */
+int app_alive(const omp_numa_app* app, pid_t pid)
+{
+	unsigned long long start_time, app_start_time;
+	char state;
+
+	if(kill(pid, 0) && errno == ESRCH)
+		return 0;
+	if(!proc_stat(pid, &state, &start_time))
+		return 1;
+	if(state == 'Z' || state == 'X')
+		return 0;
+
+	app_start_time = __atomic_load_n(&app->start_time, __ATOMIC_RELAXED);
+	return !app_start_time || app_start_time == start_time;
+}
+
+/* Reclaim a dead application's slot & subtract its reservations from the node
+ * & CPU counters.  Returns 1 if we reaped it, 0 if somebody else got there
+ * first (or the slot changed hands).
+ */
+int reap_app(omp_numa_t* handle, omp_numa_app* app, pid_t pid)
+{
+	omp_numa_shmem* shmem = handle->shmem;
+	unsigned short* cpu_tasks = app_cpu_tasks(shmem, app);
+	omp_numa_node* node_counters;
+	omp_numa_cpu* cpu_counters;
+	numa_node_t node;
+	unsigned i, cpu;
+
+	if(!__atomic_compare_exchange_n(&app->pid, &pid, APP_REAPING, 0,
+																	__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		return 0;
+
+	shmem_lock(shmem);
+	if(app->qos_class == OMP_NUMA_LATENCY_CRITICAL)
+	{
+		unsigned task_assignment[MAX_NUM_NODES];
+		app_task_assignment(shmem, app, task_assignment);
+		count_critical(shmem, -1, app->active, app->weight, app->num_tasks,
+			task_assignment);
+	}
+	shmem->num_omp_applications -= app->active;
+	shmem->total_weight -= app->weight * app->active;
+	shmem->num_omp_tasks -= app->num_tasks;
+	for(node = 0; node < __num_nodes; node++)
+	{
+		node_counters = shmem_node(shmem, node);
+		node_counters->application_count -= app_node(shmem, app, node)->specs;
+		node_counters->task_count -= app_node(shmem, app, node)->tasks;
+	}
+	for(i = 0; i < __node_cpu_offset[__num_nodes]; i++)
+	{
+		cpu = __node_cpus[i];
+		if(!cpu_tasks[cpu])
+			continue;
+		cpu_counters = shmem_cpu(shmem, cpu);
+		cpu_counters->task_count -= cpu_tasks[cpu];
+		if(!cpu_counters->task_count || cpu_counters->owner == pid)
+			cpu_counters->owner = 0;
+	}
+	bump_epoch(shmem);
+
+	app->active = 0;
+	app->profiled = 0;
+	app->alloc_gen = 0;
+	app->start_time = 0;
+	drop_pledge(shmem, app);
+	clear_reservations(shmem, app);
+	shmem_unlock(shmem);
+
+	__atomic_store_n(&app->pid, 0, __ATOMIC_RELEASE);
+
+	// The reaped process never got to detach from the segment
+	lock_init(shmem);
+	if(shmem->users > 1)
+		shmem->users--;
+	pthread_mutex_unlock(&shmem->init_lock);
+	return 1;
+}
+
+/* Read a process's state & start time (in clock ticks since boot) from
+ * /proc/<pid>/stat.  Returns 0 if the process could not be inspected.
+ */
+int proc_stat(pid_t pid, char* state, unsigned long long* start_time)
+{
+	char path[64], buf[1024], *fields;
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if((fd = open(path, O_RDONLY)) < 0)
+		return 0;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if(len <= 0)
+		return 0;
+	buf[len] = '\0';
+
+	// The command name may contain spaces & parentheses, so skip past the last
+	// ')' - the state is the 3rd field & the start time the 22nd
+	if(!(fields = strrchr(buf, ')')))
+		return 0;
+	return sscanf(fields + 1, " %c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u "
+								"%*u %*d %*d %*d %*d %*d %*d %llu", state, start_time) == 2;
+}
+
+/* Cheap (vDSO, no syscall) monotonic time in nanoseconds */
+unsigned long long __omp_numa_coarse_time_ns()
+{
+	struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Read the machine's topology.  Each node's CPUs are the ones libnuma reports
+ * for it that the process is allowed to execute on (libnuma reads the allowed
+ * CPUs when it's loaded, i.e. before the runtime pins any threads), so
+ * offlined CPUs & CPUs outside our cpuset/cgroup don't count.  Nodes may end
+ * up with different numbers of CPUs, or none at all (e.g. memory-only nodes).
+ */
+void init_topology()
+{
+	numa_node_t node;
+	unsigned cpu, num_cpus = 0,
+					 max_cpus = MIN(numa_num_configured_cpus(), MAX_NUM_CPUS);
+	struct bitmask* node_cpus = numa_allocate_cpumask();
+
+	__num_nodes = MIN(numa_num_configured_nodes(), MAX_NUM_NODES);
+	__num_procs_per_node = 0;
+
+	for(node = 0; node < __num_nodes; node++)
+	{
+		__node_cpu_offset[node] = num_cpus;
+		if(numa_node_to_cpus(node, node_cpus))
+			continue;
+		for(cpu = 0; cpu < max_cpus; cpu++)
+			if(numa_bitmask_isbitset(node_cpus, cpu) &&
+				 numa_bitmask_isbitset(numa_all_cpus_ptr, cpu))
+				__node_cpus[num_cpus++] = cpu;
+		__num_procs_per_node = MAX(__num_procs_per_node,
+															 num_cpus - __node_cpu_offset[node]);
+	}
+	numa_free_cpumask(node_cpus);
+
+	// Without libnuma's view of the CPUs, treat the machine as a single node
+	if(!num_cpus)
+	{
+		for(cpu = 0; cpu < MIN((unsigned)get_nprocs(), max_cpus); cpu++)
+			__node_cpus[num_cpus++] = cpu;
+		for(node = 0; node <= __num_nodes; node++)
+			__node_cpu_offset[node] = node ? num_cpus : 0;
+		__num_procs_per_node = num_cpus;
+	}
+
+	__node_cpu_offset[__num_nodes] = num_cpus;
+	__num_procs = num_cpus;
+	__num_cpu_words = (max_cpus + CPU_MASK_BITS - 1) / CPU_MASK_BITS;
+
+	OMP_NUMA_DEBUG("%u CPUs available on %d nodes\n", num_cpus, __num_nodes);
+}
+
+/* Reserve CPUs for an execution specification's tasks on each of its nodes -
+ * the CPUs with the fewest tasks, preferring CPUs we previously executed on
+ * among equally-loaded ones.  If we have more tasks on a node than it has
+ * CPUs, all of its CPUs are reserved.  The caller must have exclusive access
+ * to the shared counters (or a snapshot in lock-free mode).
+ */
+void assign_cpus(omp_numa_t* handle, exec_spec_t* spec)
+{
+	numa_node_t node;
+	unsigned i, j, num_cpus;
+
+	memset(spec->cpus, 0, sizeof(unsigned long) * __num_cpu_words);
+	for(node = 0; node < __num_nodes; node++)
+	{
+		num_cpus = MIN(spec->task_assignment[node], omp_numa_node_num_cpus(node));
+		for(i = 0; i < num_cpus; i++)
+		{
+			unsigned best = 0, best_count = UINT_MAX, count;
+			int best_prev = 0, prev;
+
+			for(j = __node_cpu_offset[node]; j < __node_cpu_offset[node + 1]; j++)
 			{
-				task_chunk = MIN(tasks_remaining, __num_procs_per_node);
-				spec->task_assignment[cur_node] += task_chunk;
-				local_task_count[cur_node] += task_chunk;
-				tasks_remaining -= task_chunk;
+				if(SPEC_HAS_CPU(spec, __node_cpus[j]))
+					continue;
+
+				count = shmem_cpu(handle->shmem, __node_cpus[j])->task_count;
+				prev = SPEC_HAS_CPU(&handle->prev_setup, __node_cpus[j]);
+				if(count < best_count || (count == best_count && prev && !best_prev))
+				{
+					best = __node_cpus[j];
+					best_count = count;
+					best_prev = prev;
+				}
 			}
+			SPEC_SET_CPU(spec, best);
 		}
+	}
+}
 
-		// Second pass - attempt to map tasks into non-full & previous execution
-		// nodes
-		for(cur_node = 0; cur_node < __num_nodes && tasks_remaining; cur_node++)
+/* Add an application's execution specification to the node counters & to its
+ * reservations.  The caller must have exclusive access to the shared counters.
+ */
+void add_spec(omp_numa_t* handle, exec_spec_t* spec)
+{
+	omp_numa_shmem* shmem = handle->shmem;
+	numa_node_t cur_node = 0;
+	omp_numa_app* app = handle->app;
+	unsigned short* cpu_tasks = app ? app_cpu_tasks(shmem, app) : NULL;
+	pid_t pid = app ? app->pid : getpid();
+	unsigned i, tasks;
+
+	shmem->num_omp_applications++;
+	shmem->total_weight += handle->weight;
+	if(handle->qos_class == OMP_NUMA_LATENCY_CRITICAL)
+		count_critical(shmem, 1, 1, handle->weight, spec->num_tasks,
+			spec->task_assignment);
+	if(app)
+	{
+		drop_pledge(shmem, app);
+		app->active++;
+		app->num_tasks += spec->num_tasks;
+	}
+	shmem->num_omp_tasks += spec->num_tasks;
+	for(cur_node = 0; cur_node < __num_nodes; cur_node++)
+	{
+		if((tasks = spec->task_assignment[cur_node]))
 		{
-			if(local_task_count[cur_node] < __num_procs_per_node &&
-				 handle->prev_setup.task_assignment[cur_node] != 0)
+			omp_numa_node* counters = shmem_node(shmem, cur_node);
+			counters->application_count++;
+			counters->task_count += tasks;
+			if(app)
 			{
-				task_chunk = MIN(tasks_remaining,
-												 __num_procs_per_node - local_task_count[cur_node]);
-				spec->task_assignment[cur_node] += task_chunk;
-				local_task_count[cur_node] += task_chunk;
-				tasks_remaining -= task_chunk;
+				app_node(shmem, app, cur_node)->specs++;
+				app_node(shmem, app, cur_node)->tasks += tasks;
 			}
 		}
 	}
+	for(i = 0; i < __node_cpu_offset[__num_nodes]; i++)
+	{
+		if(SPEC_HAS_CPU(spec, __node_cpus[i]))
+		{
+			omp_numa_cpu* counters = shmem_cpu(shmem, __node_cpus[i]);
+			counters->task_count++;
+			counters->owner = pid;
+			if(app)
+				cpu_tasks[__node_cpus[i]]++;
+		}
+	}
+}
 
-	// First pass - attempt to map tasks into empty nodes
-	for(cur_node = 0; cur_node < __num_nodes && tasks_remaining; cur_node++)
+/* Remove an application's execution specification from the node counters &
+ * from its reservations.  The caller must have exclusive access to the shared
+ * counters.
+ */
+void remove_spec(omp_numa_t* handle, exec_spec_t* spec)
+{
+	omp_numa_shmem* shmem = handle->shmem;
+	omp_numa_app* app = handle->app;
+	unsigned short* cpu_tasks = app ? app_cpu_tasks(shmem, app) : NULL;
+	numa_node_t cur_node = 0;
+	unsigned i, tasks;
+
+	shmem->num_omp_applications--;
+	shmem->total_weight -= handle->weight;
+	if(handle->qos_class == OMP_NUMA_LATENCY_CRITICAL)
+		count_critical(shmem, -1, 1, handle->weight, spec->num_tasks,
+			spec->task_assignment);
+	if(app)
+	{
+		app->active--;
+		app->num_tasks -= spec->num_tasks;
+	}
+	shmem->num_omp_tasks -= spec->num_tasks;
+	for(cur_node = 0; cur_node < __num_nodes; cur_node++)
 	{
-		if(local_task_count[cur_node] == 0)
+		if((tasks = spec->task_assignment[cur_node]))
 		{
-			task_chunk = MIN(tasks_remaining, __num_procs_per_node);
-			spec->task_assignment[cur_node] += task_chunk;
-			local_task_count[cur_node] += task_chunk;
-			tasks_remaining -= task_chunk;
+			omp_numa_node* counters = shmem_node(shmem, cur_node);
+			counters->application_count--;
+			counters->task_count -= tasks;
+			if(app)
+			{
+				app_node(shmem, app, cur_node)->specs--;
+				app_node(shmem, app, cur_node)->tasks -= tasks;
+			}
 		}
 	}
+	for(i = 0; i < __node_cpu_offset[__num_nodes]; i++)
+	{
+		if(!SPEC_HAS_CPU(spec, __node_cpus[i]))
+			continue;
+		omp_numa_cpu* counters = shmem_cpu(shmem, __node_cpus[i]);
+		if(app)
+			cpu_tasks[__node_cpus[i]]--;
+		if(!--counters->task_count)
+			counters->owner = 0;
+	}
+}
+
+/* Lay out the segment's topology-sized arrays after the fixed part, each
+ * starting on a cache line.  Returns the size of the segment.
+ */
+size_t layout_segment(omp_numa_header* hdr,
+											numa_node_t num_nodes,
+											unsigned num_cpus)
+{
+	unsigned long offset = ALIGN_UP(sizeof(omp_numa_shmem), CACHE_LINE);
+
+	hdr->num_nodes = num_nodes;
+	hdr->num_cpus = num_cpus;
+
+	hdr->nodes_offset = offset;
+	offset += num_nodes * sizeof(omp_numa_node);
+	hdr->distance_offset = offset;
+	offset = ALIGN_UP(offset + num_nodes * num_nodes, CACHE_LINE);
+	hdr->cpus_offset = offset;
+	offset = ALIGN_UP(offset + num_cpus * sizeof(omp_numa_cpu), CACHE_LINE);
+
+	// Each application's reservations start on their own cache line
+	hdr->app_nodes_stride = ALIGN_UP(num_nodes * sizeof(omp_numa_app_node),
+																	 CACHE_LINE);
+	hdr->app_nodes_offset = offset;
+	offset += MAX_NUM_APPS * hdr->app_nodes_stride;
+	hdr->app_cpus_stride = ALIGN_UP(num_cpus * sizeof(unsigned short),
+																	CACHE_LINE);
+	hdr->app_cpus_offset = offset;
+	offset += MAX_NUM_APPS * hdr->app_cpus_stride;
+
+	// Trace records carry the granted setup, sized to the topology
+	hdr->trace_record_size = ALIGN_UP(sizeof(omp_numa_trace_rec) +
+																		num_nodes * sizeof(unsigned) +
+																		num_cpus / 8, sizeof(unsigned long));
+	hdr->trace_stride = ALIGN_UP(sizeof(omp_numa_trace_ring) +
+															 TRACE_RECORDS * hdr->trace_record_size,
+															 CACHE_LINE);
+	hdr->trace_offset = offset;
+	offset += MAX_NUM_APPS * hdr->trace_stride;
+
+	hdr->size = offset;
+	return offset;
+}
 
-	// Second pass - attempt to map tasks into nodes that aren't already
-	// fully occupied
-	for(cur_node = 0; cur_node < __num_nodes && tasks_remaining; cur_node++)
+/* Size of the segment for the largest supported topology */
+size_t max_segment_size()
+{
+	omp_numa_header hdr;
+	return ALIGN_UP(layout_segment(&hdr, MAX_NUM_NODES, MAX_NUM_CPUS),
+									(size_t)sysconf(_SC_PAGESIZE));
+}
+
+/* Check that the shepherd's segment uses our layout & fits our topology */
+int segment_compatible(omp_numa_t* handle)
+{
+	omp_numa_header* hdr = &handle->shmem->hdr;
+
+	if((size_t)handle->shmem_fd_stats.st_size < sizeof(omp_numa_header) ||
+		 __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHMEM_MAGIC)
+	{
+		ERROR("shared memory is not an OpenMP/NUMA segment\n");
+		return 0;
+	}
+	if(hdr->version != SHMEM_VERSION)
+	{
+		fprintf(stderr, "ERROR: shared memory layout version %u, expected %u - "
+			"please stop all OpenMP/NUMA processes\n", hdr->version, SHMEM_VERSION);
+		return 0;
+	}
+	if((size_t)handle->shmem_fd_stats.st_size < hdr->size ||
+		 hdr->num_nodes < (unsigned)__num_nodes ||
+		 hdr->num_cpus < __num_cpu_words * CPU_MASK_BITS)
 	{
-		if(local_task_count[cur_node] < __num_procs_per_node)
+		ERROR("shared memory does not fit this machine's topology\n");
+		return 0;
+	}
+	return 1;
+}
+
+/* Wait at the first parallel region until the active policy would give us at
+ * least OMP_NUMA_ADMIT_MIN processors rather than oversubscribing a saturated
+ * machine - running fewer applications at full speed beats running all of
+ * them slowly.  Sleeps on the epoch, which changes whenever tasks are mapped
+ * or cleaned up, & starts anyway after OMP_NUMA_ADMIT_TIMEOUT.
+ */
+void admit(omp_numa_t* handle)
+{
+	omp_numa_shmem* shmem = handle->shmem;
+	unsigned long long now, deadline, wait_ns;
+	unsigned epoch, needed = MIN(handle->admit_min, __num_procs);
+	struct timespec ts;
+
+	handle->admitted = 1;
+	if(!needed || !handle->app)
+		return;
+
+	deadline = omp_numa_time_ns() + handle->admit_timeout_ns;
+	__atomic_add_fetch(&shmem->admit_waiters, 1, __ATOMIC_SEQ_CST);
+	while(1)
+	{
+		epoch = __atomic_load_n(&shmem->epoch, __ATOMIC_SEQ_CST);
+		if(try_admit(handle, needed))
+			break;
+
+		now = omp_numa_time_ns();
+		if(now >= deadline)
 		{
-			task_chunk =
-				MIN(tasks_remaining, __num_procs_per_node - local_task_count[cur_node]);
-			spec->task_assignment[cur_node] += task_chunk;
-			local_task_count[cur_node] += task_chunk;
-			tasks_remaining -= task_chunk;
+			WARN("timed out waiting for a large enough share, starting anyway\n");
+			break;
 		}
+		wait_ns = MIN(deadline - now, ADMIT_POLL_MS * 1000000ULL);
+		ts.tv_sec = wait_ns / 1000000000ULL;
+		ts.tv_nsec = wait_ns % 1000000000ULL;
+		syscall(SYS_futex, &shmem->epoch, FUTEX_WAIT, epoch, &ts, NULL, 0);
+		omp_numa_reap_apps(handle);
 	}
+	__atomic_sub_fetch(&shmem->admit_waiters, 1, __ATOMIC_SEQ_CST);
+}
 
-	// Last pass - map tasks onto nodes to minimize oversubscription
-	while(tasks_remaining)
+/* Admit the application if the active policy would give it at least the
+ * number of processors it needs.  Applications admitted before us which
+ * haven't started yet are about to be mapped, so they're temporarily counted
+ * as mapped applications while deciding - the policy counts us itself.  Our
+ * bounds aren't set before the first parallel region, so this is the
+ * policy's unclamped share.  If admitted, we're counted among the
+ * applications which haven't started yet.  Returns non-zero if admitted.
+ */
+int try_admit(omp_numa_t* handle, unsigned needed)
+{
+	const omp_numa_policy_t* policy = __omp_numa_active_policy(handle);
+	omp_numa_shmem* shmem = handle->shmem;
+	exec_spec_t spec;
+	int admitted = 0;
+
+	shmem_lock(shmem);
+	shmem->num_omp_applications += shmem->admit_pledged;
+	shmem->total_weight += shmem->admit_pledged_weight;
+	policy->decide(handle, &spec, 0);
+	shmem->num_omp_applications -= shmem->admit_pledged;
+	shmem->total_weight -= shmem->admit_pledged_weight;
+	if(spec.num_tasks >= needed)
+	{
+		handle->app->admit_pledged = 1;
+		shmem->admit_pledged++;
+		shmem->admit_pledged_weight += handle->weight;
+		admitted = 1;
+	}
+	shmem_unlock(shmem);
+
+	if(admitted)
+		OMP_NUMA_DEBUG("admitted with a share of %u of %u processors\n",
+			spec.num_tasks, __num_procs);
+	return admitted;
+}
+
+/* Add (sign 1) or remove (sign -1) execution specifications of a
+ * latency-critical application to/from the latency-critical counters.  Must
+ * hold the lock.
+ */
+void count_critical(omp_numa_shmem* shmem,
+										int sign,
+										unsigned specs,
+										unsigned weight,
+										unsigned num_tasks,
+										const unsigned* task_assignment)
+{
+	numa_node_t node;
+
+	shmem->critical_applications += sign * specs;
+	shmem->critical_weight += sign * specs * weight;
+	shmem->critical_tasks += sign * num_tasks;
+	for(node = 0; node < __num_nodes; node++)
+		shmem_node(shmem, node)->critical_task_count += sign * task_assignment[node];
+}
+
+/* Gather the per-node tasks an application holds */
+void app_task_assignment(omp_numa_shmem* shmem,
+												 omp_numa_app* app,
+												 unsigned* task_assignment)
+{
+	numa_node_t node;
+	for(node = 0; node < __num_nodes; node++)
+		task_assignment[node] = app_node(shmem, app, node)->tasks;
+}
+
+/* Stop counting an application as admitted but not yet started, now that it
+ * has reserved its first setup (or died).  Must hold the lock.
+ */
+void drop_pledge(omp_numa_shmem* shmem, omp_numa_app* app)
+{
+	if(!app->admit_pledged)
+		return;
+	shmem->admit_pledged -= MIN(1, shmem->admit_pledged);
+	shmem->admit_pledged_weight -= MIN(app->weight, shmem->admit_pledged_weight);
+	app->admit_pledged = 0;
+}
+
+/* Open the shared-memory segment, creating it if nobody has yet.  Whoever
+ * wins the race to create the file initializes it; everybody else waits for
+ * them.  If the segment is unlinked while we're attaching (its last user
+ * left, or its creator died before making it usable), start over.  Returns 0
+ * if attached.
+ */
+int open_segment(omp_numa_t* handle, omp_numa_flags flags)
+{
+	int attempt, created, ret;
+
+	handle->shmem_map_size = max_segment_size();
+	for(attempt = 0; attempt < OPEN_ATTEMPTS; attempt++)
+	{
+		created = 0;
+		handle->shmem_fd = shm_open(SHMEM_FILE, O_RDWR, 0666);
+		if(handle->shmem_fd < 0 && errno == ENOENT)
+		{
+			handle->shmem_fd = shm_open(SHMEM_FILE, O_RDWR | O_CREAT | O_EXCL, 0666);
+			if(handle->shmem_fd < 0 && errno == EEXIST)
+				continue; // Somebody else beat us to it
+			created = 1;
+		}
+		if(handle->shmem_fd < 0)
+		{
+			perror("Could not open shared-memory device");
+			return -1;
+		}
+
+		// Map into memory, leaving room to grow
+		if((handle->shmem = (omp_numa_shmem*)mmap(NULL,
+																							handle->shmem_map_size,
+																							PROT_READ | PROT_WRITE,
+																							MAP_SHARED,
+																							handle->shmem_fd,
+																							0)) == MAP_FAILED)
+		{
+			perror("Could not map shared-memory into process");
+			close(handle->shmem_fd);
+			return -1;
+		}
+
+		if(created)
+			ret = create_segment(handle, flags);
+		else
+			ret = join_segment(handle, flags);
+		if(!ret)
+			return 0;
+
+		munmap(handle->shmem, handle->shmem_map_size);
+		close(handle->shmem_fd);
+		if(ret < 0)
+			return -1;
+	}
+
+	ERROR("shared memory keeps disappearing, giving up\n");
+	return -1;
+}
+
+/* Size & initialize a segment we just created.  Returns 0 if attached. */
+int create_segment(omp_numa_t* handle, omp_numa_flags flags)
+{
+	omp_numa_shmem* shmem = handle->shmem;
+	pthread_mutexattr_t attr;
+	omp_numa_header hdr;
+	int ret;
+
+	OMP_NUMA_DEBUG("creating shared memory\n");
+	if(ftruncate(handle->shmem_fd,
+							 layout_segment(&hdr, __num_nodes, __num_cpu_words * CPU_MASK_BITS)) ||
+		 fstat(handle->shmem_fd, &handle->shmem_fd_stats))
+	{
+		perror("Could not resize shared-memory file");
+		shm_unlink(SHMEM_FILE);
+		return -1;
+	}
+
+	// Robust, so that whoever's next gets the lock if we die while holding it
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	ret = pthread_mutex_init(&shmem->init_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	if(ret)
+	{
+		ERROR("could not initialize shared-memory init lock\n");
+		shm_unlink(SHMEM_FILE);
+		return -1;
+	}
+
+	pthread_mutex_lock(&shmem->init_lock);
+	__atomic_store_n(&shmem->state, SEGMENT_INITIALIZING, __ATOMIC_RELEASE);
+	shmem->users = 0;
+	shmem->shepherd = 0;
+	if((ret = init_segment(handle)) || (ret = attach_segment(handle, flags)))
 	{
-		numa_node_t cur_smallest = 0;
-		unsigned cur_smallest_count = UINT_MAX;
+		shmem->state = SEGMENT_DEAD;
+		shm_unlink(SHMEM_FILE);
+	}
+	pthread_mutex_unlock(&shmem->init_lock);
+	return ret;
+}
 
-		// Find node with smallest # tasks, or if we're NUMA-aware, a node with
-		// an equally small # tasks but was a previous execution node
-		for(cur_node = 0; cur_node < __num_nodes; cur_node++)
+/* Attach to a segment somebody else created, waiting for it to become usable
+ * (& finishing its initialization if its creator died).  Returns 0 if
+ * attached, 1 if the segment went away & should be re-opened or -1 if it
+ * can't be used.
+ */
+int join_segment(omp_numa_t* handle, omp_numa_flags flags)
+{
+	omp_numa_shmem* shmem = handle->shmem;
+	unsigned long long deadline;
+	struct stat cur_stats;
+	int fd, ret;
+
+	// Wait for the creator to size the segment & make its init lock usable
+	deadline = omp_numa_time_ns() + INIT_TIMEOUT_MS * 1000000ULL;
+	while(1)
+	{
+		if(fstat(handle->shmem_fd, &handle->shmem_fd_stats))
+		{
+			perror("Could not get shared-memory file statistics");
+			return -1;
+		}
+
+		// Don't touch locks laid out differently by other versions
+		if((size_t)handle->shmem_fd_stats.st_size >= sizeof(omp_numa_header) &&
+			 __atomic_load_n(&shmem->hdr.magic, __ATOMIC_ACQUIRE) == SHMEM_MAGIC &&
+			 shmem->hdr.version != SHMEM_VERSION)
 		{
-			if(local_task_count[cur_node] < cur_smallest_count)
+			segment_compatible(handle);
+			return -1;
+		}
+
+		if((size_t)handle->shmem_fd_stats.st_size >= sizeof(omp_numa_shmem) &&
+			 __atomic_load_n(&shmem->state, __ATOMIC_ACQUIRE) != SEGMENT_CREATING)
+			break;
+
+		if(omp_numa_time_ns() > deadline)
+		{
+			// Only remove the file if it's still the one we opened
+			fd = shm_open(SHMEM_FILE, O_RDWR, 0666);
+			if(fd >= 0 && !fstat(fd, &cur_stats) &&
+				 cur_stats.st_ino == handle->shmem_fd_stats.st_ino)
 			{
-				cur_smallest = cur_node;
-				cur_smallest_count = local_task_count[cur_node];
+				WARN("creator of shared memory died, re-creating it\n");
+				shm_unlink(SHMEM_FILE);
 			}
-			else if(numa_aware &&
-							local_task_count[cur_node] == cur_smallest_count &&
-							handle->prev_setup.task_assignment[cur_node] != 0)
-				cur_smallest = cur_node;
+			if(fd >= 0)
+				close(fd);
+			return 1;
 		}
+		usleep(1000);
+	}
 
-		// Schedule tasks to fill up node to next multiple of __num_procs_per_node
-		task_chunk = MIN(tasks_remaining,
-			__num_procs_per_node -
-				(local_task_count[cur_smallest] % __num_procs_per_node));
-		spec->task_assignment[cur_smallest] += task_chunk;
-		local_task_count[cur_smallest] += task_chunk;
-		tasks_remaining -= task_chunk;
+	if(lock_init(shmem) && shmem->state == SEGMENT_INITIALIZING)
+	{
+		WARN("creator of shared memory died, initializing it\n");
+		shmem->users = 0;
+		shmem->shepherd = 0;
+		if(init_segment(handle))
+		{
+			shmem->state = SEGMENT_DEAD;
+			shm_unlink(SHMEM_FILE);
+			pthread_mutex_unlock(&shmem->init_lock);
+			return -1;
+		}
 	}
 
-	return spec;
+	if(shmem->state == SEGMENT_DEAD)
+		ret = 1; // Last user left while we were waiting
+	else if(fstat(handle->shmem_fd, &handle->shmem_fd_stats) ||
+					!segment_compatible(handle))
+		ret = -1;
+	else
+		ret = attach_segment(handle, flags);
+	pthread_mutex_unlock(&shmem->init_lock);
+	return ret;
+}
+
+/* Initialize a segment's locks & contents for our topology.  Must hold the
+ * init lock.  Returns 0 if successful.
+ */
+int init_segment(omp_numa_t* handle)
+{
+	omp_numa_shmem* shmem = handle->shmem;
+	numa_node_t i, j;
+
+#if defined(_USE_SPINLOCK)
+	if(pthread_spin_init(&shmem->lock, PTHREAD_PROCESS_SHARED))
+	{
+		perror("Could not initialize spin lock");
+		return -1;
+	}
+#elif defined(_USE_SEMAPHORE)
+	if(sem_init(&shmem->lock, 1, 1))
+	{
+		perror("Could not initialize semaphore");
+		return -1;
+	}
+#else
+	shmem->seq = 0;
+#endif
+	if(sem_init(&shmem->sched_sem, 1, 0))
+	{
+		perror("Could not initialize scheduler semaphore");
+		return -1;
+	}
+	shmem_lock(shmem);
+
+	// Initialize shared memory
+	layout_segment(&shmem->hdr, __num_nodes, __num_cpu_words * CPU_MASK_BITS);
+	shmem->hdr.version = SHMEM_VERSION;
+	shmem->num_omp_applications = 0;
+	shmem->num_omp_tasks = 0;
+	shmem->cur_rr_node = 0;
+	shmem->epoch = 0;
+	shmem->admit_waiters = 0;
+	shmem->admit_pledged = 0;
+	shmem->admit_pledged_weight = 0;
+	shmem->policy = 0;
+	shmem->total_weight = 0;
+	shmem->critical_applications = 0;
+	shmem->critical_tasks = 0;
+	shmem->critical_weight = 0;
+	memset(shmem->apps, 0, sizeof(shmem->apps));
+	shmem->sched_gen = 0;
+	memset(&shmem->load, 0, sizeof(shmem->load));
+	clear_arrays(shmem);
+
+	// Load the distance matrix
+	for(i = 0; i < __num_nodes; i++)
+		for(j = 0; j < __num_nodes; j++)
+			*shmem_distance(shmem, i, j) = MIN(numa_distance(i, j), 255);
+
+	shmem_unlock(shmem);
+
+	// Applications may attach from here on
+	__atomic_store_n(&shmem->hdr.magic, SHMEM_MAGIC, __ATOMIC_RELEASE);
+	__atomic_store_n(&shmem->state, SEGMENT_READY, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Count ourselves as a user of the segment (& claim it if we're the
+ * shepherd).  Must hold the init lock.  Returns 0 if successful.
+ */
+int attach_segment(omp_numa_t* handle, omp_numa_flags flags)
+{
+	omp_numa_shmem* shmem = handle->shmem;
+
+	if(IS_SHEPHERD(flags))
+	{
+		if(shmem->shepherd && shmem->shepherd != getpid() &&
+			 (!kill(shmem->shepherd, 0) || errno != ESRCH))
+		{
+			fprintf(stderr, "ERROR: shepherd %d is already running\n",
+				shmem->shepherd);
+			return -1;
+		}
+
+		// Inherit a dead shepherd's reference
+		if(shmem->shepherd && shmem->users)
+			shmem->users--;
+		shmem->shepherd = getpid();
+	}
+	shmem->users++;
+	return 0;
+}
+
+/* Stop using the segment.  The last process out destroys its locks & removes
+ * it, anybody opening it in the meantime will see it's dead & start over.
+ */
+void detach_segment(omp_numa_t* handle, omp_numa_flags flags)
+{
+	omp_numa_shmem* shmem = handle->shmem;
+
+	lock_init(shmem);
+	if(IS_SHEPHERD(flags))
+	{
+		// Applications fall back to mapping themselves
+		shmem->shepherd = 0;
+		__atomic_store_n(&shmem->policy, 0, __ATOMIC_RELAXED);
+		bump_epoch(shmem);
+	}
+	if(shmem->users)
+		shmem->users--;
+	if(!shmem->users)
+	{
+		OMP_NUMA_DEBUG("last user of shared memory, removing it\n");
+		shmem->state = SEGMENT_DEAD;
+#if defined(_USE_SPINLOCK)
+		pthread_spin_destroy(&shmem->lock);
+#elif defined(_USE_SEMAPHORE)
+		sem_destroy(&shmem->lock);
+#endif
+		sem_destroy(&shmem->sched_sem);
+		shm_unlink(SHMEM_FILE);
+	}
+	pthread_mutex_unlock(&shmem->init_lock);
+}
+
+/* Take a segment's init lock.  Returns 1 if its previous owner died while
+ * holding it, in which case whatever it was doing must be checked.
+ */
+int lock_init(omp_numa_shmem* shmem)
+{
+	if(pthread_mutex_lock(&shmem->init_lock) == EOWNERDEAD)
+	{
+		pthread_mutex_consistent(&shmem->init_lock);
+		return 1;
+	}
+	return 0;
 }
 
+/* Zero the per-node, per-CPU & per-application arrays (but not the central
+ * scheduler's allotments) & empty the trace rings
+ */
+void clear_arrays(omp_numa_shmem* shmem)
+{
+	unsigned i;
+
+	memset(shmem_node(shmem, 0), 0,
+		shmem->hdr.num_nodes * sizeof(omp_numa_node));
+	memset(shmem_distance(shmem, 0, 0), 0,
+		shmem->hdr.num_nodes * shmem->hdr.num_nodes);
+	memset(shmem_cpu(shmem, 0), 0, shmem->hdr.num_cpus * sizeof(omp_numa_cpu));
+	for(i = 0; i < MAX_NUM_APPS; i++)
+	{
+		memset(app_node(shmem, &shmem->apps[i], 0), 0, shmem->hdr.app_nodes_stride);
+		clear_reservations(shmem, &shmem->apps[i]);
+		memset(app_trace_ring(shmem, &shmem->apps[i]), 0,
+			sizeof(omp_numa_trace_ring));
+	}
+}
+
+/* Forget an application's reservations.  The caller must have exclusive
+ * access to the shared counters (or own the application's slot).
+ */
+void clear_reservations(omp_numa_shmem* shmem, omp_numa_app* app)
+{
+	numa_node_t node;
+
+	app->num_tasks = 0;
+	for(node = 0; node < (numa_node_t)shmem->hdr.num_nodes; node++)
+	{
+		app_node(shmem, app, node)->specs = 0;
+		app_node(shmem, app, node)->tasks = 0;
+	}
+	memset(app_cpu_tasks(shmem, app), 0, shmem->hdr.app_cpus_stride);
+}
+
+/* Remember an execution specification as the previous setup for NUMA-aware
+ * mapping
+ */
+void save_prev_setup(omp_numa_t* handle, const exec_spec_t* spec)
+{
+	omp_numa_copy_spec(&handle->prev_setup, spec);
+}
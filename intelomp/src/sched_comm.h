@@ -20,6 +20,8 @@ extern "C" {
 ///////////////////////////////////////////////////////////////////////////////
 
 #define MAX_NUM_NODES 64
+#define MAX_NUM_CPUS 1024
+#define CPU_MASK_BITS (8 * sizeof(unsigned long))
 
 /* Handle used to query and retain NUMA information about OpenMP tasks */
 typedef struct omp_numa_t omp_numa_t;
@@ -28,8 +30,43 @@ typedef struct omp_numa_t omp_numa_t;
 typedef struct exec_spec_t {
 	unsigned num_tasks; // Total number of tasks
 	unsigned task_assignment[MAX_NUM_NODES]; // Per-node tasks
+	unsigned long cpus[MAX_NUM_CPUS / CPU_MASK_BITS]; // Reserved (configured) CPUs
 } exec_spec_t;
 
+/* Where a thread is currently bound, so binding it again to the same place
+ * can skip the migration (see omp_numa_bind_node()) */
+typedef struct omp_numa_binding_t {
+	numa_node_t node; // Node the thread is bound to, -1 if not bound yet
+	int cpu; // CPU the thread is pinned to, -1 if anywhere on the node
+} omp_numa_binding_t;
+
+/* Information about an OpenMP application, returned by omp_numa_app_info() */
+typedef struct omp_numa_app_info_t {
+	int pid; // Process ID
+	unsigned weight; // Weight for weighted mapping policies
+	unsigned qos_class; // Quality-of-service class (OMP_NUMA_BEST_EFFORT, ...)
+	unsigned num_tasks; // Tasks currently reserved
+	unsigned task_assignment[MAX_NUM_NODES]; // Per-node reserved tasks
+	unsigned alloc_num_tasks; // Tasks allotted by the central scheduler
+	unsigned alloc_assignment[MAX_NUM_NODES]; // Per-node allotted tasks
+	unsigned resizes; // Times the number of tasks changed between mappings
+	unsigned damped; // Changes suppressed by damping (OMP_NUMA_DAMP_THRESHOLD)
+	unsigned rebinds; // Threads moved to a new node or CPU
+	unsigned rebinds_avoided; // Threads already where they were bound to
+} omp_numa_app_info_t;
+
+/* System load sampled by the shepherd, returned by omp_numa_system_load() */
+typedef struct omp_numa_load_t {
+	unsigned long long age_ns; // How long ago the sample was taken
+	unsigned running; // Runnable tasks of all processes, except the shepherd
+	unsigned threads; // Tasks (threads) of all processes
+	double loadavg[3]; // 1, 5 & 15-minute load averages
+} omp_numa_load_t;
+
+/* Query an execution specification's CPU mask */
+#define SPEC_HAS_CPU( spec, cpu ) \
+	(((spec)->cpus[(cpu) / CPU_MASK_BITS] >> ((cpu) % CPU_MASK_BITS)) & 0x1)
+
 /* Flag type for configuring behavior */
 typedef unsigned omp_numa_flags;
 
@@ -45,9 +82,10 @@ typedef unsigned omp_numa_flags;
 #define OMP_NUMA_DEBUG( format, ... )
 #endif
 
-/* For initialize & shutdown, specify whether the calling process is
- * considered the shepherd process responsible for initial setup & final
- * cleanup.
+/* For initialize & shutdown, specify whether the calling process is the
+ * shepherd.  Setup & cleanup don't need one - whichever process arrives first
+ * creates the shared memory & the last one to leave removes it - but only one
+ * shepherd may run at a time.
  */
 #define IS_SHEPHERD( flags ) (flags & 0x1)
 #define SHEPHERD 1
@@ -60,13 +98,37 @@ typedef unsigned omp_numa_flags;
 
 /* Environment variables to specify configuration & execution */
 #define OMP_NUMA_AWARE_MAPPING "OMP_NUMA_AWARE_MAPPING"
+#define OMP_NUMA_LEASE "OMP_NUMA_LEASE" // Lease duration in milliseconds
+#define OMP_NUMA_POLICY "OMP_NUMA_POLICY" // Mapping policy (overrides shepherd)
+#define OMP_NUMA_WEIGHT "OMP_NUMA_WEIGHT" // Weight for weighted-share mapping
+#define OMP_NUMA_CPU_BINDING "OMP_NUMA_CPU_BINDING" // Pin tasks to single CPUs
+#define OMP_NUMA_RESIDENCY "OMP_NUMA_RESIDENCY" // Residency sampling interval (ms)
+#define OMP_NUMA_MIGRATE "OMP_NUMA_MIGRATE" // Page migration rate limit (MB/s)
+#define OMP_NUMA_TRACE "OMP_NUMA_TRACE" // Record mapping decisions
+#define OMP_NUMA_SOCKET "OMP_NUMA_SOCKET" // Shepherd control socket path
+#define OMP_NUMA_ADMIT_MIN "OMP_NUMA_ADMIT_MIN" // Min. share to start (CPUs)
+#define OMP_NUMA_ADMIT_TIMEOUT "OMP_NUMA_ADMIT_TIMEOUT" // Admission wait (ms)
+#define OMP_NUMA_CLASS "OMP_NUMA_CLASS" // Quality-of-service class name
+#define OMP_NUMA_DAMP_THRESHOLD "OMP_NUMA_DAMP_THRESHOLD" // Min. resize (tasks)
+#define OMP_NUMA_SHRINK_DELAY "OMP_NUMA_SHRINK_DELAY" // Shrink after (ms)
+#define OMP_NUMA_GROW_INTERVAL "OMP_NUMA_GROW_INTERVAL" // Grow every (ms)
+#define OMP_NUMA_RANGE "OMP_NUMA_RANGE" // Task bounds, "min:pref:max"
+
+/* Quality-of-service classes, see omp_numa_set_qos() */
+#define OMP_NUMA_BEST_EFFORT 0
+#define OMP_NUMA_LATENCY_CRITICAL 1
+#define OMP_NUMA_NUM_CLASSES 2
+
+/* Default path of the shepherd's control socket */
+#define OMP_NUMA_DEFAULT_SOCKET "/tmp/omp_numa.sock"
 
 ///////////////////////////////////////////////////////////////////////////////
 // Initialization & shutdown
 ///////////////////////////////////////////////////////////////////////////////
 
 /**
- * Initialize shared memory communication
+ * Initialize shared memory communication, creating the shared memory if no
+ * other process has
  *
  * @return a shared-memory handle used for communication, or NULL if
  *         initialization failed
@@ -74,7 +136,8 @@ typedef unsigned omp_numa_flags;
 omp_numa_t* omp_numa_initialize(omp_numa_flags flags);
 
 /**
- * Shutdown shared-memory communication
+ * Shutdown shared-memory communication, removing the shared memory if no
+ * other process is using it
  *
  * @param handle the shared-memory handle to shutdown & clean up
  */
@@ -90,15 +153,35 @@ void omp_numa_shutdown(omp_numa_t* handle, omp_numa_flags);
 numa_node_t omp_numa_num_nodes();
 
 /**
- * Returns the number of processors
+ * Returns the number of processors available to the process, i.e. online &
+ * within its cpuset
  */
 unsigned omp_numa_num_procs();
 
 /**
- * Returns the number of processors per node
+ * Returns the number of processors per node (of the largest node, if nodes
+ * have different numbers of available processors)
  */
 unsigned omp_numa_num_procs_per_node();
 
+/**
+ * Returns the number of CPUs of a node available to the process (0 for
+ * memory-only nodes)
+ */
+unsigned omp_numa_node_num_cpus(numa_node_t node);
+
+/**
+ * Returns the NUMA distance between two nodes, as reported by the SLIT (10 is
+ * local)
+ *
+ * @param handle the shared-memory handle
+ * @param from the node accessing memory
+ * @param to the node on which the memory resides
+ */
+unsigned omp_numa_node_distance(omp_numa_t* handle,
+																numa_node_t from,
+																numa_node_t to);
+
 /**
  * Return the number of tasks currently executing on a NUMA node
  *
@@ -122,6 +205,41 @@ void omp_numa_task_assignment(omp_numa_t* handle,
 															size_t num_nodes,
 															omp_numa_flags flags);
 
+/**
+ * Return the number of CPUs of a NUMA node reserved by at least one task
+ *
+ * @param handle the shared-memory handle
+ * @param node the node for which to query the number of busy CPUs
+ * @param flags users can specify OMP_FAST to avoid locking
+ * @return the number of busy CPUs on a node
+ */
+unsigned omp_numa_num_busy_cpus(omp_numa_t* handle,
+																numa_node_t node,
+																omp_numa_flags flags);
+
+/**
+ * Return information about the application in a per-application slot.  The
+ * information is read without locking & may be slightly outdated.
+ *
+ * @param handle the shared-memory handle
+ * @param slot the slot to query, starting at 0
+ * @param info filled in with the application's information if the slot is
+ *        in use
+ * @return 1 if the slot is in use, 0 if it is free, or -1 if there is no such
+ *         slot
+ */
+int omp_numa_app_info(omp_numa_t* handle,
+											unsigned slot,
+											omp_numa_app_info_t* info);
+
+/**
+ * Return the epoch, which changes whenever an application arrives, leaves or
+ * is remapped (or the central scheduler publishes new allotments)
+ *
+ * @param handle the shared-memory handle
+ */
+unsigned omp_numa_epoch(omp_numa_t* handle);
+
 ///////////////////////////////////////////////////////////////////////////////
 // Updates to shared data
 ///////////////////////////////////////////////////////////////////////////////
@@ -133,10 +251,25 @@ void omp_numa_task_assignment(omp_numa_t* handle,
  */
 void omp_numa_clear_counters(omp_numa_t* handle);
 
+/**
+ * Reclaim the slots & reservations of applications which exited without
+ * shutting down (e.g. crashed or were killed), so their tasks stop counting
+ * against the nodes & CPUs they were mapped to.  An application is dead if its
+ * process is gone or a zombie, or if its PID was reused by a process with a
+ * different start time.  Applications reap when they start, the shepherd
+ * periodically.
+ *
+ * @param handle the shared-memory handle
+ * @return the number of applications reaped
+ */
+int omp_numa_reap_apps(omp_numa_t* handle);
+
 /**
  * Schedule tasks for an OpenMP application
  *
- * TODO describe strategy for mapping
+ * The number of tasks & their mapping onto nodes are decided by the active
+ * mapping policy (see omp_numa_set_policy()).  Several threads of a process
+ * may map, clean up & record regions through the same handle concurrently.
  *
  * @param handle the shared-memory handle
  * @param requested_spec application-requested execution specification.  If
@@ -148,6 +281,91 @@ exec_spec_t* omp_numa_map_tasks(omp_numa_t* handle,
 																exec_spec_t* requested,
 																omp_numa_flags flags);
 
+/**
+ * Schedule tasks for an OpenMP application like omp_numa_map_tasks(), but
+ * decide the execution specification into caller-provided storage rather
+ * than a freshly allocated one.  Nothing is allocated, so this is safe to call
+ * on every parallel region.
+ *
+ * @param handle the shared-memory handle
+ * @param spec storage for the execution specification, which must stay valid
+ *        until it is passed to omp_numa_cleanup()
+ * @param flags configure mapping behavior (ignored for now)
+ * @return spec, or the handle's leased specification if leases are enabled
+ */
+exec_spec_t* omp_numa_map_tasks_into(omp_numa_t* handle,
+																		 exec_spec_t* spec,
+																		 omp_numa_flags flags);
+
+/**
+ * Schedule tasks for a parallel region like omp_numa_map_tasks_into(), within
+ * bounds on its number of tasks - the region needs at least min tasks,
+ * prefers pref & can use at most max (0 for no bound).  The policy's decision
+ * is clamped to [min, max], & beyond pref the region only takes processors no
+ * other application has reserved, leaving the surplus to them.  The bounds
+ * are narrowed by the process's (see omp_numa_request_range()).
+ *
+ * @param handle the shared-memory handle
+ * @param spec storage for the execution specification, which must stay valid
+ *        until it is passed to omp_numa_cleanup()
+ * @param min the minimum number of tasks, even if it oversubscribes nodes
+ * @param pref the preferred number of tasks
+ * @param max the maximum number of tasks
+ * @param flags configure mapping behavior (ignored for now)
+ * @return spec, or the handle's leased specification if leases are enabled
+ *         & it is within the bounds
+ */
+exec_spec_t* omp_numa_map_range(omp_numa_t* handle,
+																exec_spec_t* spec,
+																unsigned min,
+																unsigned pref,
+																unsigned max,
+																omp_numa_flags flags);
+
+/**
+ * Divide up a parent team's execution specification for a nested parallel
+ * region, without negotiating through shared memory.  The region runs on the
+ * node of the thread forking it, with an equal share of the parent's tasks on
+ * the node among the parent's threads there (within bounds, see
+ * omp_numa_map_range()) & a slice of the parent's CPUs on the node.  The
+ * result is only for omp_numa_bind_node(), don't pass it to
+ * omp_numa_cleanup().
+ *
+ * @param handle the shared-memory handle
+ * @param parent the parent team's execution specification
+ * @param node the forking thread's node
+ * @param idx the forking thread's index among the parent's threads on the node
+ * @param siblings the number of the parent's threads on the node
+ * @param spec storage for the nested execution specification
+ * @param min the minimum number of tasks
+ * @param max the maximum number of tasks (0 for no bound)
+ * @return spec, or NULL if the parent has no tasks on the node
+ */
+exec_spec_t* omp_numa_map_nested(omp_numa_t* handle,
+																 const exec_spec_t* parent,
+																 numa_node_t node,
+																 unsigned idx,
+																 unsigned siblings,
+																 exec_spec_t* spec,
+																 unsigned min,
+																 unsigned max);
+
+/**
+ * Bound the number of tasks of all of the process's mappings (also set through
+ * OMP_NUMA_RANGE), see omp_numa_map_range().  Takes effect from the next
+ * mapping.  The maximum is what the central scheduler allots us at most.
+ *
+ * @param handle the shared-memory handle
+ * @param min the minimum number of tasks (0 for no bound)
+ * @param pref the preferred number of tasks (0 for no preference)
+ * @param max the maximum number of tasks (0 for no bound)
+ * @return 0 on success, -1 if the bounds are inconsistent
+ */
+int omp_numa_request_range(omp_numa_t* handle,
+													 unsigned min,
+													 unsigned pref,
+													 unsigned max);
+
 /**
  * Cleanup an application's task from the node task counters
  *
@@ -158,11 +376,318 @@ exec_spec_t* omp_numa_map_tasks(omp_numa_t* handle,
  */
 void omp_numa_cleanup(omp_numa_t* handle, exec_spec_t* spec);
 
+/**
+ * Copy an execution specification, e.g. to keep it past the storage it was
+ * mapped into.  Only the entries in use for this machine's nodes & CPUs are
+ * copied, the rest of the destination is left as is.
+ *
+ * @param dst the specification to copy into
+ * @param src the specification to copy
+ * @return dst
+ */
+exec_spec_t* omp_numa_copy_spec(exec_spec_t* dst, const exec_spec_t* src);
+
+/**
+ * CPU binding - along with the per-node task assignment, every execution
+ * specification reserves CPUs for its tasks on each node, preferring CPUs no
+ * other task is reserving.  If OMP_NUMA_CPU_BINDING=1, omp_numa_bind_task()
+ * pins each task to its own CPU rather than letting it float across its node.
+ */
+
+/**
+ * Move the calling thread to where a task of an execution specification
+ * executes - its reserved CPU if CPU binding is enabled, otherwise (or if the
+ * application has more tasks than CPUs on the task's node) anywhere on the
+ * task's node.
+ *
+ * @param handle the shared-memory handle
+ * @param spec an execution specification returned by omp_numa_map_tasks()
+ * @param task the task's index in the execution specification, where tasks
+ *        are assigned to nodes in order
+ * @return the task's node, or -1 if the task is not in the specification or
+ *         could not be moved there
+ */
+numa_node_t omp_numa_bind_task(omp_numa_t* handle,
+															 const exec_spec_t* spec,
+															 unsigned task);
+
+/**
+ * Move the calling thread to a node of an execution specification, for
+ * runtimes which decide themselves which thread runs on which node - the
+ * idx-th CPU the specification reserves on the node if CPU binding is
+ * enabled, otherwise anywhere on the node.  If the thread keeps a binding
+ * cache & is already bound there, it isn't migrated again.
+ *
+ * @param handle the shared-memory handle
+ * @param spec an execution specification returned by omp_numa_map_tasks()
+ * @param node the node to run on
+ * @param idx the thread's index among the specification's tasks on the node
+ * @param binding the calling thread's current binding, updated on migration
+ *        (initialize the node to -1) & reset if it fails, or NULL to always
+ *        migrate
+ * @return the node, or -1 if the specification has no tasks on it or the
+ *         thread could not be moved there
+ */
+numa_node_t omp_numa_bind_node(omp_numa_t* handle,
+															 const exec_spec_t* spec,
+															 numa_node_t node,
+															 unsigned idx,
+															 omp_numa_binding_t* binding);
+
+/**
+ * Leases - if OMP_NUMA_LEASE is set, omp_numa_map_tasks() hands out the same
+ * execution specification across parallel regions until the lease expires or
+ * an application arrives or leaves.  The leased specification is owned by the
+ * handle, stays reserved in shared memory after omp_numa_cleanup() and must
+ * not be freed.
+ */
+
+/**
+ * Return whether an execution specification is the handle's leased one
+ *
+ * @param handle the shared-memory handle
+ * @param spec an execution specification returned by omp_numa_map_tasks()
+ * @return non-zero if spec is leased (and must not be freed)
+ */
+int omp_numa_is_leased(omp_numa_t* handle, exec_spec_t* spec);
+
+/**
+ * Give back the handle's lease, if any, removing it from the node task
+ * counters.  Called automatically by omp_numa_shutdown().
+ *
+ * @param handle the shared-memory handle
+ */
+void omp_numa_release_lease(omp_numa_t* handle);
+
+///////////////////////////////////////////////////////////////////////////////
+// Mapping policies
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Available policies:
+ *   equal-share    - every application gets an equal share of processors,
+ *                    filling empty nodes first & spilling over onto the
+ *                    nodes closest to the ones already chosen (default)
+ *   weighted-share - shares proportional to each application's OMP_NUMA_WEIGHT
+ *                    (see omp_numa_set_qos())
+ *   distance-aware - equal shares on the closest unfilled nodes, even if
+ *                    farther nodes are empty
+ *   packing        - equal shares, packed onto the fewest, most-occupied nodes
+ *   feedback       - processors go to the applications with the highest
+ *                    measured marginal utility (see omp_numa_region_done())
+ *   central        - the shepherd decides all applications' allotments at
+ *                    once (see omp_numa_schedule()), equal-share until it has
+ *
+ * Applications use the policy named by OMP_NUMA_POLICY if set, otherwise the
+ * one pushed by the shepherd.
+ */
+
+/**
+ * Quality of service - every application has a weight (OMP_NUMA_WEIGHT) & a
+ * class (OMP_NUMA_CLASS, "best-effort" by default or "latency-critical"):
+ *   latency-critical - a fair share of all processors, weighted if the policy
+ *                      is, mapped as if best-effort applications weren't
+ *                      there.  Best-effort applications give the processors
+ *                      back at their next mapping.
+ *   best-effort      - a fair share of the processors latency-critical
+ *                      applications don't hold
+ *
+ * Set the calling application's weight & class, including for the tasks it
+ * currently holds.  Other applications adapt at their next mapping.
+ *
+ * @param handle the shared-memory handle
+ * @param weight the application's weight (at least 1)
+ * @param qos_class the application's class (OMP_NUMA_BEST_EFFORT, ...)
+ * @return 0 if successful, -1 if the weight or class is invalid or the
+ *         application has no slot in shared memory
+ */
+int omp_numa_set_qos(omp_numa_t* handle, unsigned weight, unsigned qos_class);
+
+/**
+ * Return the name of a quality-of-service class, or NULL if there is no such
+ * class
+ */
+const char* omp_numa_class_name(unsigned qos_class);
+
+/**
+ * Push a mapping policy to all applications not overriding it through
+ * OMP_NUMA_POLICY.  Takes effect at each application's next mapping.
+ *
+ * @param handle the shared-memory handle
+ * @param name the name of the policy
+ * @return 0 if the policy was pushed, -1 if there is no such policy
+ */
+int omp_numa_set_policy(omp_numa_t* handle, const char* name);
+
+/**
+ * Return the name of the mapping policy the calling application uses
+ *
+ * @param handle the shared-memory handle
+ */
+const char* omp_numa_policy_name(omp_numa_t* handle);
+
+///////////////////////////////////////////////////////////////////////////////
+// Central scheduling
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Wait for an application to arrive or leave (used by the shepherd when acting
+ * as central scheduler)
+ *
+ * @param handle the shared-memory handle
+ * @param timeout_ms maximum time to wait, in milliseconds
+ * @return 1 if an application arrived or left, 0 on timeout or interruption
+ */
+int omp_numa_wait_requests(omp_numa_t* handle, unsigned timeout_ms);
+
+/**
+ * Re-solve the node assignment of all attached applications at once &
+ * publish each application's allotment, which applications using the central
+ * policy adopt at their next mapping.  Processors are shared in proportion to
+ * the applications' weights, & each application is placed on the free nodes
+ * closest to each other, preferring the nodes of its previous allotment.
+ *
+ * @param handle the shared-memory handle
+ * @return the number of applications scheduled
+ */
+int omp_numa_schedule(omp_numa_t* handle);
+
+///////////////////////////////////////////////////////////////////////////////
+// Parallel-region feedback
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Return a monotonic timestamp in nanoseconds, for timing parallel regions
+ */
+unsigned long long omp_numa_time_ns();
+
+/**
+ * Record the duration of a parallel region.  Builds a speedup curve per call
+ * site & periodically publishes the application's estimated serial fraction
+ * to shared memory, for use by the feedback mapping policy.
+ *
+ * @param handle the shared-memory handle
+ * @param site identifies the parallel region's call site (i.e. its ident_t)
+ * @param num_tasks number of threads the region executed with
+ * @param duration_ns duration of the region in nanoseconds
+ */
+void omp_numa_region_done(omp_numa_t* handle,
+													const void* site,
+													unsigned num_tasks,
+													unsigned long long duration_ns);
+
+///////////////////////////////////////////////////////////////////////////////
+// Tracing
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Tracing - if OMP_NUMA_TRACE=1, every parallel region's mapping decision is
+ * recorded in a ring buffer in the application's slot in shared memory, which
+ * the shepherd drains into a trace file (see scripts/parse_trace.py).  A full
+ * ring drops records rather than slowing down the application.
+ */
+
+/**
+ * Record a parallel region's mapping decision, if tracing is enabled.  May be
+ * called by several threads at once.
+ *
+ * @param handle the shared-memory handle
+ * @param site the parallel region's call site
+ * @param requested the number of threads the application asked for
+ * @param spec the execution specification the region executed with
+ * @param duration_ns how long the region took
+ */
+void omp_numa_trace_region(omp_numa_t* handle,
+													 const void* site,
+													 unsigned requested,
+													 const exec_spec_t* spec,
+													 unsigned long long duration_ns);
+
+/**
+ * Drain all applications' trace rings into a trace file (shepherd only).
+ * Writes the trace file header if the file is empty.
+ *
+ * @param handle the shared-memory handle
+ * @param fp the trace file
+ * @param dropped if non-null, set to the number of records applications
+ *        dropped since the last call because their rings were full
+ * @return the number of records written, or -1 if writing failed
+ */
+int omp_numa_drain_trace(omp_numa_t* handle, FILE* fp, unsigned* dropped);
+
+///////////////////////////////////////////////////////////////////////////////
+// System load
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * System load - the shepherd periodically samples the load of the whole
+ * machine, including processes which aren't OpenMP applications, so that
+ * applications don't each have to scan /proc for it.
+ */
+
+/**
+ * Sample the system load from /proc/stat & /proc/loadavg & publish it in
+ * shared memory (shepherd only).  Per-node utilizations cover the time since
+ * the previous sample.
+ *
+ * @param handle the shared-memory handle
+ * @return 0 if successful, or -1 if the load could not be read
+ */
+int omp_numa_sample_load(omp_numa_t* handle);
+
+/**
+ * Read the latest system load sample
+ *
+ * @param handle the shared-memory handle
+ * @param max_age_ms oldest sample accepted, in milliseconds
+ * @param load filled in with the sample if there is a recent enough one
+ * @return 1 if there was a sample at most max_age_ms old, 0 otherwise (e.g.
+ *         no shepherd is running)
+ */
+int omp_numa_system_load(omp_numa_t* handle,
+												 unsigned max_age_ms,
+												 omp_numa_load_t* load);
+
+/**
+ * Return the number of busy CPUs of a node in the latest system load sample,
+ * whichever processes kept them busy
+ *
+ * @param handle the shared-memory handle
+ * @param node the node for which to query the load
+ * @return the average number of busy CPUs between the latest two samples
+ */
+double omp_numa_node_load(omp_numa_t* handle, numa_node_t node);
+
 ///////////////////////////////////////////////////////////////////////////////
 // Miscellaneous helpers
 ///////////////////////////////////////////////////////////////////////////////
 
-/* N/A for now... */
+/**
+ * Simulate a different machine topology, for testing mapping policies.
+ * Replaces the calling process's view of the topology & the distance matrix
+ * in shared memory.  Call after omp_numa_initialize() & before any tasks are
+ * mapped.  Simulated CPUs cannot be bound to.
+ *
+ * @param handle the shared-memory handle
+ * @param num_nodes number of nodes
+ * @param procs_per_node number of processors per node
+ * @param distances num_nodes x num_nodes distance matrix (row-major), or NULL
+ *        for 10 (local) & 20 (remote)
+ */
+void omp_numa_simulate_topology(omp_numa_t* handle,
+																numa_node_t num_nodes,
+																unsigned procs_per_node,
+																const unsigned* distances);
+
+/**
+ * Simulate nodes with different numbers of processors (e.g. offlined CPUs,
+ * cpusets or memory-only nodes), for testing mapping policies.  Call after
+ * omp_numa_simulate_topology(), which sets the number of nodes & distances.
+ *
+ * @param handle the shared-memory handle
+ * @param node_cpus number of processors of each node (may be 0)
+ */
+void omp_numa_simulate_node_cpus(omp_numa_t* handle, const unsigned* node_cpus);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,894 @@
+///////////////////////////////////////////////////////////////////////////////
+// Shared-memory communication library internals                             //
+//                                                                           //
+// Definitions shared between the communication library & the mapping        //
+// policies.  Not installed for applications.                                //
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef _SCHED_COMM_INTERNAL_H
+#define _SCHED_COMM_INTERNAL_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // For CPU affinity
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+/* Shared-memory API */
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+/* Threading API */
+#include <semaphore.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/sysinfo.h>
+
+/* Reaping dead applications */
+#include <signal.h>
+#include <errno.h>
+
+/* Admission control */
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include <sched_comm.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal definitions
+///////////////////////////////////////////////////////////////////////////////
+
+/* Specify lock type (only leave one uncommented!), or select one when
+ * building with -D_USE_SPINLOCK, -D_USE_SEMAPHORE or -D_USE_SEQLOCK.
+ *
+ * The seqlock is the lock-free mode - readers take versioned snapshots of the
+ * counters and never block, while writers compute their update against a
+ * snapshot & commit it with a single compare-and-swap on the version,
+ * recomputing if somebody else committed first.
+ */
+#if !defined(_USE_SPINLOCK) && !defined(_USE_SEMAPHORE) && \
+		!defined(_USE_SEQLOCK)
+#define _USE_SPINLOCK
+//#define _USE_SEMAPHORE
+//#define _USE_SEQLOCK
+#endif
+
+#if (defined(_USE_SPINLOCK) + defined(_USE_SEMAPHORE) + \
+		 defined(_USE_SEQLOCK)) > 1
+#error Please use only one of a spinlock, a semaphore or a seqlock!
+#endif
+
+#define SHMEM_FILE "omp_numa"
+
+/* Shared-memory segment identification - bump the version whenever the
+ * layout of the segment changes, so that applications built against a
+ * different layout refuse to attach rather than corrupt the counters
+ */
+#define SHMEM_MAGIC 0x4f4d504eU // "OMPN"
+#define SHMEM_VERSION 11
+
+/* Bootstrapping - states of a segment (see omp_numa_shmem), how long to wait
+ * for the process creating a segment to make its init lock usable before
+ * deciding it died, & how often to retry opening a segment which went away
+ */
+#define SEGMENT_CREATING 0
+#define SEGMENT_INITIALIZING 1
+#define SEGMENT_READY 2
+#define SEGMENT_DEAD 3
+#define INIT_TIMEOUT_MS 1000
+#define OPEN_ATTEMPTS 8
+
+/* Admission control - how long to wait for free processors if
+ * OMP_NUMA_ADMIT_TIMEOUT isn't set, & how often to wake up while waiting to
+ * reap applications which died (as that doesn't change the epoch)
+ */
+#define ADMIT_TIMEOUT_MS 10000
+#define ADMIT_POLL_MS 100
+
+/* Cache line size, for keeping independently-updated data apart */
+#define CACHE_LINE 64
+#define ALIGN_UP( size, align ) (((size) + (align) - 1) / (align) * (align))
+#define MAX( a, b ) (a > b ? a : b)
+#define MIN( a, b ) (a < b ? a : b)
+
+/* Error-reporting */
+#define INIT_PERROR( msg, handle ) { \
+	perror(msg); \
+	free(handle); \
+	return NULL; \
+}
+
+#define ERROR( msg ) fprintf(stderr, "ERROR: " msg)
+
+/* Busy-wait hint */
+#if defined(__i386__) || defined(__x86_64__)
+#define CPU_RELAX() __asm__ __volatile__("pause" ::: "memory")
+#else
+#define CPU_RELAX() __asm__ __volatile__("" ::: "memory")
+#endif
+
+#ifdef _VERBOSE
+#define WARN( msg ) fprintf(stderr, "WARNING: " msg)
+#else
+#define WARN( msg )
+#endif
+
+/* Maximum number of concurrently attached OpenMP applications */
+#define MAX_NUM_APPS 64
+
+/* Owner of a per-application slot which is being reaped */
+#define APP_REAPING ((pid_t)-1)
+
+/* Parallel-region profiling - number of call sites tracked per application,
+ * number of distinct thread counts tracked per call site & number of regions
+ * between updates of the published estimates
+ */
+#define PROFILE_SITES 64
+#define PROFILE_POINTS 8
+#define PROFILE_PUBLISH_INTERVAL 16
+
+/* Tracing - number of records in each application's trace ring (a power of
+ * two), & the trace file's identification
+ */
+#define TRACE_RECORDS 1024
+#define TRACE_MAGIC 0x544d504fU // "OMPT"
+#define TRACE_VERSION 1
+
+/* Memory residency - a node is considered one of the application's data
+ * nodes if it holds at least 1/RESIDENCY_MIN_SHARE of its resident memory
+ */
+#define RESIDENCY_MIN_SHARE 8
+
+/* Background page migration - number of pages moved per move_pages() call */
+#define MIGRATE_BATCH 512
+
+/* System load sampling - fixed-point scale of the published load averages &
+ * utilizations (i.e. 1/1000ths)
+ */
+#define LOAD_SCALE 1000
+
+/* Machine topology, initialized by omp_numa_initialize() - the number of
+ * nodes, the number of CPUs available to the process & the number of CPUs of
+ * the largest node
+ */
+extern numa_node_t __num_nodes;
+extern unsigned __num_procs;
+extern unsigned __num_procs_per_node;
+
+/* CPUs of each node available to the process, i.e.
+ * __node_cpus[__node_cpu_offset[node]] through
+ * __node_cpus[__node_cpu_offset[node + 1] - 1] are the CPUs of node
+ */
+extern unsigned short __node_cpus[MAX_NUM_CPUS];
+extern unsigned __node_cpu_offset[MAX_NUM_NODES + 1];
+
+/* Number of CPUs of a node available to the process, i.e. its capacity */
+#define NODE_NUM_CPUS( node ) \
+	(__node_cpu_offset[(node) + 1] - __node_cpu_offset[(node)])
+
+/* Number of words of an execution specification's CPU mask in use */
+extern unsigned __num_cpu_words;
+
+/* Reserve a CPU in an execution specification's CPU mask */
+#define SPEC_SET_CPU( spec, cpu ) \
+	((spec)->cpus[(cpu) / CPU_MASK_BITS] |= 1UL << ((cpu) % CPU_MASK_BITS))
+
+/* Layout of the shared-memory segment, which starts with this header.  The
+ * per-node, per-CPU & per-application arrays are sized to the shepherd's
+ * topology & live at the recorded offsets (from the start of the segment),
+ * each starting on a cache line:
+ *   1. Magic number & layout version (SHMEM_MAGIC, SHMEM_VERSION)
+ *   2. Size of the segment in bytes
+ *   3. Number of nodes & CPUs the arrays are sized for
+ *   4. Per-node counters (one cache line per node)
+ *   5. Node distance matrix (num_nodes x num_nodes)
+ *   6. Per-CPU counters
+ *   7. Per-application per-node & per-CPU reservations, & their strides
+ *   8. Per-application trace rings, their stride & the size of a record
+ */
+typedef struct omp_numa_header {
+	unsigned magic;
+	unsigned version;
+	unsigned long size;
+
+	unsigned num_nodes;
+	unsigned num_cpus;
+
+	unsigned long nodes_offset;
+	unsigned long distance_offset;
+	unsigned long cpus_offset;
+	unsigned long app_nodes_offset;
+	unsigned long app_nodes_stride;
+	unsigned long app_cpus_offset;
+	unsigned long app_cpus_stride;
+	unsigned long trace_offset;
+	unsigned long trace_stride;
+	unsigned long trace_record_size;
+} omp_numa_header;
+
+/* Per-node task information:
+ *   1. OpenMP application count (# applications mapped to node)
+ *   2. OpenMP task counter (# tasks mapped to node) & how many of them belong
+ *      to latency-critical applications
+ *   3. Number of busy CPUs in the latest system load sample, by any process
+ *      (in 1/LOAD_SCALE CPUs, published with omp_numa_load's seqlock)
+ */
+typedef struct omp_numa_node {
+	unsigned application_count;
+	unsigned task_count;
+	unsigned critical_task_count;
+	unsigned busy_scaled;
+} __attribute__((aligned(CACHE_LINE))) omp_numa_node;
+
+/* Per-CPU task information:
+ *   1. OpenMP task counter (# tasks reserving CPU)
+ *   2. Process which most recently reserved the CPU (0 if none)
+ */
+typedef struct omp_numa_cpu {
+	unsigned task_count;
+	pid_t owner;
+} omp_numa_cpu;
+
+/* Per-application per-node information:
+ *   1. Number of tasks allotted by the central scheduler
+ *   2. Number of the application's execution specifications & tasks on the
+ *      node currently in the node counters
+ */
+typedef struct omp_numa_app_node {
+	unsigned alloc_tasks;
+	unsigned specs;
+	unsigned tasks;
+} omp_numa_app_node;
+
+/* Per-application information published in shared memory:
+ *   1. Owning process (0 if the slot is free, APP_REAPING while its owner's
+ *      reservations are being reclaimed) & its start time (in clock ticks
+ *      since boot, 0 if unknown), which tells a dead owner from a new process
+ *      which reused its PID
+ *   2. Number of execution specifications currently in the node counters
+ *   3. Whether the application has a measured speedup curve
+ *   4. Estimated serial fraction of the application (in 1/1000ths), from its
+ *      measured speedup curve - the speedup at any thread count follows from
+ *      it (see __omp_numa_speedup())
+ *   5. Request to the central scheduler - the application's weight,
+ *      quality-of-service class & maximum number of tasks (0 if unlimited)
+ *   6. Allotment published by the central scheduler - version counter (odd
+ *      while being published), generation in which it was decided (0 if
+ *      none yet) & the allotted number of tasks (per node, see app_node())
+ *   7. The application's live reservations, i.e. the sum of its execution
+ *      specifications in the node & CPU counters, so they can be reclaimed if
+ *      it dies without cleaning up (per node & per CPU, see app_node() &
+ *      app_cpu_tasks())
+ *   8. Whether the application was admitted but hasn't yet reserved its
+ *      first parallel region's setup
+ *   9. Number of times the application's number of tasks changed from one
+ *      mapping to the next, & number of changes suppressed by damping
+ *   10. Number of times the application's threads were migrated, & number of
+ *       migrations skipped because the thread was already bound there
+ */
+typedef struct omp_numa_app {
+	pid_t pid;
+	unsigned long long start_time;
+	unsigned active;
+	unsigned profiled;
+	unsigned serial_milli;
+
+	unsigned weight;
+	unsigned qos_class;
+	unsigned max_tasks;
+
+	unsigned alloc_seq;
+	unsigned alloc_gen;
+	unsigned alloc_num_tasks;
+
+	unsigned num_tasks;
+
+	unsigned admit_pledged;
+
+	unsigned resizes;
+	unsigned damped;
+
+	unsigned rebinds;
+	unsigned rebinds_avoided;
+} __attribute__((aligned(CACHE_LINE))) omp_numa_app;
+
+/* System load sampled by the shepherd (see sched_load.c), on a single cache
+ * line so applications can read it without touching the counters:
+ *   1. Version counter (odd while a sample is being published)
+ *   2. When the sample was taken (CLOCK_MONOTONIC, 0 if never)
+ *   3. Number of runnable tasks (excluding the shepherd) & of all tasks in the
+ *      system
+ *   4. 1, 5 & 15-minute load averages (in 1/LOAD_SCALE)
+ */
+typedef struct omp_numa_load {
+	unsigned seq;
+	unsigned long long sampled_ns;
+	unsigned running;
+	unsigned threads;
+	unsigned loadavg_scaled[3];
+} __attribute__((aligned(CACHE_LINE))) omp_numa_load;
+
+/* Per-application ring of trace records, written by the application & drained
+ * by the shepherd.  Indices only ever increase (modulo wrap-around) & survive
+ * the slot changing owners, as records carry their owner's PID:
+ *   1. Number of records written by the application & number of records it
+ *      dropped because the ring was full
+ *   2. Number of records drained by the shepherd (on its own cache line)
+ *
+ * TRACE_RECORDS records follow, each an omp_numa_trace_rec followed by the
+ * granted per-node task assignment (num_nodes unsigned ints) & CPU mask
+ * (num_cpus bits), padded to the header's record size.  The trace file written
+ * by the shepherd is an omp_numa_trace_file header followed by records in the
+ * same format (see scripts/parse_trace.py).
+ */
+typedef struct omp_numa_trace_ring {
+	unsigned head;
+	unsigned drops;
+	unsigned tail __attribute__((aligned(CACHE_LINE)));
+} __attribute__((aligned(CACHE_LINE))) omp_numa_trace_ring;
+
+/* A parallel region's mapping decision:
+ *   1. When the region ended (CLOCK_MONOTONIC) & how long it took (0 for
+ *      serialized regions)
+ *   2. Call site (ident_t of the parallel region)
+ *   3. Application's PID
+ *   4. Number of threads requested by the application & number of tasks
+ *      granted
+ */
+typedef struct omp_numa_trace_rec {
+	unsigned long long end_ns;
+	unsigned long long duration_ns;
+	unsigned long long site;
+	int pid;
+	unsigned requested;
+	unsigned num_tasks;
+	unsigned pad;
+} omp_numa_trace_rec;
+
+/* Trace file header:
+ *   1. Magic number & version (TRACE_MAGIC, TRACE_VERSION)
+ *   2. Number of nodes & CPUs records are sized for, & the size of a record
+ */
+typedef struct omp_numa_trace_file {
+	unsigned magic;
+	unsigned version;
+	unsigned num_nodes;
+	unsigned num_cpus;
+	unsigned record_size;
+	unsigned pad;
+} omp_numa_trace_file;
+
+/* Per-call site parallel region timings, used to build the speedup curve:
+ *   1. The call site (ident_t of the parallel region)
+ *   2. Total time spent in the region
+ *   3. Number of regions since the estimates were last updated
+ *   4. Average region duration for each thread count it executed with
+ *   5. Fitted serial & parallel time (T(n) = serial + parallel / n)
+ */
+typedef struct region_point {
+	unsigned num_tasks;
+	unsigned samples;
+	double avg_ns;
+} region_point;
+
+typedef struct region_profile {
+	const void* site;
+	double total_ns;
+	unsigned regions;
+	region_point points[PROFILE_POINTS];
+	int fitted;
+	double serial_ns;
+	double parallel_ns;
+} region_profile;
+
+/* Shared-memory data & application handle */
+typedef struct omp_numa_shmem {
+	/* Segment layout, see above */
+	omp_numa_header hdr;
+
+	/* Bootstrapping - the first process to open the segment (shepherd or
+	 * application) creates & initializes it while holding the init lock, which
+	 * is robust so that a process dying mid-initialization hands it over to the
+	 * next one.  Attaching & detaching also take the init lock, & the last
+	 * process to detach unlinks the segment:
+	 *   1. Init lock & segment state (SEGMENT_*, SEGMENT_CREATING until the
+	 *      init lock is usable, SEGMENT_DEAD once unlinked)
+	 *   2. Number of attached processes
+	 *   3. Shepherd's PID (0 if no shepherd is running)
+	 */
+	pthread_mutex_t init_lock;
+	unsigned state;
+	unsigned users;
+	pid_t shepherd;
+
+	/* POSIX locking for concurrency updates, or the version counter for the
+	 * lock-free mode (odd while a writer is committing an update)
+	 */
+#if defined(_USE_SPINLOCK)
+	pthread_spinlock_t lock;
+#elif defined(_USE_SEMAPHORE)
+	sem_t lock;
+#else
+	unsigned seq;
+#endif
+
+	/* Runtime environment information:
+	 *   1. Number of OpenMP applications
+	 *   2. Number of tasks for all OpenMP applications
+	 *   3. Current NUMA node, for filling in a round-robin fasion
+	 */
+	unsigned num_omp_applications;
+	unsigned num_omp_tasks;
+	numa_node_t cur_rr_node; // TODO needed?
+
+	/* Latency-critical applications' share of the above & of the total weight
+	 * (see omp_numa_set_qos())
+	 */
+	unsigned critical_applications;
+	unsigned critical_tasks;
+	unsigned critical_weight;
+
+	/* Bumped every time an OpenMP application arrives or leaves (or the central
+	 * scheduler publishes new allotments), invalidating all outstanding leases.
+	 * Applications waiting to be admitted sleep on it (see bump_epoch()).
+	 */
+	unsigned epoch;
+	unsigned admit_waiters;
+
+	/* Number & sum of weights of admitted applications which haven't started
+	 * yet, so that several waiting applications aren't all admitted on the
+	 * strength of the same share
+	 */
+	unsigned admit_pledged;
+	unsigned admit_pledged_weight;
+
+	/* Mapping policy pushed by the shepherd (index into the policy registry)
+	 * & sum of all OpenMP applications' weights
+	 */
+	unsigned policy;
+	unsigned total_weight;
+
+	/* Per-application information */
+	omp_numa_app apps[MAX_NUM_APPS];
+
+	/* Central scheduling - posted by applications when they arrive or leave to
+	 * wake up the shepherd, & the generation of the latest global solution
+	 */
+	sem_t sched_sem;
+	unsigned sched_gen;
+
+	/* System load, sampled by the shepherd */
+	omp_numa_load load;
+
+	/* Topology-sized arrays follow (see omp_numa_header & the accessors
+	 * below): per-node & per-CPU task information, NUMA distances between
+	 * nodes (from the SLIT, loaded by the shepherd) & per-application
+	 * reservations
+	 */
+} omp_numa_shmem;
+
+/* Accessors for the topology-sized arrays */
+static inline omp_numa_node* shmem_node(omp_numa_shmem* shmem,
+																				numa_node_t node)
+{
+	return (omp_numa_node*)((char*)shmem + shmem->hdr.nodes_offset) + node;
+}
+
+static inline unsigned char* shmem_distance(omp_numa_shmem* shmem,
+																						numa_node_t from,
+																						numa_node_t to)
+{
+	return (unsigned char*)shmem + shmem->hdr.distance_offset +
+				 from * shmem->hdr.num_nodes + to;
+}
+
+static inline omp_numa_cpu* shmem_cpu(omp_numa_shmem* shmem, unsigned cpu)
+{
+	return (omp_numa_cpu*)((char*)shmem + shmem->hdr.cpus_offset) + cpu;
+}
+
+static inline omp_numa_app_node* app_node(omp_numa_shmem* shmem,
+																					const omp_numa_app* app,
+																					numa_node_t node)
+{
+	return (omp_numa_app_node*)((char*)shmem + shmem->hdr.app_nodes_offset +
+															(app - shmem->apps) *
+																shmem->hdr.app_nodes_stride) + node;
+}
+
+static inline unsigned short* app_cpu_tasks(omp_numa_shmem* shmem,
+																						const omp_numa_app* app)
+{
+	return (unsigned short*)((char*)shmem + shmem->hdr.app_cpus_offset +
+													 (app - shmem->apps) * shmem->hdr.app_cpus_stride);
+}
+
+static inline omp_numa_trace_ring* app_trace_ring(omp_numa_shmem* shmem,
+																									const omp_numa_app* app)
+{
+	return (omp_numa_trace_ring*)((char*)shmem + shmem->hdr.trace_offset +
+																(app - shmem->apps) * shmem->hdr.trace_stride);
+}
+
+static inline omp_numa_trace_rec* trace_record(omp_numa_shmem* shmem,
+																							 omp_numa_trace_ring* ring,
+																							 unsigned idx)
+{
+	return (omp_numa_trace_rec*)((char*)(ring + 1) +
+															 (idx % TRACE_RECORDS) *
+																 shmem->hdr.trace_record_size);
+}
+
+struct omp_numa_t {
+	int shmem_fd;
+	struct stat shmem_fd_stats;
+
+	/* Size of our mapping of the segment - room for the largest topology, so
+	 * that the segment can grow (for simulated topologies) without remapping
+	 */
+	size_t shmem_map_size;
+
+	/* Serializes the process's threads mapping, cleaning up & profiling
+	 * parallel regions through the handle (e.g. several OpenMP root threads),
+	 * as the runtime negotiates outside of its own fork/join lock
+	 */
+	pthread_mutex_t lock;
+
+	/* Previous execution setup - used to attempt to place nodes near memory 
+	 * from previous executions
+	 */
+	exec_spec_t prev_setup;
+
+	/* Whether tasks are pinned to their reserved CPUs (OMP_NUMA_CPU_BINDING) */
+	int bind_cpus;
+
+	/* Memory residency, sampled by the helper thread for NUMA-aware mapping
+	 * (OMP_NUMA_RESIDENCY):
+	 *   1. Sampling interval in nanoseconds, 0 if disabled
+	 *   2. Generation of the latest sample published by the helper thread &
+	 *      of the sample mapping uses
+	 *   3. Latest sample's resident memory per node, in kilobytes (protected
+	 *      by migrate_lock)
+	 *   4. Whether the sample mapping uses has any resident memory
+	 *   5. Whether each node holds a significant share of our memory
+	 *   6. Expected distance from each node to our memory
+	 */
+	unsigned long long residency_ns;
+	unsigned residency_gen;
+	unsigned residency_used_gen;
+	unsigned long long resident_kb[MAX_NUM_NODES];
+	int resident;
+	int data_node[MAX_NUM_NODES];
+	unsigned mem_distance[MAX_NUM_NODES];
+
+	/* Background page migration (OMP_NUMA_MIGRATE):
+	 *   1. Rate limit in bytes per second, 0 if disabled
+	 *   2. Helper thread migrating pages & sampling memory residency, &
+	 *      whether it was started
+	 *   3. Lock & condition variable protecting the request & the residency
+	 *      sample
+	 *   4. Generation of the latest request - bumped to cancel a migration in
+	 *      progress, & of the last request the helper thread picked up
+	 *   5. Nodes the latest request migrates to (weighted by their tasks)
+	 *   6. Whether the helper thread should exit
+	 *   7. Total number of pages migrated
+	 *   8. Thread whose private mappings drive migration (the first thread to
+	 *      map, normally the initial thread) & whether there is one yet
+	 */
+	unsigned long long migrate_rate;
+	pthread_t migrate_thread;
+	int migrate_started;
+	pthread_mutex_t migrate_lock;
+	pthread_cond_t migrate_cond;
+	unsigned migrate_gen;
+	unsigned migrate_done_gen;
+	unsigned migrate_target[MAX_NUM_NODES];
+	int migrate_stop;
+	unsigned long long migrated_pages;
+	pthread_t migrate_owner;
+	int migrate_owned;
+
+	/* Leased execution setup, kept across parallel regions until the lease
+	 * expires or the epoch changes (see OMP_NUMA_LEASE):
+	 *   1. Lease duration in nanoseconds, 0 if leases are disabled
+	 *   2. Whether we currently hold a lease (i.e. are counted in shmem)
+	 *   3. Number of teams currently executing with the leased setup
+	 *   4. Epoch in which the lease was granted
+	 *   5. Time at which the lease expires
+	 */
+	unsigned long long lease_ns;
+	int lease_held;
+	unsigned lease_users;
+	unsigned lease_epoch;
+	unsigned long long lease_expiry;
+	exec_spec_t lease;
+
+	/* Mapping policies:
+	 *   1. Policy requested through OMP_NUMA_POLICY (overrides the shepherd)
+	 *   2. Policy initialized for (and last used by) this process
+	 *   3. Weight for weighted mapping policies (OMP_NUMA_WEIGHT) &
+	 *      quality-of-service class (OMP_NUMA_CLASS)
+	 */
+	const struct omp_numa_policy_t* env_policy;
+	const struct omp_numa_policy_t* policy;
+	unsigned weight;
+	unsigned qos_class;
+
+	/* Tracing (OMP_NUMA_TRACE) - whether the application records its mapping
+	 * decisions & the lock making the process's threads a single producer for
+	 * its trace ring, & for the shepherd the number of records each slot had
+	 * dropped when it was last drained
+	 */
+	int trace;
+	pthread_mutex_t trace_lock;
+	unsigned trace_drops[MAX_NUM_APPS];
+
+	/* System load sampling (shepherd only) - busy & total CPU time of each node
+	 * in the previous sample, in clock ticks
+	 */
+	unsigned long long load_busy[MAX_NUM_NODES];
+	unsigned long long load_total[MAX_NUM_NODES];
+
+	/* Damping of the number of tasks decided by the policy (see
+	 * OMP_NUMA_DAMP_THRESHOLD):
+	 *   1. Whether damping is enabled
+	 *   2. Smallest change in the number of tasks acted upon
+	 *   3. How long a shrink must be asked for before it's acted upon, & since
+	 *      when it has been (0 if not)
+	 *   4. Minimum time between a resize & a grow, & when we last resized
+	 */
+	int damping;
+	unsigned damp_threshold;
+	unsigned long long shrink_delay_ns;
+	unsigned long long shrink_since;
+	unsigned long long grow_interval_ns;
+	unsigned long long last_resize;
+
+	/* Bounds on the number of tasks (0 if unbounded) - requested for all of the
+	 * process's mappings (OMP_NUMA_RANGE), & in effect for the mapping being
+	 * decided, i.e. narrowed by its region's (see omp_numa_map_range())
+	 */
+	unsigned range_min;
+	unsigned range_pref;
+	unsigned range_max;
+	unsigned bound_min;
+	unsigned bound_pref;
+	unsigned bound_max;
+
+	/* Admission control (OMP_NUMA_ADMIT_MIN) - minimum share of processors
+	 * the policy must give us before the first parallel region starts (0 to
+	 * start right away), how long to wait for it & whether we've started
+	 */
+	unsigned admit_min;
+	unsigned long long admit_timeout_ns;
+	int admitted;
+
+	/* This application's slot in shared memory (NULL if none was free) &
+	 * parallel-region profiles
+	 */
+	omp_numa_app* app;
+	unsigned regions;
+	region_profile profiles[PROFILE_SITES];
+
+	/* Actual shared memory between processes */
+	omp_numa_shmem* shmem;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Mapping policies
+///////////////////////////////////////////////////////////////////////////////
+
+/* A mapping policy decides how many tasks an application gets & on which
+ * nodes they execute.
+ */
+typedef struct omp_numa_policy_t {
+	/* Name used to select the policy */
+	const char* name;
+
+	/* Called once per process before the policy makes its first decision
+	 * (optional)
+	 */
+	void (*init)(omp_numa_t* handle);
+
+	/* Fill in the number of tasks & per-node task assignment for the calling
+	 * application.  Called with exclusive access to the shared counters (or
+	 * against a snapshot in lock-free mode), which do not yet include the
+	 * calling application.
+	 */
+	void (*decide)(omp_numa_t* handle, exec_spec_t* spec, omp_numa_flags flags);
+
+	/* Called when an execution specification decided by the policy is cleaned
+	 * up (optional)
+	 */
+	void (*release)(omp_numa_t* handle, exec_spec_t* spec);
+} omp_numa_policy_t;
+
+/**
+ * Look up a policy by name
+ *
+ * @return the policy's index in the registry, or -1 if there is no such policy
+ */
+int __omp_numa_find_policy(const char* name);
+
+/**
+ * Return the policy at an index in the registry, or the default policy if the
+ * index is out of bounds
+ */
+const omp_numa_policy_t* __omp_numa_get_policy(unsigned idx);
+
+/**
+ * Return the policy the calling application should currently use, i.e. the
+ * one requested through the environment or the one pushed by the shepherd.
+ * Initializes the policy for this process if necessary.
+ */
+const omp_numa_policy_t* __omp_numa_active_policy(omp_numa_t* handle);
+
+/**
+ * Check whether the calling application's active policy is the central one,
+ * i.e. whether the central scheduler decides its number of tasks
+ */
+int __omp_numa_central_active(omp_numa_t* handle);
+
+/**
+ * Speedup of an application with a serial fraction (in 1/1000ths) when
+ * executing with a number of threads, according to Amdahl's law
+ */
+double __omp_numa_speedup(unsigned serial_milli, unsigned num_tasks);
+
+/**
+ * Copy the allotment the central scheduler published for the calling
+ * application into an execution specification
+ *
+ * @return 1 if there was an allotment, 0 otherwise
+ */
+int __omp_numa_adopt_allotment(omp_numa_t* handle, exec_spec_t* spec);
+
+/**
+ * Clamp a policy's number of tasks to the bounds of the mapping being decided
+ * (see omp_numa_map_range())
+ */
+unsigned __omp_numa_bound_tasks(omp_numa_t* handle, unsigned num_tasks);
+
+/**
+ * Wake up the central scheduler
+ */
+void __omp_numa_post_request(omp_numa_t* handle);
+
+/**
+ * Sample where the application's memory resides & publish it for mapping.
+ * Called by the helper thread.
+ */
+void __omp_numa_sample_residency(omp_numa_t* handle);
+
+/**
+ * Pick up the latest residency sample published by the helper thread, if it
+ * changed.  Must hold the handle's lock.
+ */
+void __omp_numa_adopt_residency(omp_numa_t* handle);
+
+/**
+ * Return whether the application's data lives on a node, i.e. whether the
+ * node holds a significant share of its resident memory or, without residency
+ * samples, whether the application previously executed there
+ */
+static inline int __omp_numa_data_node(omp_numa_t* handle, numa_node_t node)
+{
+	if(handle->resident)
+		return handle->data_node[node];
+	return handle->prev_setup.task_assignment[node] != 0;
+}
+
+/**
+ * Start the helper thread migrating pages (OMP_NUMA_MIGRATE) & sampling memory
+ * residency (OMP_NUMA_RESIDENCY)
+ */
+void __omp_numa_start_helper(omp_numa_t* handle);
+
+/**
+ * Ask the helper thread to migrate the application's pages to the nodes of an
+ * execution specification if they differ from the previous one's, cancelling
+ * any migration in progress.  Only the process-level mapping drives migration,
+ * i.e. the lease if leases are enabled & otherwise the mappings of the first
+ * thread to map - other root threads' mappings are ignored rather than
+ * cancelling & restarting each other's migrations.  Must hold the handle's
+ * lock.
+ */
+void __omp_numa_request_migration(omp_numa_t* handle, const exec_spec_t* spec);
+
+/**
+ * Cancel any migration in progress & stop the helper thread
+ */
+void __omp_numa_stop_helper(omp_numa_t* handle);
+
+/**
+ * Cheap (vDSO, no syscall) monotonic time in nanoseconds, used for leases &
+ * residency sampling
+ */
+unsigned long long __omp_numa_coarse_time_ns();
+
+///////////////////////////////////////////////////////////////////////////////
+// Locking
+///////////////////////////////////////////////////////////////////////////////
+
+#ifdef _USE_SEQLOCK
+/* Wait out any in-flight commit & return the version of the snapshot */
+static inline unsigned seq_read_begin(omp_numa_shmem* shmem)
+{
+	unsigned seq;
+	while((seq = __atomic_load_n(&shmem->seq, __ATOMIC_ACQUIRE)) & 0x1)
+		CPU_RELAX();
+	return seq;
+}
+
+/* Returns non-zero if a commit happened since the snapshot was taken */
+static inline int seq_read_retry(omp_numa_shmem* shmem, unsigned seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&shmem->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/* Claim the counters for writing, but only if nobody else has committed since
+ * the snapshot at version seq was taken.  Returns non-zero on success.
+ */
+static inline int seq_try_commit(omp_numa_shmem* shmem, unsigned seq)
+{
+	if(!__atomic_compare_exchange_n(&shmem->seq, &seq, seq + 1, 0,
+																	__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return 0;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Publish the committed update & make the version even again */
+static inline void seq_end_commit(omp_numa_shmem* shmem)
+{
+	__atomic_add_fetch(&shmem->seq, 1, __ATOMIC_RELEASE);
+}
+#endif
+
+/* Gain exclusive access to the shared counters */
+static inline void shmem_lock(omp_numa_shmem* shmem)
+{
+#if defined(_USE_SPINLOCK)
+	pthread_spin_lock(&shmem->lock);
+#elif defined(_USE_SEMAPHORE)
+	sem_wait(&shmem->lock);
+#else
+	while(!seq_try_commit(shmem, seq_read_begin(shmem)))
+		CPU_RELAX();
+#endif
+}
+
+static inline void shmem_unlock(omp_numa_shmem* shmem)
+{
+#if defined(_USE_SPINLOCK)
+	pthread_spin_unlock(&shmem->lock);
+#elif defined(_USE_SEMAPHORE)
+	sem_post(&shmem->lock);
+#else
+	seq_end_commit(shmem);
+#endif
+}
+
+/* Bump the epoch & wake up any applications waiting to be admitted.  Both
+ * sides are sequentially consistent, so either the waker sees the waiter or
+ * the waiter sees the new epoch.  Returns the new epoch.
+ */
+static inline unsigned bump_epoch(omp_numa_shmem* shmem)
+{
+	unsigned epoch = __atomic_add_fetch(&shmem->epoch, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&shmem->admit_waiters, __ATOMIC_SEQ_CST))
+		syscall(SYS_futex, &shmem->epoch, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	return epoch;
+}
+
+#endif /* _SCHED_COMM_INTERNAL_H */
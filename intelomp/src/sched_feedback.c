@@ -0,0 +1,190 @@
+/*
+ * Feedback from measured parallel-region efficiency - times each parallel
+ * region per call site at the thread count it executed with, fits an online
+ * speedup curve & publishes the application's estimated serial fraction to
+ * shared memory.  The feedback mapping policy works out the marginal utility
+ * of one more thread at any thread count from the published serial fractions
+ * & hands processors to the applications that gain the most from them.
+ *
+ * Curves are fitted to Amdahl's law, T(n) = serial + parallel / n, by least
+ * squares over the average region durations at each thread count.  A call
+ * site needs timings at two or more thread counts before it has a curve;
+ * until then the application is assumed to scale perfectly.
+ */
+
+#include "sched_comm_internal.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Prototypes for internal functions
+///////////////////////////////////////////////////////////////////////////////
+
+static region_profile* find_profile(omp_numa_t* handle, const void* site);
+static void fit_profile(region_profile* profile);
+static void publish_estimates(omp_numa_t* handle);
+
+///////////////////////////////////////////////////////////////////////////////
+// Parallel-region profiling
+///////////////////////////////////////////////////////////////////////////////
+
+unsigned long long omp_numa_time_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void omp_numa_region_done(omp_numa_t* handle,
+													const void* site,
+													unsigned num_tasks,
+													unsigned long long duration_ns)
+{
+	region_profile* profile;
+	region_point* point = NULL;
+	unsigned i;
+
+	if(!num_tasks)
+		return;
+
+	pthread_mutex_lock(&handle->lock);
+	if(!(profile = find_profile(handle, site)))
+	{
+		pthread_mutex_unlock(&handle->lock);
+		return;
+	}
+
+	// Find the thread count's point, or replace the least-sampled one
+	for(i = 0; i < PROFILE_POINTS; i++)
+	{
+		if(profile->points[i].num_tasks == num_tasks)
+		{
+			point = &profile->points[i];
+			break;
+		}
+		if(!point || profile->points[i].samples < point->samples)
+			point = &profile->points[i];
+	}
+
+	if(point->num_tasks != num_tasks)
+	{
+		point->num_tasks = num_tasks;
+		point->samples = 0;
+		point->avg_ns = 0.0;
+	}
+
+	// Running average which favors recent regions once warmed up
+	point->samples++;
+	point->avg_ns += ((double)duration_ns - point->avg_ns) /
+									 (double)MIN(point->samples, 8);
+	profile->total_ns += (double)duration_ns;
+
+	if(++profile->regions >= PROFILE_PUBLISH_INTERVAL)
+	{
+		profile->regions = 0;
+		fit_profile(profile);
+	}
+
+	if(++handle->regions >= PROFILE_PUBLISH_INTERVAL)
+	{
+		handle->regions = 0;
+		publish_estimates(handle);
+	}
+	pthread_mutex_unlock(&handle->lock);
+}
+
+double __omp_numa_speedup(unsigned serial_milli, unsigned num_tasks)
+{
+	double serial = (double)serial_milli / 1000.0;
+	if(!num_tasks)
+		return 0.0;
+	return 1.0 / (serial + (1.0 - serial) / (double)num_tasks);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Miscellaneous helpers
+///////////////////////////////////////////////////////////////////////////////
+
+/* Find (or start) a call site's profile.  Returns NULL if the table is full. */
+region_profile* find_profile(omp_numa_t* handle, const void* site)
+{
+	unsigned i, idx = ((unsigned long)site >> 4) % PROFILE_SITES;
+
+	for(i = 0; i < PROFILE_SITES; i++, idx = (idx + 1) % PROFILE_SITES)
+	{
+		if(handle->profiles[idx].site == site)
+			return &handle->profiles[idx];
+		if(!handle->profiles[idx].site)
+		{
+			memset(&handle->profiles[idx], 0, sizeof(region_profile));
+			handle->profiles[idx].site = site;
+			return &handle->profiles[idx];
+		}
+	}
+
+	return NULL;
+}
+
+/* Least-squares fit of T(n) = serial + parallel / n over a call site's
+ * points, i.e. a linear regression of T against 1/n
+ */
+void fit_profile(region_profile* profile)
+{
+	double sum_x = 0.0, sum_y = 0.0, sum_xx = 0.0, sum_xy = 0.0, x, n = 0.0;
+	unsigned i;
+
+	for(i = 0; i < PROFILE_POINTS; i++)
+	{
+		if(!profile->points[i].samples)
+			continue;
+		x = 1.0 / (double)profile->points[i].num_tasks;
+		sum_x += x;
+		sum_y += profile->points[i].avg_ns;
+		sum_xx += x * x;
+		sum_xy += x * profile->points[i].avg_ns;
+		n += 1.0;
+	}
+
+	if(n < 2.0 || (n * sum_xx - sum_x * sum_x) <= 0.0)
+		return;
+
+	profile->parallel_ns = (n * sum_xy - sum_x * sum_y) /
+												 (n * sum_xx - sum_x * sum_x);
+	profile->serial_ns = (sum_y - profile->parallel_ns * sum_x) / n;
+
+	// Clamp to physically meaningful curves - regions that slow down with more
+	// threads are entirely serial, regions with superlinear speedup are
+	// entirely parallel
+	profile->parallel_ns = MAX(profile->parallel_ns, 0.0);
+	profile->serial_ns = MAX(profile->serial_ns, 0.0);
+	profile->fitted = (profile->parallel_ns + profile->serial_ns) > 0.0;
+}
+
+/* Publish the application's serial fraction, i.e. the time-weighted average
+ * over all call sites with a speedup curve
+ */
+void publish_estimates(omp_numa_t* handle)
+{
+	double weighted = 0.0, total = 0.0, serial;
+	unsigned i;
+
+	if(!handle->app)
+		return;
+
+	for(i = 0; i < PROFILE_SITES; i++)
+	{
+		region_profile* profile = &handle->profiles[i];
+		if(!profile->site || !profile->fitted)
+			continue;
+		weighted += profile->total_ns * profile->serial_ns /
+								(profile->serial_ns + profile->parallel_ns);
+		total += profile->total_ns;
+	}
+
+	if(total <= 0.0)
+		return;
+
+	serial = weighted / total;
+	__atomic_store_n(&handle->app->serial_milli,
+									 (unsigned)(serial * 1000.0 + 0.5), __ATOMIC_RELAXED);
+	__atomic_store_n(&handle->app->profiled, 1, __ATOMIC_RELAXED);
+	OMP_NUMA_DEBUG("published serial fraction %.3f\n", serial);
+}
@@ -0,0 +1,214 @@
+/*
+ * System load sampling - the shepherd periodically samples how busy the
+ * machine is, including processes which aren't OpenMP applications, &
+ * publishes it in shared memory.  Applications read the latest sample rather
+ * than each scanning /proc/<pid>/task/<tid>/stat for running threads (as the
+ * runtime's load_balance dynamic mode does), which is expensive & would
+ * otherwise be repeated by every application.
+ *
+ * The number of runnable tasks comes from /proc/stat & the load averages from
+ * /proc/loadavg, & share a single cache line.  Per-node utilizations are
+ * computed from the per-CPU times in /proc/stat & published in the node
+ * counters.  The shepherd is the only writer, so samples are published under
+ * their own seqlock rather than the lock protecting the counters, & readers
+ * never block the applications mapping tasks.
+ */
+
+#include "sched_comm_internal.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Prototypes for internal functions
+///////////////////////////////////////////////////////////////////////////////
+
+static int read_stat(omp_numa_t* handle, unsigned* busy, unsigned* running);
+static int read_loadavg(unsigned* loadavg, unsigned* threads);
+
+///////////////////////////////////////////////////////////////////////////////
+// Shepherd
+///////////////////////////////////////////////////////////////////////////////
+
+int omp_numa_sample_load(omp_numa_t* handle)
+{
+	omp_numa_shmem* shmem = handle->shmem;
+	omp_numa_load* load = &shmem->load;
+	unsigned busy[MAX_NUM_NODES], loadavg[3], running, threads, i;
+	numa_node_t node, num_nodes = MIN(__num_nodes,
+																		(numa_node_t)shmem->hdr.num_nodes);
+
+	if(read_stat(handle, busy, &running) || read_loadavg(loadavg, &threads))
+		return -1;
+
+	// We're the only writer, readers retry if they overlap with publishing
+	__atomic_add_fetch(&load->seq, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	load->sampled_ns = omp_numa_time_ns();
+	load->running = running;
+	load->threads = threads;
+	for(i = 0; i < 3; i++)
+		load->loadavg_scaled[i] = loadavg[i];
+	for(node = 0; node < num_nodes; node++)
+		shmem_node(shmem, node)->busy_scaled = busy[node];
+	__atomic_add_fetch(&load->seq, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Applications
+///////////////////////////////////////////////////////////////////////////////
+
+int omp_numa_system_load(omp_numa_t* handle,
+												 unsigned max_age_ms,
+												 omp_numa_load_t* load)
+{
+	omp_numa_load* sample = &handle->shmem->load;
+	unsigned long long sampled_ns, now;
+	unsigned seq, i;
+
+	do
+	{
+		while((seq = __atomic_load_n(&sample->seq, __ATOMIC_ACQUIRE)) & 1)
+			CPU_RELAX();
+		sampled_ns = sample->sampled_ns;
+		load->running = sample->running;
+		load->threads = sample->threads;
+		for(i = 0; i < 3; i++)
+			load->loadavg[i] = (double)sample->loadavg_scaled[i] / LOAD_SCALE;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while(__atomic_load_n(&sample->seq, __ATOMIC_RELAXED) != seq);
+
+	if(!sampled_ns)
+		return 0;
+
+	// The coarse clock may lag slightly behind the shepherd's
+	now = __omp_numa_coarse_time_ns();
+	load->age_ns = now > sampled_ns ? now - sampled_ns : 0;
+	return load->age_ns <= max_age_ms * 1000000ULL;
+}
+
+double omp_numa_node_load(omp_numa_t* handle, numa_node_t node)
+{
+	omp_numa_shmem* shmem = handle->shmem;
+	unsigned seq, busy;
+
+	assert(node < MAX_NUM_NODES);
+	if(node >= __num_nodes || node >= (numa_node_t)shmem->hdr.num_nodes)
+		return 0.0;
+
+	do
+	{
+		while((seq = __atomic_load_n(&shmem->load.seq, __ATOMIC_ACQUIRE)) & 1)
+			CPU_RELAX();
+		busy = shmem_node(shmem, node)->busy_scaled;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while(__atomic_load_n(&shmem->load.seq, __ATOMIC_RELAXED) != seq);
+
+	return (double)busy / LOAD_SCALE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Miscellaneous helpers
+///////////////////////////////////////////////////////////////////////////////
+
+/* Read the number of runnable tasks (excluding ourselves) & each node's busy
+ * CPUs since the previous sample (in 1/LOAD_SCALE CPUs, for the nodes in
+ * shared memory) from /proc/stat.  Returns 0 if successful.
+ */
+int read_stat(omp_numa_t* handle, unsigned* busy, unsigned* running)
+{
+	unsigned long long node_busy[MAX_NUM_NODES] = { 0 };
+	unsigned long long node_total[MAX_NUM_NODES] = { 0 };
+	unsigned long long times[8], total, delta_busy, delta_total;
+	unsigned node_cpus[MAX_NUM_NODES] = { 0 };
+	short cpu_node[MAX_NUM_CPUS];
+	unsigned cpu, i;
+	numa_node_t node, num_nodes = MIN(__num_nodes,
+																		(numa_node_t)handle->shmem->hdr.num_nodes);
+	char* line = NULL;
+	size_t line_size = 0;
+	int found = 0;
+	FILE* fp;
+
+	// Only the CPUs available to us count towards their node's load
+	memset(cpu_node, 0xff, sizeof(cpu_node));
+	for(node = 0; node < __num_nodes; node++)
+		for(i = __node_cpu_offset[node]; i < __node_cpu_offset[node + 1]; i++)
+			cpu_node[__node_cpus[i]] = node;
+
+	if(!(fp = fopen("/proc/stat", "r")))
+		return -1;
+	while(getline(&line, &line_size, fp) > 0)
+	{
+		// Per-CPU lines are "cpu<N> user nice system idle iowait irq softirq
+		// steal ...", older kernels have fewer fields
+		if(!strncmp(line, "cpu", 3) && line[3] >= '0' && line[3] <= '9')
+		{
+			memset(times, 0, sizeof(times));
+			if(sscanf(line + 3, "%u %llu %llu %llu %llu %llu %llu %llu %llu", &cpu,
+								&times[0], &times[1], &times[2], &times[3], &times[4],
+								&times[5], &times[6], &times[7]) < 5 ||
+				 cpu >= MAX_NUM_CPUS || cpu_node[cpu] < 0)
+				continue;
+
+			for(i = 0, total = 0; i < 8; i++)
+				total += times[i];
+			node = cpu_node[cpu];
+			node_busy[node] += total - times[3] - times[4];
+			node_total[node] += total;
+			node_cpus[node]++;
+		}
+		else if(sscanf(line, "procs_running %u", running) == 1)
+			found = 1;
+	}
+	free(line);
+	fclose(fp);
+	if(!found)
+		return -1;
+
+	// We were running while reading the file
+	if(*running)
+		(*running)--;
+
+	// Times are summed over the node's CPUs, so the busy share of the elapsed
+	// time scales to the number of CPUs.  Keep the previous utilization if no
+	// time elapsed.
+	for(node = 0; node < num_nodes; node++)
+	{
+		delta_busy = node_busy[node] - handle->load_busy[node];
+		delta_total = node_total[node] - handle->load_total[node];
+		if(!delta_total)
+		{
+			busy[node] = shmem_node(handle->shmem, node)->busy_scaled;
+			continue;
+		}
+
+		busy[node] = (unsigned)(delta_busy * LOAD_SCALE * node_cpus[node] /
+														delta_total);
+		handle->load_busy[node] = node_busy[node];
+		handle->load_total[node] = node_total[node];
+	}
+	return 0;
+}
+
+/* Read the load averages (in 1/LOAD_SCALE) & the number of tasks in the
+ * system from /proc/loadavg.  Returns 0 if successful.
+ */
+int read_loadavg(unsigned* loadavg, unsigned* threads)
+{
+	double avg[3];
+	unsigned running, i;
+	int read;
+	FILE* fp;
+
+	// "<1 min> <5 min> <15 min> <runnable>/<tasks> <last PID>"
+	if(!(fp = fopen("/proc/loadavg", "r")))
+		return -1;
+	read = fscanf(fp, "%lf %lf %lf %u/%u", &avg[0], &avg[1], &avg[2], &running,
+								threads);
+	fclose(fp);
+	if(read != 5)
+		return -1;
+
+	for(i = 0; i < 3; i++)
+		loadavg[i] = (unsigned)(avg[i] * LOAD_SCALE + 0.5);
+	return 0;
+}
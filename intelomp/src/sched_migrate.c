@@ -0,0 +1,429 @@
+/*
+ * Background page migration - when an application is remapped onto a
+ * different set of nodes its threads follow immediately, but its memory stays
+ * behind.  A helper thread moves the application's pages to its new nodes
+ * with batched move_pages() calls, spreading them over the new nodes in
+ * proportion to their tasks.
+ *
+ * The hottest memory ranges go first, where a range's heat is the fraction of
+ * its pages on the kernel's active LRU lists (as reported by
+ * /proc/self/numa_maps).  Migration is rate-limited to OMP_NUMA_MIGRATE MB/s
+ * so as not to starve the application of memory bandwidth, and is abandoned
+ * as soon as the application is remapped again.
+ *
+ * A process has a single migration target.  With several root threads mapped
+ * to different nodes, only the process-level mapping moves memory: the lease
+ * when leases are enabled (root threads' private mappings only cover a busy
+ * lease), otherwise the mappings of the first thread to map, normally the
+ * initial thread.
+ *
+ * The same helper thread samples memory residency (see sched_residency.c)
+ * every OMP_NUMA_RESIDENCY milliseconds & right after moving pages, so that
+ * mapping never reads /proc/self/numa_maps itself.
+ */
+
+#include "sched_comm_internal.h"
+#include <numaif.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal definitions
+///////////////////////////////////////////////////////////////////////////////
+
+/* An anonymous memory range with pages to be migrated:
+ *   1. Address range
+ *   2. Page size of the range
+ *   3. Number of resident pages & number of pages on the active LRU lists
+ *   4. Number of resident pages not already on one of the target nodes
+ */
+typedef struct migrate_range {
+	unsigned long start;
+	unsigned long end;
+	unsigned long page_size;
+	unsigned long pages;
+	unsigned long active;
+	unsigned long remote;
+} migrate_range;
+
+///////////////////////////////////////////////////////////////////////////////
+// Prototypes for internal functions
+///////////////////////////////////////////////////////////////////////////////
+
+static void* helper_thread(void* arg);
+static unsigned long long migrate(omp_numa_t* handle,
+																	unsigned gen,
+																	const unsigned* target);
+static migrate_range* find_ranges(const unsigned* target, size_t* num_ranges);
+static int hotter(const void* a, const void* b);
+static int cancelled(omp_numa_t* handle, unsigned gen);
+
+///////////////////////////////////////////////////////////////////////////////
+// Migration requests
+///////////////////////////////////////////////////////////////////////////////
+
+void __omp_numa_start_helper(omp_numa_t* handle)
+{
+	pthread_condattr_t attr;
+
+	handle->migrate_gen = 0;
+	handle->migrate_done_gen = 0;
+	handle->migrate_stop = 0;
+	handle->migrated_pages = 0;
+	handle->migrate_owned = 0;
+	memset(handle->migrate_target, 0, sizeof(handle->migrate_target));
+	pthread_mutex_init(&handle->migrate_lock, NULL);
+
+	// Residency samples are due on the monotonic clock
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&handle->migrate_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if(pthread_create(&handle->migrate_thread, NULL, helper_thread, handle))
+	{
+		WARN("could not start page migration & residency sampling thread\n");
+		pthread_cond_destroy(&handle->migrate_cond);
+		pthread_mutex_destroy(&handle->migrate_lock);
+		return;
+	}
+
+	if(handle->migrate_rate)
+		OMP_NUMA_DEBUG("migrating pages at up to %llu bytes/s\n",
+			handle->migrate_rate);
+	handle->migrate_started = 1;
+}
+
+void __omp_numa_request_migration(omp_numa_t* handle, const exec_spec_t* spec)
+{
+	numa_node_t node;
+	int changed = 0, first = 1;
+
+	if(!handle->migrate_rate)
+		return;
+
+	// Only the process-level mapping moves memory
+	if(!handle->migrate_owned)
+	{
+		handle->migrate_owner = pthread_self();
+		handle->migrate_owned = 1;
+	}
+	if(spec != &handle->lease &&
+		 (handle->lease_ns || !pthread_equal(handle->migrate_owner, pthread_self())))
+		return;
+
+	// Only migrate if the set of nodes changed - the first mapping only records
+	// where the application executes
+	for(node = 0; node < __num_nodes; node++)
+	{
+		if(handle->migrate_target[node])
+			first = 0;
+		if(!handle->migrate_target[node] != !spec->task_assignment[node])
+			changed = 1;
+	}
+	if(!changed)
+		return;
+
+	pthread_mutex_lock(&handle->migrate_lock);
+	for(node = 0; node < __num_nodes; node++)
+		handle->migrate_target[node] = spec->task_assignment[node];
+	if(!first)
+	{
+		__atomic_add_fetch(&handle->migrate_gen, 1, __ATOMIC_RELEASE);
+		pthread_cond_signal(&handle->migrate_cond);
+	}
+	pthread_mutex_unlock(&handle->migrate_lock);
+}
+
+void __omp_numa_stop_helper(omp_numa_t* handle)
+{
+	if(!handle->migrate_started)
+		return;
+
+	pthread_mutex_lock(&handle->migrate_lock);
+	handle->migrate_stop = 1;
+	__atomic_add_fetch(&handle->migrate_gen, 1, __ATOMIC_RELEASE);
+	pthread_cond_signal(&handle->migrate_cond);
+	pthread_mutex_unlock(&handle->migrate_lock);
+
+	pthread_join(handle->migrate_thread, NULL);
+	pthread_cond_destroy(&handle->migrate_cond);
+	pthread_mutex_destroy(&handle->migrate_lock);
+	handle->migrate_started = 0;
+	OMP_NUMA_DEBUG("migrated %llu pages in total\n", handle->migrated_pages);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Helper thread
+///////////////////////////////////////////////////////////////////////////////
+
+/* Wait for requests & migrate pages for the latest one, sampling memory
+ * residency whenever a sample is due in between
+ */
+void* helper_thread(void* arg)
+{
+	omp_numa_t* handle = (omp_numa_t*)arg;
+	unsigned target[MAX_NUM_NODES], gen;
+	unsigned long long next_sample = 0;
+	struct timespec ts;
+
+	pthread_mutex_lock(&handle->migrate_lock);
+	while(1)
+	{
+		while(!handle->migrate_stop &&
+					handle->migrate_gen == handle->migrate_done_gen &&
+					(!handle->residency_ns || omp_numa_time_ns() < next_sample))
+		{
+			if(!handle->residency_ns)
+			{
+				pthread_cond_wait(&handle->migrate_cond, &handle->migrate_lock);
+				continue;
+			}
+			ts.tv_sec = next_sample / 1000000000ULL;
+			ts.tv_nsec = next_sample % 1000000000ULL;
+			pthread_cond_timedwait(&handle->migrate_cond, &handle->migrate_lock, &ts);
+		}
+		if(handle->migrate_stop)
+			break;
+
+		if(handle->migrate_gen != handle->migrate_done_gen)
+		{
+			gen = handle->migrate_done_gen = handle->migrate_gen;
+			memcpy(target, handle->migrate_target, sizeof(target));
+			pthread_mutex_unlock(&handle->migrate_lock);
+
+			// Moved pages make the residency sample stale
+			if(migrate(handle, gen, target))
+				next_sample = 0;
+		}
+		else
+		{
+			pthread_mutex_unlock(&handle->migrate_lock);
+			__omp_numa_sample_residency(handle);
+			next_sample = omp_numa_time_ns() + handle->residency_ns;
+		}
+
+		pthread_mutex_lock(&handle->migrate_lock);
+	}
+	pthread_mutex_unlock(&handle->migrate_lock);
+
+	return NULL;
+}
+
+/* Migrate the application's remote pages onto the target nodes, hottest
+ * ranges first.  Pages are queried in batches & only those not already on a
+ * target node are moved.  Returns the number of bytes moved.
+ */
+unsigned long long migrate(omp_numa_t* handle,
+													 unsigned gen,
+													 const unsigned* target)
+{
+	void* pages[MIGRATE_BATCH];
+	void* remote[MIGRATE_BATCH];
+	int nodes[MIGRATE_BATCH], status[MIGRATE_BATCH];
+	int order[MAX_NUM_CPUS];
+	unsigned long long start_ns = omp_numa_time_ns(), moved_bytes = 0, due_ns;
+	unsigned num_order = 0, next = 0, i, j, num_remote;
+	size_t num_ranges, r;
+	unsigned long addr, found;
+	numa_node_t node;
+	struct timespec ts;
+
+	// Spread pages over the target nodes in proportion to their tasks
+	for(node = 0; node < __num_nodes; node++)
+		for(i = 0; i < target[node] && num_order < MAX_NUM_CPUS; i++)
+			order[num_order++] = node;
+	if(!num_order)
+		return 0;
+
+	migrate_range* ranges = find_ranges(target, &num_ranges);
+	if(!ranges)
+		return 0;
+	qsort(ranges, num_ranges, sizeof(migrate_range), hotter);
+	OMP_NUMA_DEBUG("migrating pages from %lu ranges\n", (unsigned long)num_ranges);
+
+	for(r = 0; r < num_ranges && !cancelled(handle, gen); r++)
+	{
+		// Stop scanning a range once we've found all of its remote pages, ranges
+		// may be sparsely populated
+		for(addr = ranges[r].start, found = 0;
+				addr < ranges[r].end && found < ranges[r].remote; )
+		{
+			if(cancelled(handle, gen))
+				break;
+
+			// Find out where the next batch of pages resides
+			for(i = 0; i < MIGRATE_BATCH && addr < ranges[r].end; i++)
+			{
+				pages[i] = (void*)addr;
+				addr += ranges[r].page_size;
+			}
+			if(numa_move_pages(0, i, pages, NULL, status, 0))
+				continue;
+
+			for(j = 0, num_remote = 0; j < i; j++)
+			{
+				if(status[j] < 0 || status[j] >= __num_nodes || target[status[j]])
+					continue;
+				remote[num_remote] = pages[j];
+				nodes[num_remote++] = order[next++ % num_order];
+			}
+			found += num_remote;
+			if(!num_remote)
+				continue;
+
+			// Move them & stay under the rate limit
+			if(numa_move_pages(0, num_remote, remote, nodes, status, MPOL_MF_MOVE) < 0)
+				continue;
+			for(j = 0; j < num_remote; j++)
+			{
+				if(status[j] != nodes[j])
+					continue;
+				handle->migrated_pages++;
+				moved_bytes += ranges[r].page_size;
+			}
+
+			// Split the division so large migrations don't overflow
+			due_ns = start_ns +
+							 moved_bytes / handle->migrate_rate * 1000000000ULL +
+							 moved_bytes % handle->migrate_rate * 1000000000ULL /
+								 handle->migrate_rate;
+			if(due_ns > omp_numa_time_ns())
+			{
+				due_ns -= omp_numa_time_ns();
+				ts.tv_sec = due_ns / 1000000000ULL;
+				ts.tv_nsec = due_ns % 1000000000ULL;
+				nanosleep(&ts, NULL);
+			}
+		}
+	}
+
+	if(cancelled(handle, gen))
+		OMP_NUMA_DEBUG("migration cancelled after %llu bytes\n", moved_bytes);
+	else
+		OMP_NUMA_DEBUG("migration finished, moved %llu bytes\n", moved_bytes);
+	free(ranges);
+	return moved_bytes;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Miscellaneous helpers
+///////////////////////////////////////////////////////////////////////////////
+
+/* Find the application's anonymous memory ranges with pages off the target
+ * nodes, using /proc/self/maps for range boundaries & /proc/self/numa_maps
+ * for per-node & active page counts.  Returns NULL on failure.
+ */
+migrate_range* find_ranges(const unsigned* target, size_t* num_ranges)
+{
+	migrate_range* ranges = NULL, *range, *grown;
+	size_t max_ranges = 0, num_maps = 0, i;
+	unsigned long start, end, page_kb, count;
+	char* line = NULL, *tok, *save;
+	size_t line_size = 0;
+	int node;
+	FILE* fp;
+
+	// Read range boundaries
+	if(!(fp = fopen("/proc/self/maps", "r")))
+		return NULL;
+	while(getline(&line, &line_size, fp) > 0)
+	{
+		if(sscanf(line, "%lx-%lx", &start, &end) != 2)
+			continue;
+		if(num_maps == max_ranges)
+		{
+			max_ranges = max_ranges ? max_ranges * 2 : 256;
+			grown = (migrate_range*)realloc(ranges,
+																			max_ranges * sizeof(migrate_range));
+			if(!grown)
+			{
+				fclose(fp);
+				free(line);
+				free(ranges);
+				return NULL;
+			}
+			ranges = grown;
+		}
+		memset(&ranges[num_maps], 0, sizeof(migrate_range));
+		ranges[num_maps].start = start;
+		ranges[num_maps++].end = end;
+	}
+	fclose(fp);
+
+	// Read page counts & keep the ranges that have pages to move
+	if(!(fp = fopen("/proc/self/numa_maps", "r")))
+	{
+		free(line);
+		free(ranges);
+		return NULL;
+	}
+
+	*num_ranges = 0;
+	i = 0;
+	while(getline(&line, &line_size, fp) > 0)
+	{
+		if(sscanf(line, "%lx", &start) != 1)
+			continue;
+		if(strstr(line, " file=") && !strstr(line, " anon="))
+			continue;
+
+		// Both files list ranges in the same order
+		while(i < num_maps && ranges[i].start < start)
+			i++;
+		if(i >= num_maps || ranges[i].start != start)
+			continue;
+
+		range = &ranges[i];
+		page_kb = 4;
+		if((tok = strstr(line, "kernelpagesize_kB=")))
+			sscanf(tok, "kernelpagesize_kB=%lu", &page_kb);
+		range->page_size = page_kb * 1024;
+
+		range->active = ULONG_MAX;
+		if((tok = strstr(line, " active=")))
+			sscanf(tok, " active=%lu", &range->active);
+
+		for(tok = strtok_r(line, " \n", &save); tok; tok = strtok_r(NULL, " \n", &save))
+		{
+			if(sscanf(tok, "N%d=%lu", &node, &count) != 2)
+				continue;
+			range->pages += count;
+			if(node < 0 || node >= __num_nodes || !target[node])
+				range->remote += count;
+		}
+
+		// No active count means all pages are active
+		range->active = MIN(range->active, range->pages);
+		if(range->remote)
+			ranges[(*num_ranges)++] = *range;
+		i++;
+	}
+
+	free(line);
+	fclose(fp);
+	return ranges;
+}
+
+/* Order ranges by decreasing fraction of active pages, then by decreasing
+ * number of pages to move
+ */
+int hotter(const void* a, const void* b)
+{
+	const migrate_range* ra = (const migrate_range*)a;
+	const migrate_range* rb = (const migrate_range*)b;
+	unsigned long long heat_a = (unsigned long long)ra->active * rb->pages,
+										 heat_b = (unsigned long long)rb->active * ra->pages;
+
+	if(heat_a != heat_b)
+		return heat_a > heat_b ? -1 : 1;
+	if(ra->remote != rb->remote)
+		return ra->remote > rb->remote ? -1 : 1;
+	return 0;
+}
+
+/* Check whether the application was remapped (or is shutting down) since a
+ * request was picked up
+ */
+int cancelled(omp_numa_t* handle, unsigned gen)
+{
+	return __atomic_load_n(&handle->migrate_gen, __ATOMIC_ACQUIRE) != gen;
+}
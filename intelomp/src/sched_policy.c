@@ -0,0 +1,632 @@
+/*
+ * Mapping policies - decide how many tasks each OpenMP application gets &
+ * onto which NUMA nodes they are mapped.
+ *
+ * A process uses the policy named by OMP_NUMA_POLICY if set, otherwise the
+ * policy pushed into shared memory by the shepherd (equal-share by default).
+ * To add a policy, implement its hooks & add it to the registry at the bottom
+ * of this file.
+ */
+
+#include "sched_comm_internal.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal definitions
+///////////////////////////////////////////////////////////////////////////////
+
+/* Node selection passes for map_tasks_to_nodes() */
+#define PASS_PREV_EMPTY 0 // Empty nodes on which we've previously executed
+#define PASS_PREV 1 // Unfilled nodes on which we've previously executed
+#define PASS_EMPTY 2 // Empty nodes
+#define PASS_UNFILLED 3 // Unfilled nodes
+
+///////////////////////////////////////////////////////////////////////////////
+// Prototypes for internal functions
+///////////////////////////////////////////////////////////////////////////////
+
+static int numa_aware_mapping(omp_numa_t* handle);
+static unsigned class_share(omp_numa_t* handle,
+														unsigned stake,
+														unsigned total_stake,
+														unsigned critical_stake);
+static unsigned distance(omp_numa_t* handle, numa_node_t a, numa_node_t b);
+static void add_distances(omp_numa_t* handle, unsigned* cost, numa_node_t node);
+static unsigned init_mapping(omp_numa_t* handle,
+														 exec_spec_t* spec,
+														 unsigned num_tasks,
+														 unsigned* local_task_count);
+static unsigned fill_node(exec_spec_t* spec,
+													unsigned* local_task_count,
+													numa_node_t node,
+													unsigned tasks_remaining);
+static void minimize_oversubscription(omp_numa_t* handle,
+																			exec_spec_t* spec,
+																			unsigned* local_task_count,
+																			unsigned tasks_remaining,
+																			int numa_aware);
+
+///////////////////////////////////////////////////////////////////////////////
+// Equal-share policy
+///////////////////////////////////////////////////////////////////////////////
+
+/* Give each application an equal number of processors, that is:
+ *
+ *   # processors / # OpenMP applications
+ *
+ * The calling application is about to be added to the counters, and is
+ * therefore included in the number of OpenMP applications.  Best-effort
+ * applications split what latency-critical ones hold among themselves (see
+ * class_share()).  The share is clamped to the mapping's bounds.
+ */
+static unsigned calc_num_tasks(omp_numa_t* handle, omp_numa_flags flags)
+{
+	return __omp_numa_bound_tasks(handle,
+		class_share(handle, 1, handle->shmem->num_omp_applications,
+								handle->shmem->critical_applications));
+}
+
+/* Assign the requested number of tasks to nodes - fill each node up with
+ * tasks, then spill over onto the next.
+ *
+ * "Filling up a node" refers to mapping as many tasks to a NUMA node as it
+ * has CPUs available to us (nodes may differ, e.g. because of offlined CPUs or
+ * cpusets, & memory-only nodes have none).  If it has fewer tasks than this,
+ * it is considered unfilled.
+ *
+ * The current algorithm maps tasks according to the following priority:
+ *
+ * 1. (NUMA-aware) Map tasks to nodes that are empty and on which we've
+ *    previously executed
+ * 2. (NUMA-aware) Map tasks to nodes that are unfilled and on which we've
+ *    previously executed
+ * 3. Map tasks to nodes that are empty
+ * 4. Map tasks to nodes that are unfilled
+ * 5. Map tasks to nodes that have the least number of tasks per CPU.
+ *    (NUMA-aware) if two nodes are equally lightly loaded, prefer the node
+ *    on which we've previously executed
+ *
+ * If memory residency is sampled (OMP_NUMA_RESIDENCY), the nodes holding a
+ * significant share of the application's memory stand in for the nodes on
+ * which we've previously executed, and nodes are additionally preferred by
+ * their expected distance to the application's memory.
+ *
+ * Within each of passes 1-4, the application spills over onto the node with
+ * the smallest total NUMA distance to the nodes already chosen for it (in
+ * both directions, as the SLIT may be asymmetric), so that multi-node
+ * applications don't straddle far-apart sockets.  Ties go to the
+ * lowest-numbered node.
+ */
+static numa_node_t next_node(omp_numa_t* handle,
+														 exec_spec_t* spec,
+														 unsigned* local_task_count,
+														 unsigned* cost,
+														 int pass)
+{
+	numa_node_t cur_node, chosen = -1;
+
+	for(cur_node = 0; cur_node < __num_nodes; cur_node++)
+	{
+		if(local_task_count[cur_node] >= NODE_NUM_CPUS(cur_node))
+			continue;
+		if((pass == PASS_PREV_EMPTY || pass == PASS_EMPTY) &&
+			 local_task_count[cur_node] != 0)
+			continue;
+		if((pass == PASS_PREV_EMPTY || pass == PASS_PREV) &&
+			 !__omp_numa_data_node(handle, cur_node))
+			continue;
+
+		if(chosen < 0 || cost[cur_node] < cost[chosen])
+			chosen = cur_node;
+	}
+
+	return chosen;
+}
+
+static void map_tasks_to_nodes(omp_numa_t* handle,
+															 exec_spec_t* spec,
+															 unsigned num_tasks,
+															 omp_numa_flags flags)
+{
+	unsigned local_task_count[MAX_NUM_NODES], cost[MAX_NUM_NODES];
+	unsigned tasks_remaining = init_mapping(handle, spec, num_tasks,
+																					local_task_count);
+	numa_node_t cur_node;
+	int numa_aware = numa_aware_mapping(handle), pass;
+
+	// If we know where our memory resides, start out preferring nodes close to
+	// it
+	for(cur_node = 0; cur_node < __num_nodes; cur_node++)
+		cost[cur_node] = handle->resident ? handle->mem_distance[cur_node] : 0;
+
+	// NUMA-aware passes attempt to schedule onto nodes on which we've
+	// previously executed, first empty ones & then ones that aren't full.  The
+	// regular passes do the same for any node.
+	for(pass = numa_aware ? PASS_PREV_EMPTY : PASS_EMPTY;
+			pass <= PASS_UNFILLED && tasks_remaining;
+			pass++)
+	{
+		while(tasks_remaining &&
+					(cur_node = next_node(handle, spec, local_task_count, cost, pass))
+						>= 0)
+		{
+			if(!spec->task_assignment[cur_node])
+				add_distances(handle, cost, cur_node);
+			tasks_remaining -= fill_node(spec, local_task_count, cur_node,
+																	 tasks_remaining);
+		}
+	}
+
+	minimize_oversubscription(handle, spec, local_task_count, tasks_remaining,
+														numa_aware);
+}
+
+static void equal_share_decide(omp_numa_t* handle,
+															 exec_spec_t* spec,
+															 omp_numa_flags flags)
+{
+	map_tasks_to_nodes(handle, spec, calc_num_tasks(handle, flags), flags);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Weighted-share policy
+///////////////////////////////////////////////////////////////////////////////
+
+/* Give each application a share of the processors proportional to its weight
+ * (OMP_NUMA_WEIGHT), that is:
+ *
+ *   # processors * weight / sum of all OpenMP applications' weights
+ */
+static void weighted_share_decide(omp_numa_t* handle,
+																	exec_spec_t* spec,
+																	omp_numa_flags flags)
+{
+	unsigned num_tasks = class_share(handle, handle->weight,
+																	 handle->shmem->total_weight,
+																	 handle->shmem->critical_weight);
+	map_tasks_to_nodes(handle, spec, __omp_numa_bound_tasks(handle, num_tasks),
+										 flags);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Distance-aware policy
+///////////////////////////////////////////////////////////////////////////////
+
+/* Equal share of processors, picking each node to minimize the total NUMA
+ * distance to the nodes already chosen (and, if NUMA-aware, to the nodes on
+ * which we've previously executed) regardless of how occupied it is.  Ties go
+ * to the node with the most free processors.
+ */
+static void distance_aware_decide(omp_numa_t* handle,
+																	exec_spec_t* spec,
+																	omp_numa_flags flags)
+{
+	unsigned local_task_count[MAX_NUM_NODES], cost[MAX_NUM_NODES];
+	unsigned tasks_remaining = init_mapping(handle, spec,
+																					calc_num_tasks(handle, flags),
+																					local_task_count);
+	numa_node_t cur_node, chosen;
+	int numa_aware = numa_aware_mapping(handle);
+
+	for(cur_node = 0; cur_node < __num_nodes; cur_node++)
+		cost[cur_node] = 0;
+	if(numa_aware)
+		for(cur_node = 0; cur_node < __num_nodes; cur_node++)
+			if(__omp_numa_data_node(handle, cur_node))
+				add_distances(handle, cost, cur_node);
+
+	while(tasks_remaining)
+	{
+		unsigned best_cost = UINT_MAX, best_free = 0;
+		chosen = -1;
+
+		for(cur_node = 0; cur_node < __num_nodes; cur_node++)
+		{
+			unsigned free_procs;
+
+			if(local_task_count[cur_node] >= NODE_NUM_CPUS(cur_node))
+				continue;
+
+			free_procs = NODE_NUM_CPUS(cur_node) - local_task_count[cur_node];
+			if(cost[cur_node] < best_cost ||
+				 (cost[cur_node] == best_cost && free_procs > best_free))
+			{
+				chosen = cur_node;
+				best_cost = cost[cur_node];
+				best_free = free_procs;
+			}
+		}
+
+		if(chosen < 0)
+			break;
+		if(!spec->task_assignment[chosen] &&
+			 !(numa_aware && __omp_numa_data_node(handle, chosen)))
+			add_distances(handle, cost, chosen);
+		tasks_remaining -= fill_node(spec, local_task_count, chosen,
+																 tasks_remaining);
+	}
+
+	minimize_oversubscription(handle, spec, local_task_count, tasks_remaining,
+														numa_aware);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Packing policy
+///////////////////////////////////////////////////////////////////////////////
+
+/* Equal share of processors, packed onto as few nodes as possible - fill the
+ * most-occupied unfilled node first, so that empty nodes stay empty for
+ * applications that need whole nodes.  If NUMA-aware, prefer nodes on which
+ * we've previously executed among equally-occupied nodes.
+ */
+static void packing_decide(omp_numa_t* handle,
+													 exec_spec_t* spec,
+													 omp_numa_flags flags)
+{
+	unsigned local_task_count[MAX_NUM_NODES];
+	unsigned tasks_remaining = init_mapping(handle, spec,
+																					calc_num_tasks(handle, flags),
+																					local_task_count);
+	numa_node_t cur_node, chosen;
+	int numa_aware = numa_aware_mapping(handle);
+
+	while(tasks_remaining)
+	{
+		chosen = -1;
+		for(cur_node = 0; cur_node < __num_nodes; cur_node++)
+		{
+			if(local_task_count[cur_node] >= NODE_NUM_CPUS(cur_node))
+				continue;
+
+			if(chosen < 0 ||
+				 local_task_count[cur_node] > local_task_count[chosen] ||
+				 (numa_aware &&
+					local_task_count[cur_node] == local_task_count[chosen] &&
+					__omp_numa_data_node(handle, cur_node) &&
+					!__omp_numa_data_node(handle, chosen)))
+				chosen = cur_node;
+		}
+
+		if(chosen < 0)
+			break;
+		tasks_remaining -= fill_node(spec, local_task_count, chosen,
+																 tasks_remaining);
+	}
+
+	minimize_oversubscription(handle, spec, local_task_count, tasks_remaining,
+														numa_aware);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Feedback policy
+///////////////////////////////////////////////////////////////////////////////
+
+/* Hand out processors one at a time to whichever application gains the most
+ * speedup from one more thread, according to the speedup curves published by
+ * each application (see sched_feedback.c).  Every application gets at least
+ * one thread.  As speedup curves are concave, this maximizes the total speedup
+ * of all co-running applications.  Applications without a measured curve are
+ * assumed to scale perfectly - if no application has a curve, this reduces to
+ * an equal share.  Ties go to the application with fewer threads.
+ */
+static void feedback_decide(omp_numa_t* handle,
+														exec_spec_t* spec,
+														omp_numa_flags flags)
+{
+	unsigned serial[MAX_NUM_APPS + 1], num_tasks[MAX_NUM_APPS + 1];
+	unsigned num_apps = 0, i, me, remaining;
+
+	// Gather the curves of all other mapped applications, then our own
+	for(i = 0; i < MAX_NUM_APPS; i++)
+	{
+		omp_numa_app* app = &handle->shmem->apps[i];
+		if(app == handle->app || app->pid <= 0 || !app->active)
+			continue;
+		serial[num_apps++] = app->profiled ? app->serial_milli : 0;
+	}
+	me = num_apps++;
+	serial[me] = (handle->app && handle->app->profiled) ?
+							 handle->app->serial_milli : 0;
+
+	for(i = 0; i < num_apps; i++)
+		num_tasks[i] = 1;
+	remaining = __num_procs > num_apps ? __num_procs - num_apps : 0;
+
+	while(remaining--)
+	{
+		unsigned best = 0;
+		double best_gain = -1.0, gain;
+		for(i = 0; i < num_apps; i++)
+		{
+			gain = __omp_numa_speedup(serial[i], num_tasks[i] + 1) -
+						 __omp_numa_speedup(serial[i], num_tasks[i]);
+			if(gain > best_gain + 1e-9 ||
+				 (gain > best_gain - 1e-9 && num_tasks[i] < num_tasks[best]))
+			{
+				best = i;
+				best_gain = gain;
+			}
+		}
+		num_tasks[best]++;
+	}
+
+	map_tasks_to_nodes(handle, spec, __omp_numa_bound_tasks(handle, num_tasks[me]),
+										 flags);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Central policy
+///////////////////////////////////////////////////////////////////////////////
+
+/* Adopt the allotment published by the central scheduler (see
+ * sched_central.c).  Until the shepherd has scheduled us, fall back to an
+ * equal share.  The central scheduler only knows our maximum, if the
+ * allotment is outside the mapping's bounds map the clamped number of tasks.
+ */
+static void central_decide(omp_numa_t* handle,
+													 exec_spec_t* spec,
+													 omp_numa_flags flags)
+{
+	unsigned num_tasks;
+
+	if(!__omp_numa_adopt_allotment(handle, spec))
+		equal_share_decide(handle, spec, flags);
+	else if((num_tasks = __omp_numa_bound_tasks(handle, spec->num_tasks)) !=
+					spec->num_tasks)
+		map_tasks_to_nodes(handle, spec, num_tasks, flags);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Policy registry
+///////////////////////////////////////////////////////////////////////////////
+
+/* Available policies - the first one is the default */
+static const omp_numa_policy_t __policies[] = {
+	{ "equal-share", NULL, equal_share_decide, NULL },
+	{ "weighted-share", NULL, weighted_share_decide, NULL },
+	{ "distance-aware", NULL, distance_aware_decide, NULL },
+	{ "packing", NULL, packing_decide, NULL },
+	{ "feedback", NULL, feedback_decide, NULL },
+	{ "central", NULL, central_decide, NULL },
+};
+
+#define NUM_POLICIES (sizeof(__policies) / sizeof(__policies[0]))
+
+int __omp_numa_find_policy(const char* name)
+{
+	unsigned i;
+	for(i = 0; i < NUM_POLICIES; i++)
+		if(!strcmp(__policies[i].name, name))
+			return i;
+	return -1;
+}
+
+const omp_numa_policy_t* __omp_numa_get_policy(unsigned idx)
+{
+	return idx < NUM_POLICIES ? &__policies[idx] : &__policies[0];
+}
+
+const omp_numa_policy_t* __omp_numa_active_policy(omp_numa_t* handle)
+{
+	const omp_numa_policy_t* policy = handle->env_policy;
+
+	if(!policy)
+		policy = __omp_numa_get_policy(__atomic_load_n(&handle->shmem->policy,
+																									 __ATOMIC_RELAXED));
+
+	if(policy != handle->policy)
+	{
+		OMP_NUMA_DEBUG("switching to %s mapping policy\n", policy->name);
+		if(policy->init)
+			policy->init(handle);
+		handle->policy = policy;
+	}
+
+	return policy;
+}
+
+int __omp_numa_central_active(omp_numa_t* handle)
+{
+	return __omp_numa_active_policy(handle)->decide == central_decide;
+}
+
+int omp_numa_set_policy(omp_numa_t* handle, const char* name)
+{
+	int idx = __omp_numa_find_policy(name);
+	if(idx < 0)
+		return -1;
+
+	OMP_NUMA_DEBUG("pushing %s mapping policy\n", name);
+	__atomic_store_n(&handle->shmem->policy, (unsigned)idx, __ATOMIC_RELAXED);
+	return 0;
+}
+
+const char* omp_numa_policy_name(omp_numa_t* handle)
+{
+	if(handle->env_policy)
+		return handle->env_policy->name;
+	return __omp_numa_get_policy(__atomic_load_n(&handle->shmem->policy,
+																							 __ATOMIC_RELAXED))->name;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Miscellaneous helpers
+///////////////////////////////////////////////////////////////////////////////
+
+/* Clamp a number of tasks to [min, max] of the mapping's bounds.  Tasks
+ * beyond the preferred number are only granted from processors nobody else
+ * has reserved, the rest are left to other applications.
+ */
+unsigned __omp_numa_bound_tasks(omp_numa_t* handle, unsigned num_tasks)
+{
+	omp_numa_shmem* shmem = handle->shmem;
+	unsigned idle;
+
+	if(handle->bound_pref && num_tasks > handle->bound_pref)
+	{
+		idle = __num_procs > shmem->num_omp_tasks ?
+					 __num_procs - shmem->num_omp_tasks : 0;
+		num_tasks = MAX(handle->bound_pref, MIN(num_tasks, idle));
+	}
+	if(handle->bound_max && num_tasks > handle->bound_max)
+		num_tasks = handle->bound_max;
+	return MAX(num_tasks, handle->bound_min);
+}
+
+/* Share of the processors for an application with the given stake (1 for an
+ * equal share, or its weight) given the stakes of all mapped applications &
+ * of the latency-critical ones, that is:
+ *
+ *   latency-critical: # processors * stake / (all stakes + stake)
+ *   best-effort: (# processors - latency-critical tasks) * stake /
+ *                (best-effort stakes + stake)
+ *
+ * Latency-critical applications are entitled to their share even if
+ * best-effort applications currently hold the processors, best-effort ones
+ * make do with what's left.  Every application gets at least one processor.
+ */
+unsigned class_share(omp_numa_t* handle,
+										 unsigned stake,
+										 unsigned total_stake,
+										 unsigned critical_stake)
+{
+	unsigned procs = __num_procs;
+
+	if(handle->qos_class != OMP_NUMA_LATENCY_CRITICAL)
+	{
+		procs -= MIN(handle->shmem->critical_tasks, procs);
+		total_stake -= MIN(critical_stake, total_stake);
+	}
+	return MAX(ceil((double)procs * (double)stake /
+									(double)(total_stake + stake)), 1);
+}
+
+/* Check to see if NUMA-aware mapping is enabled (implied by sampling memory
+ * residency)
+ */
+int numa_aware_mapping(omp_numa_t* handle)
+{
+	if(handle->residency_ns)
+		return 1;
+	if(getenv(OMP_NUMA_AWARE_MAPPING) &&
+		 !strcmp(getenv(OMP_NUMA_AWARE_MAPPING), "1"))
+	{
+		OMP_NUMA_DEBUG("NUMA-aware mapping is enabled\n");
+		return 1;
+	}
+	return 0;
+}
+
+/* NUMA distance between two nodes in both directions */
+unsigned distance(omp_numa_t* handle, numa_node_t a, numa_node_t b)
+{
+	return *shmem_distance(handle->shmem, a, b) +
+				 *shmem_distance(handle->shmem, b, a);
+}
+
+/* Add the distances to a newly-chosen node to every node's cost */
+void add_distances(omp_numa_t* handle, unsigned* cost, numa_node_t node)
+{
+	numa_node_t cur_node;
+	for(cur_node = 0; cur_node < __num_nodes; cur_node++)
+		cost[cur_node] += distance(handle, cur_node, node);
+}
+
+/* Initialize local copy of current task assignment & spec task assignment.
+ * Returns the number of tasks remaining to be mapped.
+ */
+unsigned init_mapping(omp_numa_t* handle,
+											exec_spec_t* spec,
+											unsigned num_tasks,
+											unsigned* local_task_count)
+{
+	numa_node_t cur_node;
+
+	// Latency-critical applications map as if best-effort ones weren't there
+	spec->num_tasks = num_tasks;
+	for(cur_node = 0; cur_node < __num_nodes; cur_node++)
+	{
+		omp_numa_node* counters = shmem_node(handle->shmem, cur_node);
+		spec->task_assignment[cur_node] = 0;
+		local_task_count[cur_node] =
+			handle->qos_class == OMP_NUMA_LATENCY_CRITICAL ?
+			counters->critical_task_count : counters->task_count;
+	}
+
+	return num_tasks;
+}
+
+/* Map as many of the remaining tasks as fit onto a node without filling it
+ * beyond its number of CPUs.  Returns the number of tasks mapped.
+ */
+unsigned fill_node(exec_spec_t* spec,
+									 unsigned* local_task_count,
+									 numa_node_t node,
+									 unsigned tasks_remaining)
+{
+	unsigned task_chunk, capacity = NODE_NUM_CPUS(node);
+
+	if(local_task_count[node] >= capacity)
+		return 0;
+
+	task_chunk = MIN(tasks_remaining, capacity - local_task_count[node]);
+	spec->task_assignment[node] += task_chunk;
+	local_task_count[node] += task_chunk;
+	return task_chunk;
+}
+
+/* Last pass - map remaining tasks onto nodes to minimize oversubscription,
+ * i.e. the number of tasks per CPU.  Nodes without CPUs are skipped.
+ */
+void minimize_oversubscription(omp_numa_t* handle,
+															 exec_spec_t* spec,
+															 unsigned* local_task_count,
+															 unsigned tasks_remaining,
+															 int numa_aware)
+{
+	numa_node_t cur_node;
+	unsigned task_chunk, capacity;
+
+	while(tasks_remaining)
+	{
+		numa_node_t cur_smallest = -1;
+		unsigned long long load, smallest_load;
+
+		// Find node with smallest # tasks per CPU, or if we're NUMA-aware, a node
+		// with an equally small # tasks per CPU but was a previous execution node
+		for(cur_node = 0; cur_node < __num_nodes; cur_node++)
+		{
+			if(!NODE_NUM_CPUS(cur_node))
+				continue;
+			if(cur_smallest < 0)
+			{
+				cur_smallest = cur_node;
+				continue;
+			}
+
+			load = (unsigned long long)local_task_count[cur_node] *
+						 NODE_NUM_CPUS(cur_smallest);
+			smallest_load = (unsigned long long)local_task_count[cur_smallest] *
+											NODE_NUM_CPUS(cur_node);
+			if(load < smallest_load ||
+				 (numa_aware && load == smallest_load &&
+					__omp_numa_data_node(handle, cur_node)))
+				cur_smallest = cur_node;
+		}
+
+		// No CPUs anywhere (shouldn't happen), put everything on the first node
+		if(cur_smallest < 0)
+		{
+			spec->task_assignment[0] += tasks_remaining;
+			local_task_count[0] += tasks_remaining;
+			break;
+		}
+
+		// Schedule tasks to fill up node to next multiple of its # CPUs
+		capacity = NODE_NUM_CPUS(cur_smallest);
+		task_chunk = MIN(tasks_remaining,
+			capacity - (local_task_count[cur_smallest] % capacity));
+		spec->task_assignment[cur_smallest] += task_chunk;
+		local_task_count[cur_smallest] += task_chunk;
+		tasks_remaining -= task_chunk;
+	}
+}
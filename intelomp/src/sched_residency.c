@@ -0,0 +1,80 @@
+/*
+ * Memory residency - samples on which nodes the application's memory actually
+ * resides, so that NUMA-aware mapping places threads near their data rather
+ * than near wherever they executed in the previous parallel region (which is
+ * wrong after the kernel migrates pages, or when the data was first touched
+ * elsewhere).
+ *
+ * Residency is read from /proc/self/numa_maps, which is far too expensive to
+ * do while mapping a parallel region.  The helper thread (see
+ * sched_migrate.c) samples it every OMP_NUMA_RESIDENCY milliseconds & after
+ * migrating pages, & publishes the per-node resident memory.  Mapping only
+ * picks up the latest published sample.
+ */
+
+#include "sched_comm_internal.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Residency sampling
+///////////////////////////////////////////////////////////////////////////////
+
+void __omp_numa_sample_residency(omp_numa_t* handle)
+{
+	unsigned long long kb[MAX_NUM_NODES];
+
+	// Without a sample, mapping falls back to the previous execution setup
+	if(numa_resident_memory(kb, __num_nodes))
+	{
+		WARN("could not sample memory residency\n");
+		memset(kb, 0, sizeof(kb));
+	}
+
+	pthread_mutex_lock(&handle->migrate_lock);
+	memcpy(handle->resident_kb, kb, sizeof(kb[0]) * __num_nodes);
+	__atomic_add_fetch(&handle->residency_gen, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&handle->migrate_lock);
+}
+
+void __omp_numa_adopt_residency(omp_numa_t* handle)
+{
+	unsigned long long kb[MAX_NUM_NODES], total = 0, weighted;
+	numa_node_t node, other;
+
+	if(!handle->migrate_started ||
+		 __atomic_load_n(&handle->residency_gen, __ATOMIC_ACQUIRE) ==
+			handle->residency_used_gen)
+		return;
+
+	pthread_mutex_lock(&handle->migrate_lock);
+	handle->residency_used_gen = handle->residency_gen;
+	memcpy(kb, handle->resident_kb, sizeof(kb[0]) * __num_nodes);
+	pthread_mutex_unlock(&handle->migrate_lock);
+
+	for(node = 0; node < __num_nodes; node++)
+		total += kb[node];
+
+	// Nothing resident yet - fall back to the previous execution setup
+	if(!total)
+	{
+		handle->resident = 0;
+		return;
+	}
+
+	// Find the nodes holding our data & the expected distance from each node to
+	// our memory, i.e. the distance to every node weighted by the share of our
+	// memory it holds
+	for(node = 0; node < __num_nodes; node++)
+	{
+		handle->data_node[node] = kb[node] * RESIDENCY_MIN_SHARE >= total;
+
+		weighted = 0;
+		for(other = 0; other < __num_nodes; other++)
+			weighted += kb[other] * *shmem_distance(handle->shmem, node, other);
+		handle->mem_distance[node] = (unsigned)(weighted / total);
+
+		OMP_NUMA_DEBUG("node %d: %llu kB resident, expected distance %u\n",
+			node, kb[node], handle->mem_distance[node]);
+	}
+
+	handle->resident = 1;
+}
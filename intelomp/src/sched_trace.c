@@ -0,0 +1,154 @@
+/*
+ * Tracing of mapping decisions - every parallel region appends a fixed-size
+ * binary record (when it ended, how long it took, its call site, how many
+ * threads were requested & the granted execution setup) to a ring buffer in
+ * its application's slot in shared memory.  The shepherd periodically drains
+ * all rings into a compact trace file.
+ *
+ * Each ring has a single producer & a single consumer (the shepherd), so the
+ * ring itself needs no lock shared between processes.  The application's
+ * threads (e.g. several OpenMP root threads) take the handle's trace lock to
+ * act as that single producer, which doesn't contend with negotiating
+ * mappings.  Recording a region is a few stores into shared memory; if the
+ * shepherd falls behind, records are dropped (& counted) rather than stalling
+ * the application.
+ */
+
+#include "sched_comm_internal.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Prototypes for internal functions
+///////////////////////////////////////////////////////////////////////////////
+
+static int write_records(omp_numa_shmem* shmem,
+												 omp_numa_trace_ring* ring,
+												 unsigned from,
+												 unsigned to,
+												 FILE* fp);
+
+///////////////////////////////////////////////////////////////////////////////
+// Applications
+///////////////////////////////////////////////////////////////////////////////
+
+void omp_numa_trace_region(omp_numa_t* handle,
+													 const void* site,
+													 unsigned requested,
+													 const exec_spec_t* spec,
+													 unsigned long long duration_ns)
+{
+	omp_numa_shmem* shmem = handle->shmem;
+	omp_numa_trace_ring* ring;
+	omp_numa_trace_rec* rec;
+	unsigned head, words = shmem->hdr.num_cpus / CPU_MASK_BITS;
+	unsigned* assignment;
+	numa_node_t node;
+
+	if(!handle->trace || !handle->app)
+		return;
+
+	// We're the only producer, only the shepherd moves the tail
+	pthread_mutex_lock(&handle->trace_lock);
+	ring = app_trace_ring(shmem, handle->app);
+	head = ring->head;
+	if(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= TRACE_RECORDS)
+	{
+		__atomic_store_n(&ring->drops, ring->drops + 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&handle->trace_lock);
+		return;
+	}
+
+	rec = trace_record(shmem, ring, head);
+	rec->end_ns = omp_numa_time_ns();
+	rec->duration_ns = duration_ns;
+	rec->site = (unsigned long long)(unsigned long)site;
+	rec->pid = handle->app->pid;
+	rec->requested = requested;
+	rec->num_tasks = spec->num_tasks;
+	rec->pad = 0;
+
+	// Records are sized to the shepherd's topology, which may be larger
+	assignment = (unsigned*)(rec + 1);
+	for(node = 0; node < (numa_node_t)shmem->hdr.num_nodes; node++)
+		assignment[node] = node < __num_nodes ? spec->task_assignment[node] : 0;
+	memset(assignment + shmem->hdr.num_nodes, 0, words * sizeof(unsigned long));
+	memcpy(assignment + shmem->hdr.num_nodes, spec->cpus,
+		MIN(words, __num_cpu_words) * sizeof(unsigned long));
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&handle->trace_lock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Shepherd
+///////////////////////////////////////////////////////////////////////////////
+
+int omp_numa_drain_trace(omp_numa_t* handle, FILE* fp, unsigned* dropped)
+{
+	omp_numa_shmem* shmem = handle->shmem;
+	omp_numa_trace_ring* ring;
+	omp_numa_trace_file file;
+	unsigned head, tail, drops, total_dropped = 0;
+	int written = 0, i;
+
+	if(!ftell(fp))
+	{
+		file.magic = TRACE_MAGIC;
+		file.version = TRACE_VERSION;
+		file.num_nodes = shmem->hdr.num_nodes;
+		file.num_cpus = shmem->hdr.num_cpus;
+		file.record_size = shmem->hdr.trace_record_size;
+		file.pad = 0;
+		if(fwrite(&file, sizeof(file), 1, fp) != 1)
+			return -1;
+	}
+
+	// Rings outlive their owners, so drain every slot
+	for(i = 0; i < MAX_NUM_APPS; i++)
+	{
+		ring = app_trace_ring(shmem, &shmem->apps[i]);
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		tail = ring->tail;
+
+		drops = __atomic_load_n(&ring->drops, __ATOMIC_RELAXED);
+		total_dropped += drops - handle->trace_drops[i];
+		handle->trace_drops[i] = drops;
+
+		if(head == tail)
+			continue;
+		if(write_records(shmem, ring, tail, head, fp))
+			return -1;
+		written += head - tail;
+		__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+	}
+
+	if(dropped)
+		*dropped = total_dropped;
+	fflush(fp);
+	return written;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Miscellaneous helpers
+///////////////////////////////////////////////////////////////////////////////
+
+/* Write a ring's records [from, to) to the trace file, in at most two
+ * contiguous chunks
+ */
+int write_records(omp_numa_shmem* shmem,
+									omp_numa_trace_ring* ring,
+									unsigned from,
+									unsigned to,
+									FILE* fp)
+{
+	size_t size = shmem->hdr.trace_record_size;
+	unsigned chunk;
+
+	while(from != to)
+	{
+		chunk = MIN(to - from, TRACE_RECORDS - from % TRACE_RECORDS);
+		if(fwrite(trace_record(shmem, ring, from), size, chunk, fp) != chunk)
+			return -1;
+		from += chunk;
+	}
+	return 0;
+}
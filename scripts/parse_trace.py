@@ -0,0 +1,136 @@
+#!/usr/bin/python3
+
+import sys,struct
+
+###############################################################################
+## Config
+###############################################################################
+
+traceFile = "n/a"
+statsFile = "trace.csv"
+summarize = False
+
+# Trace file format, see omp_numa_trace_file & omp_numa_trace_rec in
+# intelomp/src/sched_comm_internal.h
+traceMagic = 0x544d504f
+traceVersion = 1
+fileHeader = struct.Struct("<IIIIII")
+recordHeader = struct.Struct("<QQQiIII")
+
+###############################################################################
+## Helpers
+###############################################################################
+
+def printHelp():
+	print("parse_trace.py - convert an OpenMP/NUMA shepherd trace file to CSV")
+	print()
+	print("Usage: ./parse_trace.py <trace file> [ OPTIONS ]")
+	print("Options:")
+	print("\t-h / --help : print help & exit")
+	print("\t-o <file>   : stats file (please use .csv suffix), default is " + statsFile)
+	print("\t-s          : print a per-application summary")
+	sys.exit(0)
+
+def parseArgs(args):
+	global traceFile
+	global statsFile
+	global summarize
+	skip = True
+	for i in range(len(args)):
+		if skip is True:
+			skip = False
+			continue
+		elif args[i] == "-h" or args[i] == "--help":
+			printHelp()
+		elif args[i] == "-o":
+			statsFile = args[i+1]
+			skip = True
+		elif args[i] == "-s":
+			summarize = True
+		else:
+			traceFile = args[i]
+	if traceFile == "n/a":
+		print("Please specify a trace file!")
+		printHelp()
+
+###############################################################################
+## Parsing & saving
+###############################################################################
+
+class Record:
+	def __init__(self, data, numNodes, numCpus):
+		fields = recordHeader.unpack_from(data, 0)
+		self.endNs = fields[0]
+		self.durationNs = fields[1]
+		self.site = fields[2]
+		self.pid = fields[3]
+		self.requested = fields[4]
+		self.numTasks = fields[5]
+
+		offset = recordHeader.size
+		self.assignment = struct.unpack_from("<" + str(numNodes) + "I", data, offset)
+		offset += numNodes * 4
+		mask = int.from_bytes(data[offset:offset + numCpus // 8], "little")
+		self.cpus = [ cpu for cpu in range(numCpus) if (mask >> cpu) & 1 ]
+
+	def taskAssignment(self):
+		# Same format as the old begin_python|task_assignment| lines
+		return "[" + ",".join([ "(" + str(node) + "," + str(tasks) + ")" \
+			for node, tasks in enumerate(self.assignment) if tasks != 0 ]) + "]"
+
+def parseTrace(fileName):
+	records = []
+	with open(fileName, "rb") as fp:
+		header = fp.read(fileHeader.size)
+		if len(header) < fileHeader.size:
+			print("Trace file is too short!")
+			sys.exit(1)
+		magic, version, numNodes, numCpus, recordSize, pad = fileHeader.unpack(header)
+		if magic != traceMagic or version != traceVersion:
+			print("Not a (supported) trace file!")
+			sys.exit(1)
+
+		while True:
+			data = fp.read(recordSize)
+			if len(data) < recordSize:
+				break
+			records.append(Record(data, numNodes, numCpus))
+	records.sort(key=lambda record: record.endNs)
+	return records
+
+def saveResults(records, outF):
+	stats = open(outF, "w")
+	stats.write("pid,site,start_ns,duration_ns,requested,num_tasks,task_assignment,cpus\n")
+	for record in records:
+		stats.write(str(record.pid) + "," + hex(record.site) + "," + \
+			str(record.endNs - record.durationNs) + "," + str(record.durationNs) + "," + \
+			str(record.requested) + "," + str(record.numTasks) + ",\"" + \
+			record.taskAssignment() + "\",\"" + \
+			" ".join([ str(cpu) for cpu in record.cpus ]) + "\"\n")
+	stats.close()
+
+def printSummary(records):
+	apps = {}
+	for record in records:
+		if record.pid not in apps.keys():
+			apps[record.pid] = []
+		apps[record.pid].append(record)
+
+	for pid in sorted(apps.keys()):
+		regions = apps[pid]
+		tasks = sum([ record.numTasks for record in regions ]) / len(regions)
+		requested = sum([ record.requested for record in regions ]) / len(regions)
+		busy = sum([ record.durationNs for record in regions ]) / 1e9
+		print(str(pid) + ": " + str(len(regions)) + " regions, " + \
+			"%.1f/%.1f tasks granted/requested on average, %.3f s in parallel regions" % \
+			(tasks, requested, busy))
+
+###############################################################################
+## Driver
+###############################################################################
+
+parseArgs(sys.argv)
+records = parseTrace(traceFile)
+saveResults(records, statsFile)
+if summarize:
+	printSummary(records)